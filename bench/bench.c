@@ -0,0 +1,529 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "calc.h"
+#include "flat.h"
+#include "vm.h"
+#include "arena.h"
+#include "parallel.h"
+#include "trace.h"
+#include "format.h"
+#include "perf_counters.h"
+
+#define BENCH_MIN_NS 200000000ULL  // Run each case for at least 0.2s
+
+typedef struct {
+    const char *name;
+    char *expression;
+    unsigned optimize;  // CalcOptFlags applied before timing
+} BenchCase;
+
+static uint64_t bench_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// "1 + 2 * 3 - 4 / 5 + ..." with `terms` operands
+static char *bench_chain(size_t terms) {
+    static const char ops[] = "+*-/";
+    char *buffer = malloc(terms * 8 + 1);
+    size_t length = 0;
+    for (size_t i = 0; i < terms; i++) {
+        if (i > 0) length += sprintf(buffer + length, " %c ", ops[i % 4]);
+        length += sprintf(buffer + length, "%zu", i % 9 + 1);
+    }
+    return buffer;
+}
+
+// "1.5 + 2.5 - 3.5 + ..." with `terms` operands
+static char *bench_sum(size_t terms) {
+    char *buffer = malloc(terms * 8 + 1);
+    size_t length = 0;
+    for (size_t i = 0; i < terms; i++) {
+        if (i > 0) length += sprintf(buffer + length, " %c ", i % 3 ? '+' : '-');
+        length += sprintf(buffer + length, "%zu.5", i % 9 + 1);
+    }
+    return buffer;
+}
+
+// Random balanced expression with `leaves` numbers
+static void bench_balanced_append(char *buffer, size_t *length, size_t leaves, unsigned *seed) {
+    static const char ops[] = "+-*+";
+    if (leaves == 1) {
+        *length += sprintf(buffer + *length, "%u", rand_r(seed) % 9 + 1);
+        return;
+    }
+    size_t left = leaves / 2;
+    buffer[(*length)++] = '(';
+    bench_balanced_append(buffer, length, left, seed);
+    *length += sprintf(buffer + *length, " %c ", ops[rand_r(seed) % 4]);
+    bench_balanced_append(buffer, length, leaves - left, seed);
+    buffer[(*length)++] = ')';
+}
+
+static char *bench_balanced(size_t leaves, unsigned seed) {
+    char *buffer = malloc(leaves * 8 + 1);
+    size_t length = 0;
+    bench_balanced_append(buffer, &length, leaves, &seed);
+    buffer[length] = '\0';
+    return buffer;
+}
+
+// "1 + (2 * (3 - (...)))" nested `depth` parentheses deep
+static char *bench_nested(size_t depth) {
+    static const char ops[] = "+*-/";
+    char *buffer = malloc(depth * 8 + 2);
+    size_t length = 0;
+    for (size_t i = 0; i < depth; i++) {
+        length += sprintf(buffer + length, "%zu %c (", i % 9 + 1, ops[i % 4]);
+    }
+    length += sprintf(buffer + length, "1");
+    memset(buffer + length, ')', depth);
+    buffer[length + depth] = '\0';
+    return buffer;
+}
+
+// Random split points and occasional unary minus, so the shape varies
+static void bench_random_append(char *buffer, size_t *length, size_t leaves, unsigned *seed) {
+    static const char ops[] = "+-*/";
+    if (rand_r(seed) % 8 == 0) buffer[(*length)++] = '-';
+    if (leaves == 1) {
+        *length += sprintf(buffer + *length, "%u.%u", rand_r(seed) % 100 + 1, rand_r(seed) % 10);
+        return;
+    }
+    size_t left = 1 + (size_t)rand_r(seed) % (leaves - 1);
+    buffer[(*length)++] = '(';
+    bench_random_append(buffer, length, left, seed);
+    *length += sprintf(buffer + *length, " %c ", ops[rand_r(seed) % 4]);
+    bench_random_append(buffer, length, leaves - left, seed);
+    buffer[(*length)++] = ')';
+}
+
+static char *bench_random(size_t leaves, unsigned seed) {
+    char *buffer = malloc(leaves * 16 + 1);
+    size_t length = 0;
+    bench_random_append(buffer, &length, leaves, &seed);
+    buffer[length] = '\0';
+    return buffer;
+}
+
+static volatile double bench_sink;
+
+static double bench_engine(CalcEngine engine, const char *expression, unsigned optimize) {
+    ASTNode *root = ast_optimize(ast_build(expression), optimize);
+    FlatAST *flat = engine == CALC_ENGINE_FLAT ? flat_from_ast(root) : NULL;
+    PostfixExpr *postfix = engine == CALC_ENGINE_POSTFIX && optimize == 0 ? ast_build_postfix(expression) : NULL;
+    VMProgram *stack = engine == CALC_ENGINE_STACK_VM ? vm_compile(root) : NULL;
+    RegProgram *registers = engine == CALC_ENGINE_REGISTER_VM ? reg_compile(root) : NULL;
+
+    uint64_t runs = 0;
+    uint64_t start = bench_now_ns();
+    uint64_t elapsed;
+    do {
+        for (int i = 0; i < 64; i++) {
+            switch (engine) {
+                case CALC_ENGINE_AST: bench_sink = ast_eval(root); break;
+                case CALC_ENGINE_FLAT: bench_sink = flat_eval(flat); break;
+                case CALC_ENGINE_POSTFIX: bench_sink = postfix ? postfix_eval(postfix) : 0; break;
+                case CALC_ENGINE_STACK_VM: bench_sink = vm_run(stack); break;
+                case CALC_ENGINE_REGISTER_VM: bench_sink = reg_run(registers); break;
+                default: break;
+            }
+        }
+        runs += 64;
+        elapsed = bench_now_ns() - start;
+    } while (elapsed < BENCH_MIN_NS);
+
+    reg_free(registers);
+    vm_free(stack);
+    postfix_free(postfix);
+    flat_free(flat);
+    ast_free(root);
+    return (double)elapsed / (double)runs;
+}
+
+static void bench_engines() {
+    BenchCase cases[] = {
+        {"short", strdup("2 * (3 + 4 * (5 - 2)) - 6"), 0},
+        {"chain-100", bench_chain(100), 0},
+        {"chain-10k", bench_chain(10000), 0},
+        {"sum-10k", bench_sum(10000), 0},
+        {"sum-10k-ra", bench_sum(10000), CALC_OPT_UNSAFE_REASSOCIATE},
+    };
+    size_t case_count = sizeof(cases) / sizeof(cases[0]);
+
+    printf("%-12s", "case");
+    for (int engine = 0; engine < CALC_ENGINE_COUNT; engine++) {
+        printf(" %12s", calc_engine_name((CalcEngine)engine));
+    }
+    printf("   (ns/eval)\n");
+
+    for (size_t i = 0; i < case_count; i++) {
+        printf("%-12s", cases[i].name);
+        for (int engine = 0; engine < CALC_ENGINE_COUNT; engine++) {
+            if (engine == CALC_ENGINE_POSTFIX && cases[i].optimize != 0) {
+                // Postfix code is emitted by the parser and skips optimization
+                printf(" %12s", "-");
+                continue;
+            }
+            printf(" %12.1f", bench_engine((CalcEngine)engine, cases[i].expression, cases[i].optimize));
+            fflush(stdout);
+        }
+        printf("\n");
+        free(cases[i].expression);
+    }
+}
+
+// Evaluates one large tree whose nodes come from malloc, an arena with
+// regular pages, or an arena backed by huge pages
+static void bench_arena_case(const char *label, const char *expression, size_t nodes, CalcArena *arena) {
+    if (arena != NULL) {
+        CalcAllocator allocator = arena_allocator(arena);
+        calc_set_allocator(&allocator);
+    }
+    ASTNode *root = ast_build(expression);
+
+    PerfCounter dtlb;
+    bool has_dtlb = perf_counter_open(&dtlb, PERF_EVENT_DTLB_MISSES);
+    uint64_t best = UINT64_MAX;
+    uint64_t misses = 0;
+    for (int run = 0; run < 5; run++) {
+        perf_counter_start(&dtlb);
+        uint64_t start = bench_now_ns();
+        bench_sink = ast_eval(root);
+        uint64_t elapsed = bench_now_ns() - start;
+        uint64_t run_misses = perf_counter_stop(&dtlb);
+        if (elapsed < best) {
+            best = elapsed;
+            misses = run_misses;
+        }
+    }
+    perf_counter_close(&dtlb);
+
+    printf("%-10s %-10s %10.2f", label, arena ? arena_backing_name(arena->backing) : "malloc", (double)best / (double)nodes);
+    if (has_dtlb) {
+        printf(" %14.4f\n", (double)misses / (double)nodes);
+    } else {
+        printf(" %14s\n", "n/a");
+    }
+
+    ast_free(root);
+    if (arena != NULL) {
+        calc_set_allocator(NULL);
+    } else {
+        calc_pool_trim();
+    }
+}
+
+static void bench_arena() {
+    const size_t leaves = 1 << 20;
+    const size_t nodes = 2 * leaves - 1;
+    const size_t arena_size = nodes * sizeof(ASTNode) * 2;
+    char *expression = bench_balanced(leaves, 42);
+
+    printf("%-10s %-10s %10s %14s\n", "tree", "backing", "ns/node", "dTLB miss/node");
+    bench_arena_case("malloc", expression, nodes, NULL);
+
+    CalcArena *pages = arena_create(arena_size, false);
+    bench_arena_case("arena", expression, nodes, pages);
+    arena_destroy(pages);
+
+    CalcArena *huge = arena_create(arena_size, true);
+    bench_arena_case("arena", expression, nodes, huge);
+    arena_destroy(huge);
+
+    free(expression);
+}
+
+static void bench_parallel() {
+    const size_t leaves = 1 << 21;
+    char *expression = bench_balanced(leaves, 7);
+    ASTNode *root = ast_build(expression);
+    free(expression);
+
+    printf("%-10s %12s %10s\n", "threads", "ms", "speedup");
+    uint64_t baseline = 0;
+    for (size_t threads = 1; threads <= 8; threads *= 2) {
+        ThreadPool *pool = thread_pool_create(threads);
+        uint64_t best = UINT64_MAX;
+        for (int run = 0; run < 5; run++) {
+            uint64_t start = bench_now_ns();
+            bench_sink = ast_eval_parallel(pool, root, PARALLEL_DEFAULT_GRAIN);
+            uint64_t elapsed = bench_now_ns() - start;
+            if (elapsed < best) best = elapsed;
+        }
+        thread_pool_destroy(pool);
+
+        if (threads == 1) baseline = best;
+        printf("%-10zu %12.2f %9.2fx\n", threads, (double)best / 1e6, (double)baseline / (double)best);
+    }
+
+    ast_free(root);
+    calc_pool_trim();
+
+    // Left-deep sums recurse in ast_free, so keep the parse case moderate
+    char *sum = bench_sum(100000);
+    printf("\n%-10s %12s %10s\n", "threads", "parse ms", "speedup");
+    for (size_t threads = 1; threads <= 8; threads *= 2) {
+        ThreadPool *pool = thread_pool_create(threads);
+        uint64_t best = UINT64_MAX;
+        for (int run = 0; run < 5; run++) {
+            uint64_t start = bench_now_ns();
+            ASTNode *parsed = ast_build_parallel(pool, sum, PARALLEL_PARSE_DEFAULT_GRAIN);
+            uint64_t elapsed = bench_now_ns() - start;
+            if (elapsed < best) best = elapsed;
+            ast_free(parsed);
+        }
+        thread_pool_destroy(pool);
+
+        if (threads == 1) baseline = best;
+        printf("%-10zu %12.2f %9.2fx\n", threads, (double)best / 1e6, (double)baseline / (double)best);
+    }
+    free(sum);
+    calc_pool_trim();
+}
+
+#define BENCH_FORMAT_VALUES 65536
+
+// ns per value to format doubles shaped like typical results, next to
+// evaluating a short expression
+static void bench_format() {
+    double *values = malloc(BENCH_FORMAT_VALUES * sizeof(double));
+    unsigned seed = 9;
+    for (size_t i = 0; i < BENCH_FORMAT_VALUES; i++) {
+        switch (i % 3) {
+            case 0: values[i] = rand_r(&seed) % 100000; break;                      // Integers
+            case 1: values[i] = (rand_r(&seed) % 100000) / 100.0; break;            // Two decimals
+            default: values[i] = (double)rand_r(&seed) / (rand_r(&seed) + 1.0); break;  // Full precision
+        }
+    }
+
+    static const char *labels[] = {"calc_format_double", "snprintf %.17g", "CalcWriter to /dev/null", "eval (short)"};
+    FILE *null = fopen("/dev/null", "w");
+    CalcWriter *writer = malloc(sizeof(CalcWriter));
+    char text[CALC_FORMAT_DOUBLE_MAX];
+
+    printf("%-26s %12s\n", "format", "ns/value");
+    for (int mode = 0; mode < 4; mode++) {
+        uint64_t runs = 0;
+        uint64_t start = bench_now_ns();
+        uint64_t elapsed;
+        calc_writer_init(writer, null);
+        do {
+            for (size_t i = 0; i < BENCH_FORMAT_VALUES; i++) {
+                switch (mode) {
+                    case 0: bench_sink += (double)calc_format_double(values[i], text); break;
+                    case 1: bench_sink += snprintf(text, sizeof(text), "%.17g", values[i]); break;
+                    case 2: calc_writer_double(writer, values[i], '\n'); break;
+                    default: bench_sink += eval("2 * (3 + 4 * (5 - 2)) - 6"); break;
+                }
+            }
+            runs += BENCH_FORMAT_VALUES;
+            elapsed = bench_now_ns() - start;
+        } while (elapsed < BENCH_MIN_NS);
+        calc_writer_flush(writer);
+        printf("%-26s %12.1f\n", labels[mode], (double)elapsed / (double)runs);
+    }
+
+    free(writer);
+    fclose(null);
+    free(values);
+}
+
+typedef enum {
+    PHASE_LEX, PHASE_PARSE, PHASE_EVAL, PHASE_STAGES, PHASE_END_TO_END, PHASE_COUNT
+} BenchPhase;
+
+static const char *bench_phase_names[] = {"lex", "parse", "ast_eval", "stages", "eval"};
+
+#define BENCH_PARSE_BATCH 16
+
+// Average ns for one run of `phase` over `expression`. With `counters`,
+// only the timed work is counted and `*runs` receives the run count; the
+// counter syscalls then inflate the time, so measure it separately.
+static double bench_phase(BenchPhase phase, const char *expression, PerfCounterSet *counters, uint64_t *run_count) {
+    ASTNode *root = phase == PHASE_EVAL ? ast_build(expression) : NULL;
+    ASTNode *batch[BENCH_PARSE_BATCH];
+    ASTNodeList *stages = NULL;
+    uint64_t runs = 0;
+    uint64_t elapsed = 0;
+
+    do {
+        uint64_t start = bench_now_ns();
+        if (counters) perf_set_resume(counters);
+        switch (phase) {
+            case PHASE_LEX:
+                bench_sink = (double)ast_count_tokens(expression);
+                runs++;
+                break;
+            case PHASE_PARSE:
+                for (int i = 0; i < BENCH_PARSE_BATCH; i++) batch[i] = ast_build(expression);
+                runs += BENCH_PARSE_BATCH;
+                break;
+            case PHASE_EVAL:
+                bench_sink = ast_eval(root);
+                runs++;
+                break;
+            case PHASE_STAGES:
+                stages = ast_build_stages(expression);
+                runs++;
+                break;
+            case PHASE_END_TO_END:
+                bench_sink = eval(expression);
+                runs++;
+                break;
+            default:
+                break;
+        }
+        if (counters) perf_set_pause(counters);
+        elapsed += bench_now_ns() - start;
+
+        // Frees stay outside the measured region
+        if (phase == PHASE_PARSE) {
+            for (int i = 0; i < BENCH_PARSE_BATCH; i++) ast_free(batch[i]);
+        } else if (phase == PHASE_STAGES) {
+            nodelist_free(stages);
+        }
+    } while (elapsed < BENCH_MIN_NS);
+
+    ast_free(root);
+    if (run_count) *run_count = runs;
+    return (double)elapsed / (double)runs;
+}
+
+// Hardware events reported per token, after IPC
+static const PerfEvent bench_miss_events[] = {
+    PERF_EVENT_BRANCH_MISSES, PERF_EVENT_L1D_MISSES, PERF_EVENT_LLC_MISSES, PERF_EVENT_DTLB_MISSES
+};
+#define BENCH_MISS_EVENT_COUNT (sizeof(bench_miss_events) / sizeof(bench_miss_events[0]))
+
+static void bench_suite(bool json, bool with_counters) {
+    BenchCase cases[] = {
+        {"short", strdup("2 * (3 + 4 * (5 - 2)) - 6"), 0},
+        {"flat-10k", bench_sum(10000), 0},
+        {"nested-500", bench_nested(500), 0},
+        {"random-100", bench_random(100, 1), 0},
+        {"random-10k", bench_random(10000, 2), 0},
+    };
+    size_t case_count = sizeof(cases) / sizeof(cases[0]);
+    bool first = true;
+
+    PerfCounterSet counters;
+    if (with_counters && !perf_set_open(&counters)) {
+        fprintf(stderr, "Hardware counters unavailable (check perf_event_paranoid)\n");
+        perf_set_close(&counters);
+        with_counters = false;
+    }
+    bool has_ipc = with_counters && perf_set_has(&counters, PERF_EVENT_CYCLES) && perf_set_has(&counters, PERF_EVENT_INSTRUCTIONS);
+
+    if (json) {
+        printf("[\n");
+    } else {
+        printf("%-12s %-10s %10s %12s %14s", "case", "phase", "tokens", "ns/token", "ops/sec");
+        if (with_counters) {
+            printf(" %6s", "IPC");
+            for (size_t e = 0; e < BENCH_MISS_EVENT_COUNT; e++) printf(" %14s", perf_event_name(bench_miss_events[e]));
+            printf("   (misses/token)");
+        }
+        printf("\n");
+    }
+    for (size_t i = 0; i < case_count; i++) {
+        size_t tokens = ast_count_tokens(cases[i].expression);
+        for (int phase = 0; phase < PHASE_COUNT; phase++) {
+            double ns = bench_phase((BenchPhase)phase, cases[i].expression, NULL, NULL);
+            double ns_per_token = ns / (double)tokens;
+            double ops_per_sec = 1e9 / ns;
+
+            uint64_t runs = 1;
+            if (with_counters) {
+                perf_set_reset(&counters);
+                bench_phase((BenchPhase)phase, cases[i].expression, &counters, &runs);
+            }
+            double ipc = has_ipc ? (double)perf_set_value(&counters, PERF_EVENT_INSTRUCTIONS) /
+                (double)perf_set_value(&counters, PERF_EVENT_CYCLES) : 0;
+
+            if (json) {
+                printf("%s  {\"case\": \"%s\", \"phase\": \"%s\", \"tokens\": %zu, \"ns_per_token\": %.3f, \"ops_per_sec\": %.1f",
+                    first ? "" : ",\n", cases[i].name, bench_phase_names[phase], tokens, ns_per_token, ops_per_sec);
+                if (has_ipc) printf(", \"ipc\": %.3f", ipc);
+                for (size_t e = 0; with_counters && e < BENCH_MISS_EVENT_COUNT; e++) {
+                    if (!perf_set_has(&counters, bench_miss_events[e])) continue;
+                    double per_token = (double)perf_set_value(&counters, bench_miss_events[e]) / (double)runs / (double)tokens;
+                    printf(", \"%s_per_token\": %.5f", perf_event_name(bench_miss_events[e]), per_token);
+                }
+                printf("}");
+                first = false;
+            } else {
+                printf("%-12s %-10s %10zu %12.2f %14.1f", cases[i].name, bench_phase_names[phase], tokens, ns_per_token, ops_per_sec);
+                if (with_counters) {
+                    if (has_ipc) {
+                        printf(" %6.2f", ipc);
+                    } else {
+                        printf(" %6s", "n/a");
+                    }
+                    for (size_t e = 0; e < BENCH_MISS_EVENT_COUNT; e++) {
+                        if (perf_set_has(&counters, bench_miss_events[e])) {
+                            printf(" %14.4f", (double)perf_set_value(&counters, bench_miss_events[e]) / (double)runs / (double)tokens);
+                        } else {
+                            printf(" %14s", "n/a");
+                        }
+                    }
+                }
+                printf("\n");
+            }
+            fflush(stdout);
+        }
+        free(cases[i].expression);
+    }
+    if (json) printf("\n]\n");
+    if (with_counters) perf_set_close(&counters);
+}
+
+int main(int argc, char **argv) {
+    const char *only = NULL;
+    bool json = false;
+    bool counters = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else if (strcmp(argv[i], "--counters") == 0) {
+            counters = true;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            // Written at exit; best with one section, as every run is a span
+            calc_trace_start(argv[++i]);
+        } else {
+            only = argv[i];
+        }
+    }
+
+    // JSON output covers the suite only, so it stays machine-readable
+    if (json) {
+        bench_suite(true, counters);
+        return 0;
+    }
+
+    if (only == NULL || strcmp(only, "suite") == 0) {
+        bench_suite(false, counters);
+    }
+    if (only == NULL || strcmp(only, "engines") == 0) {
+        if (only == NULL) printf("\n");
+        bench_engines();
+    }
+    if (only == NULL || strcmp(only, "arena") == 0) {
+        if (only == NULL) printf("\n");
+        bench_arena();
+    }
+    if (only == NULL || strcmp(only, "parallel") == 0) {
+        if (only == NULL) printf("\n");
+        bench_parallel();
+    }
+    if (only == NULL || strcmp(only, "format") == 0) {
+        if (only == NULL) printf("\n");
+        bench_format();
+    }
+
+    return 0;
+}
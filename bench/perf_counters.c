@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include "perf_counters.h"
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define PERF_CACHE_MISS(cache) ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+bool perf_counter_open(PerfCounter *counter, PerfEvent event) {
+    static const struct {
+        uint32_t type;
+        uint64_t config;
+    } events[PERF_EVENT_COUNT] = {
+        [PERF_EVENT_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        [PERF_EVENT_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        [PERF_EVENT_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        [PERF_EVENT_L1D_MISSES] = {PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_L1D)},
+        [PERF_EVENT_LLC_MISSES] = {PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_LL)},
+        [PERF_EVENT_DTLB_MISSES] = {PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+    };
+
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[event].type;
+    attr.config = events[event].config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // With more events than hardware counters the kernel multiplexes
+    // them; the enabled and running times let us scale the counts back
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    counter->value = 0;
+    counter->fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    return counter->fd >= 0;
+}
+
+void perf_counter_start(PerfCounter *counter) {
+    if (counter->fd < 0) return;
+    if (read(counter->fd, counter->start, sizeof(counter->start)) != sizeof(counter->start)) {
+        memset(counter->start, 0, sizeof(counter->start));
+    }
+    ioctl(counter->fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+uint64_t perf_counter_stop(PerfCounter *counter) {
+    uint64_t values[3];
+    if (counter->fd < 0) return 0;
+    ioctl(counter->fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(counter->fd, values, sizeof(values)) != sizeof(values)) return 0;
+
+    uint64_t count = values[0] - counter->start[0];
+    uint64_t enabled = values[1] - counter->start[1];
+    uint64_t running = values[2] - counter->start[2];
+    if (running == 0) return 0;
+    if (running < enabled) {
+        return (uint64_t)((double)count * (double)enabled / (double)running);
+    }
+    return count;
+}
+
+void perf_counter_close(PerfCounter *counter) {
+    if (counter->fd >= 0) close(counter->fd);
+    counter->fd = -1;
+}
+#else
+bool perf_counter_open(PerfCounter *counter, PerfEvent event) {
+    (void)event;
+    counter->fd = -1;
+    counter->value = 0;
+    return false;
+}
+
+void perf_counter_start(PerfCounter *counter) {
+    (void)counter;
+}
+
+uint64_t perf_counter_stop(PerfCounter *counter) {
+    (void)counter;
+    return 0;
+}
+
+void perf_counter_close(PerfCounter *counter) {
+    counter->fd = -1;
+}
+#endif
+
+const char *perf_event_name(PerfEvent event) {
+    static const char *names[PERF_EVENT_COUNT] = {
+        "cycles", "instructions", "branch_misses", "l1d_misses", "llc_misses", "dtlb_misses"
+    };
+    return names[event];
+}
+
+bool perf_set_open(PerfCounterSet *set) {
+    bool any = false;
+    for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+        any |= perf_counter_open(&set->counters[i], (PerfEvent)i);
+    }
+    return any;
+}
+
+bool perf_set_has(const PerfCounterSet *set, PerfEvent event) {
+    return set->counters[event].fd >= 0;
+}
+
+void perf_set_reset(PerfCounterSet *set) {
+    for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+        set->counters[i].value = 0;
+    }
+}
+
+void perf_set_resume(PerfCounterSet *set) {
+    for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+        perf_counter_start(&set->counters[i]);
+    }
+}
+
+void perf_set_pause(PerfCounterSet *set) {
+    // Stop in reverse so each counter sees as little of the others'
+    // syscalls as possible
+    for (int i = PERF_EVENT_COUNT; i-- > 0;) {
+        set->counters[i].value += perf_counter_stop(&set->counters[i]);
+    }
+}
+
+uint64_t perf_set_value(const PerfCounterSet *set, PerfEvent event) {
+    return set->counters[event].value;
+}
+
+void perf_set_close(PerfCounterSet *set) {
+    for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+        perf_counter_close(&set->counters[i]);
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum {
+    PERF_EVENT_CYCLES,
+    PERF_EVENT_INSTRUCTIONS,
+    PERF_EVENT_BRANCH_MISSES,
+    PERF_EVENT_L1D_MISSES,
+    PERF_EVENT_LLC_MISSES,
+    PERF_EVENT_DTLB_MISSES,
+    PERF_EVENT_COUNT
+} PerfEvent;
+
+// One hardware counter read through perf_event_open. Opening fails
+// quietly where the kernel or perf_event_paranoid does not allow it.
+typedef struct {
+    int fd;
+    uint64_t start[3];  // Count, time enabled and time running at start
+    uint64_t value;     // Accumulated by perf_set_pause
+} PerfCounter;
+
+// Every PerfEvent the machine lets us open; the rest read as unavailable
+typedef struct {
+    PerfCounter counters[PERF_EVENT_COUNT];
+} PerfCounterSet;
+
+bool perf_counter_open(PerfCounter *counter, PerfEvent event);
+
+void perf_counter_start(PerfCounter *counter);
+
+uint64_t perf_counter_stop(PerfCounter *counter);
+
+void perf_counter_close(PerfCounter *counter);
+
+const char *perf_event_name(PerfEvent event);
+
+// Returns true if at least one event could be opened
+bool perf_set_open(PerfCounterSet *set);
+
+bool perf_set_has(const PerfCounterSet *set, PerfEvent event);
+
+// Zeroes the accumulated values
+void perf_set_reset(PerfCounterSet *set);
+
+// Counts between resume and pause add to the accumulated values, so
+// untimed work inside a measurement loop can be left out
+void perf_set_resume(PerfCounterSet *set);
+
+void perf_set_pause(PerfCounterSet *set);
+
+uint64_t perf_set_value(const PerfCounterSet *set, PerfEvent event);
+
+void perf_set_close(PerfCounterSet *set);
+
+#endif
@@ -0,0 +1,136 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "arena.h"
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#define ARENA_HAS_MMAP 1
+#else
+#define ARENA_HAS_MMAP 0
+#endif
+
+#define ARENA_ALIGNMENT 16
+
+static size_t arena_round_up(size_t value, size_t multiple) {
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+#if ARENA_HAS_MMAP
+// Maps `size` bytes starting on a huge page boundary by over-reserving
+// and unmapping the unaligned head and tail
+static char *arena_map_aligned(size_t size) {
+    size_t reserve = size + ARENA_HUGE_PAGE_SIZE;
+    char *raw = mmap(NULL, reserve, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+
+    char *aligned = (char *)arena_round_up((uintptr_t)raw, ARENA_HUGE_PAGE_SIZE);
+    size_t head = (size_t)(aligned - raw);
+    if (head > 0) munmap(raw, head);
+    munmap(aligned + size, reserve - head - size);
+    return aligned;
+}
+#endif
+
+CalcArena *arena_create(size_t size, bool huge_pages) {
+    CalcArena *arena = calc_alloc(sizeof(CalcArena));
+    atomic_init(&arena->used, 0);
+
+#if ARENA_HAS_MMAP
+    if (huge_pages) {
+        size = arena_round_up(size, ARENA_HUGE_PAGE_SIZE);
+
+        void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base != MAP_FAILED) {
+            arena->base = base;
+            arena->size = size;
+            arena->backing = ARENA_BACKING_HUGETLB;
+            return arena;
+        }
+
+        char *aligned = arena_map_aligned(size);
+        if (aligned != NULL) {
+            arena->base = aligned;
+            arena->size = size;
+            arena->backing = madvise(aligned, size, MADV_HUGEPAGE) == 0 ?
+                ARENA_BACKING_TRANSPARENT : ARENA_BACKING_PAGES;
+            return arena;
+        }
+    }
+
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base != MAP_FAILED) {
+        arena->base = base;
+        arena->size = size;
+        arena->backing = ARENA_BACKING_PAGES;
+        return arena;
+    }
+#else
+    (void)huge_pages;
+#endif
+
+    arena->base = malloc(size);
+    if (arena->base == NULL) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+    }
+    arena->size = size;
+    arena->backing = ARENA_BACKING_MALLOC;
+    return arena;
+}
+
+void *arena_alloc(CalcArena *arena, size_t size) {
+    size_t used = atomic_load_explicit(&arena->used, memory_order_relaxed);
+    size_t offset;
+    do {
+        offset = arena_round_up(used, ARENA_ALIGNMENT);
+        if (offset > arena->size || size > arena->size - offset) {
+            return NULL;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&arena->used, &used, offset + size,
+                                                    memory_order_relaxed, memory_order_relaxed));
+    return arena->base + offset;
+}
+
+void arena_reset(CalcArena *arena) {
+    atomic_store_explicit(&arena->used, 0, memory_order_relaxed);
+}
+
+void arena_destroy(CalcArena *arena) {
+    if (arena == NULL) return;
+#if ARENA_HAS_MMAP
+    if (arena->backing != ARENA_BACKING_MALLOC) {
+        munmap(arena->base, arena->size);
+    } else {
+        free(arena->base);
+    }
+#else
+    free(arena->base);
+#endif
+    calc_free(arena, sizeof(CalcArena));
+}
+
+static void *arena_allocator_alloc(size_t size, void *ctx) {
+    return arena_alloc(ctx, size);
+}
+
+static void arena_allocator_free(void *ptr, size_t size, void *ctx) {
+    (void)ptr;
+    (void)size;
+    (void)ctx;
+}
+
+CalcAllocator arena_allocator(CalcArena *arena) {
+    return (CalcAllocator){arena_allocator_alloc, NULL, arena_allocator_free, arena};
+}
+
+const char *arena_backing_name(ArenaBacking backing) {
+    switch (backing) {
+        case ARENA_BACKING_MALLOC: return "malloc";
+        case ARENA_BACKING_PAGES: return "4k-pages";
+        case ARENA_BACKING_TRANSPARENT: return "thp";
+        case ARENA_BACKING_HUGETLB: return "hugetlb";
+    }
+    return "unknown";
+}
@@ -0,0 +1,48 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "calc.h"
+
+#define ARENA_HUGE_PAGE_SIZE (2u << 20)
+
+typedef enum {
+    ARENA_BACKING_MALLOC,       // Plain heap memory, used where mmap is unavailable
+    ARENA_BACKING_PAGES,        // Anonymous mapping with regular pages
+    ARENA_BACKING_TRANSPARENT,  // Anonymous mapping advised with MADV_HUGEPAGE
+    ARENA_BACKING_HUGETLB       // Explicit huge pages from MAP_HUGETLB
+} ArenaBacking;
+
+// Bump allocator over one reserved region. Very large trees built inside
+// a huge-page arena touch far fewer TLB entries during ast_eval. The bump
+// pointer is advanced atomically, so threads such as the parallel
+// builder's workers may allocate from one arena at the same time.
+typedef struct {
+    char *base;
+    size_t size;
+    _Atomic size_t used;
+    ArenaBacking backing;
+} CalcArena;
+
+// Reserves `size` bytes. With `huge_pages` it tries MAP_HUGETLB first,
+// then a 2 MB aligned mapping advised for transparent huge pages, and
+// falls back to regular pages.
+CalcArena *arena_create(size_t size, bool huge_pages);
+
+void *arena_alloc(CalcArena *arena, size_t size);
+
+// Releases everything allocated from the arena at once. Node pools never
+// hold arena memory, since nodes are only pooled under malloc, so no
+// thread needs to trim its pool first.
+void arena_reset(CalcArena *arena);
+
+void arena_destroy(CalcArena *arena);
+
+// Allocator for calc_set_allocator; frees are no-ops until arena_reset
+CalcAllocator arena_allocator(CalcArena *arena);
+
+const char *arena_backing_name(ArenaBacking backing);
+
+#endif
@@ -1,3 +1,4 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,10 +6,86 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 #include "calc.h"
+#include "histogram.h"
+#include "stats.h"
+#include "trace.h"
+#include "capture.h"
+#include "format.h"
 
 #define ALLOW_INVALID_TREE true
 
+/* ===== Allocator ===== */
+static void *default_alloc(size_t size, void *ctx) {
+    (void)ctx;
+    return malloc(size);
+}
+
+static void *default_realloc(void *ptr, size_t old_size, size_t new_size, void *ctx) {
+    (void)old_size;
+    (void)ctx;
+    return realloc(ptr, new_size);
+}
+
+static void default_free(void *ptr, size_t size, void *ctx) {
+    (void)size;
+    (void)ctx;
+    free(ptr);
+}
+
+static CalcAllocator allocator = {default_alloc, default_realloc, default_free, NULL};
+
+void calc_pool_trim();
+
+void calc_set_allocator(const CalcAllocator *custom) {
+    // Cached nodes belong to the previous allocator
+    calc_pool_trim();
+    if (custom == NULL) {
+        allocator = (CalcAllocator){default_alloc, default_realloc, default_free, NULL};
+        return;
+    }
+    allocator = *custom;
+}
+
+void *calc_alloc(size_t size) {
+    calc_stats_add(CALC_STAT_BYTES_ALLOCATED, size);
+    void *ptr = allocator.alloc(size, allocator.ctx);
+    if (ptr == NULL && size != 0) {
+        fprintf(stderr, "Error: Out of memory\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+void *calc_realloc(void *ptr, size_t old_size, size_t new_size) {
+    if (ptr == NULL) return calc_alloc(new_size);
+
+    void *resized;
+    if (allocator.realloc != NULL) {
+        calc_stats_add(CALC_STAT_BYTES_ALLOCATED, new_size);
+        calc_stats_add(CALC_STAT_BYTES_FREED, old_size);
+        resized = allocator.realloc(ptr, old_size, new_size, allocator.ctx);
+        if (resized == NULL && new_size != 0) {
+            fprintf(stderr, "Error: Out of memory\n");
+            exit(1);
+        }
+        return resized;
+    }
+
+    resized = calc_alloc(new_size);
+    memcpy(resized, ptr, old_size < new_size ? old_size : new_size);
+    calc_free(ptr, old_size);
+    return resized;
+}
+
+void calc_free(void *ptr, size_t size) {
+    if (ptr == NULL) return;
+    calc_stats_add(CALC_STAT_BYTES_FREED, size);
+    allocator.free(ptr, size, allocator.ctx);
+}
+
 /* ===== Lexer ===== */
 typedef enum {
     TOKEN_NUMBER, TOKEN_PLUS, TOKEN_MINUS, TOKEN_MULTIPLY, TOKEN_DIVIDE,
@@ -35,15 +112,17 @@ void tokentype_print(TokenType type) {
     printf("%s\n", tokens[type]);
 }
 
-Lexer* lexer_create(const char* input) {
-    Lexer* lexer = malloc(sizeof(Lexer));
+void lexer_init_range(Lexer* lexer, const char* input, size_t length) {
     lexer->input = input;
-    lexer->input_len = strlen(input);
+    lexer->input_len = length;
     lexer->position = 0;
-    lexer->curr_char = input[0];
+    lexer->curr_char = length > 0 ? input[0] : '\0';
     lexer->token_count = 0;
     lexer->token_max = SIZE_MAX;
-    return lexer;
+}
+
+void lexer_init(Lexer* lexer, const char* input) {
+    lexer_init_range(lexer, input, strlen(input));
 }
 
 void lexer_advance(Lexer* lexer) {
@@ -61,6 +140,11 @@ void lexer_skip_whitespace(Lexer* lexer) {
     }
 }
 
+static inline void lexer_count_token(Lexer* lexer) {
+    lexer->token_count++;
+    calc_stats_add(CALC_STAT_TOKENS_LEXED, 1);
+}
+
 Token lexer_get_number(Lexer* lexer) {
     char number[256] = {0};
     int i = 0;
@@ -85,28 +169,28 @@ Token lexer_get_next_token(Lexer* lexer) {
         }
         
         if (isdigit(lexer->curr_char) || lexer->curr_char == '.') {
-            lexer->token_count++;
+            lexer_count_token(lexer);
             return lexer_get_number(lexer);
         }
         
         switch (lexer->curr_char) {
             case '+':
-                lexer_advance(lexer); lexer->token_count++;
+                lexer_advance(lexer); lexer_count_token(lexer);
                 return (Token){TOKEN_PLUS, 0};
             case '-':
-                lexer_advance(lexer); lexer->token_count++;
+                lexer_advance(lexer); lexer_count_token(lexer);
                 return (Token){TOKEN_MINUS, 0};
             case '*':
-                lexer_advance(lexer); lexer->token_count++;
+                lexer_advance(lexer); lexer_count_token(lexer);
                 return (Token){TOKEN_MULTIPLY, 0};
             case '/':
-                lexer_advance(lexer); lexer->token_count++;
+                lexer_advance(lexer); lexer_count_token(lexer);
                 return (Token){TOKEN_DIVIDE, 0};
             case '(':
-                lexer_advance(lexer); lexer->token_count++;
+                lexer_advance(lexer); lexer_count_token(lexer);
                 return (Token){TOKEN_LPAREN, 0};
             case ')':
-                lexer_advance(lexer); lexer->token_count++;
+                lexer_advance(lexer); lexer_count_token(lexer);
                 return (Token){TOKEN_RPAREN, 0};
             default:
                 return (Token){TOKEN_ERROR, 0};
@@ -120,63 +204,259 @@ typedef struct {
     Lexer* lexer;
     Token curr_token;
     size_t max_tokens; // Maximum number of tokens to read
+    PostfixExpr* postfix; // When set, nodes are emitted here instead of allocated
+    size_t postfix_depth;
+    bool invalid; // Set when ALLOW_INVALID_TREE let a syntax error through
 } Parser;
 
+/* ===== Node pool ===== */
+// Freed nodes are kept on a per-thread free list so a thread calling eval()
+// in a loop stops hitting the system allocator once the list is warm.
+// Only malloc'd nodes are pooled: calc_set_allocator can trim the calling
+// thread's list, but the lists of other threads would keep handing out
+// memory from a custom allocator, such as an arena, after it is reset.
+#define NODE_POOL_MAX_FREE 4096
+
+typedef union PoolNode {
+    ASTNode node;
+    union PoolNode* next;
+} PoolNode;
+
+static _Thread_local PoolNode* node_pool = NULL;
+static _Thread_local size_t node_pool_size = 0;
+static _Thread_local bool node_pool_registered = false;
+static pthread_once_t node_pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t node_pool_key;
+
+static void node_pool_thread_exit(void *arg) {
+    (void)arg;
+    calc_pool_trim();
+}
+
+static void node_pool_init() {
+    pthread_key_create(&node_pool_key, node_pool_thread_exit);
+}
+
+ASTNode* astnode_alloc() {
+    calc_stats_add(CALC_STAT_NODES_ALLOCATED, 1);
+    PoolNode* pooled = node_pool;
+    if (pooled != NULL && allocator.alloc == default_alloc) {
+        node_pool = pooled->next;
+        node_pool_size--;
+        return &pooled->node;
+    }
+    return &((PoolNode*)calc_alloc(sizeof(PoolNode)))->node;
+}
+
+void astnode_release(ASTNode* node) {
+    if (node == NULL) return;
+    calc_stats_add(CALC_STAT_NODES_FREED, 1);
+    if (node_pool_size >= NODE_POOL_MAX_FREE || allocator.alloc != default_alloc) {
+        calc_free(node, sizeof(PoolNode));
+        return;
+    }
+    if (!node_pool_registered) {
+        // Trims the pool when the thread exits
+        pthread_once(&node_pool_once, node_pool_init);
+        pthread_setspecific(node_pool_key, &node_pool);
+        node_pool_registered = true;
+    }
+    PoolNode* pooled = (PoolNode*)node;
+    pooled->next = node_pool;
+    node_pool = pooled;
+    node_pool_size++;
+}
+
+// Pooled nodes always came from malloc, whatever allocator is installed
+// by the time the pool is trimmed
+void calc_pool_trim() {
+    while (node_pool != NULL) {
+        PoolNode* next = node_pool->next;
+        calc_stats_add(CALC_STAT_BYTES_FREED, sizeof(PoolNode));
+        default_free(node_pool, sizeof(PoolNode), NULL);
+        node_pool = next;
+    }
+    node_pool_size = 0;
+}
+
+// Nodes of the trees in an ASTNodeList, which may share subtrees and are
+// released together by nodelist_free
+#define NODE_BLOCK_MIN 256
+#define NODE_BLOCK_MAX 65536
+
+typedef struct ASTNodeBlock {
+    struct ASTNodeBlock* next;
+    size_t used;
+    size_t capacity;
+    ASTNode nodes[];
+} ASTNodeBlock;
+
 ASTNodeList *nodelist_create() {
-    ASTNodeList *list = (ASTNodeList*)malloc(sizeof(ASTNodeList));
-    memset(list->data, 0, sizeof(list->data));
+    ASTNodeList *list = (ASTNodeList*)calc_alloc(sizeof(ASTNodeList));
     list->size = 0;
+    list->capacity = 0;
+    list->data = NULL;
+    list->blocks = NULL;
     return list;
 }
 
 void nodelist_append(ASTNodeList *list, ASTNode *node) {
+    if (list->size == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 16;
+        list->data = calc_realloc(list->data, list->capacity * sizeof(ASTNode*), capacity * sizeof(ASTNode*));
+        list->capacity = capacity;
+    }
     list->data[list->size] = node;
     list->size++;
 }
 
 void nodelist_free(ASTNodeList *list) {
-    for (size_t i = 0; i < list->size; i++) {
-        free(list->data[i]);
+    while (list->blocks != NULL) {
+        ASTNodeBlock *next = list->blocks->next;
+        calc_stats_add(CALC_STAT_NODES_FREED, list->blocks->used);
+        calc_free(list->blocks, sizeof(ASTNodeBlock) + list->blocks->capacity * sizeof(ASTNode));
+        list->blocks = next;
     }
-    free(list);
+    calc_free(list->data, list->capacity * sizeof(ASTNode*));
+    calc_free(list, sizeof(ASTNodeList));
 }
 
-ASTNode* astnode_create_number(double value) {
-    ASTNode* node = malloc(sizeof(ASTNode));
+void astnode_update_size(ASTNode* node) {
+    uint64_t size = 1;
+    if (node->type == NODE_BINARY_OP) {
+        if (node->binary.left) size += node->binary.left->size;
+        if (node->binary.right) size += node->binary.right->size;
+    } else if (node->type == NODE_UNARY_OP && node->unary.operand) {
+        size += node->unary.operand->size;
+    }
+    node->size = size > UINT32_MAX ? UINT32_MAX : (uint32_t)size;
+}
+
+static inline ASTNode* astnode_init_number(ASTNode* node, double value) {
     node->type = NODE_NUMBER;
+    node->size = 1;
     node->number = value;
     return node;
 }
 
-ASTNode* astnode_create_binary(char op, ASTNode* left, ASTNode* right) {
-    ASTNode* node = malloc(sizeof(ASTNode));
+static inline ASTNode* astnode_init_binary(ASTNode* node, char op, ASTNode* left, ASTNode* right) {
     node->type = NODE_BINARY_OP;
     node->binary.operator = op;
     node->binary.left = left;
     node->binary.right = right;
+    astnode_update_size(node);
     return node;
 }
 
-ASTNode* astnode_create_unary(char op, ASTNode* operand) {
-    ASTNode* node = malloc(sizeof(ASTNode));
+static inline ASTNode* astnode_init_unary(ASTNode* node, char op, ASTNode* operand) {
     node->type = NODE_UNARY_OP;
     node->unary.operator = op;
     node->unary.operand = operand;
+    astnode_update_size(node);
     return node;
 }
 
-Parser* parser_create(Lexer* lexer) {
-    Parser* parser = malloc(sizeof(Parser));
+ASTNode* astnode_create_number(double value) {
+    return astnode_init_number(astnode_alloc(), value);
+}
+
+ASTNode* astnode_create_binary(char op, ASTNode* left, ASTNode* right) {
+    return astnode_init_binary(astnode_alloc(), op, left, right);
+}
+
+ASTNode* astnode_create_unary(char op, ASTNode* operand) {
+    return astnode_init_unary(astnode_alloc(), op, operand);
+}
+
+void parser_init(Parser* parser, Lexer* lexer) {
     parser->lexer = lexer;
     parser->curr_token = lexer_get_next_token(lexer);
     parser->max_tokens = SIZE_MAX;
-    return parser;
+    parser->postfix = NULL;
+    parser->postfix_depth = 0;
+    parser->invalid = false;
+}
+
+PostfixExpr *postfix_create() {
+    PostfixExpr *expr = calc_alloc(sizeof(PostfixExpr));
+    expr->size = 0;
+    expr->capacity = 0;
+    expr->ops = NULL;
+    expr->literal_count = 0;
+    expr->literal_capacity = 0;
+    expr->literals = NULL;
+    expr->max_depth = 0;
+    return expr;
+}
+
+void parser_emit(Parser* parser, PostfixOp op) {
+    PostfixExpr* expr = parser->postfix;
+    if (expr->size == expr->capacity) {
+        size_t capacity = expr->capacity ? expr->capacity * 2 : 32;
+        expr->ops = calc_realloc(expr->ops, expr->capacity, capacity);
+        expr->capacity = capacity;
+    }
+    expr->ops[expr->size++] = (uint8_t)op;
+
+    // Pushes grow the operand stack, binary ops shrink it, unary ops keep it
+    if (op == POSTFIX_PUSH || op == POSTFIX_NULL) {
+        parser->postfix_depth++;
+        if (parser->postfix_depth > expr->max_depth) {
+            expr->max_depth = parser->postfix_depth;
+        }
+    } else if (op <= POSTFIX_DIV) {
+        parser->postfix_depth--;
+    }
+}
+
+ASTNode* parser_make_number(Parser* parser, double value) {
+    if (parser->postfix == NULL) {
+        return astnode_create_number(value);
+    }
+    PostfixExpr* expr = parser->postfix;
+    if (expr->literal_count == expr->literal_capacity) {
+        size_t capacity = expr->literal_capacity ? expr->literal_capacity * 2 : 16;
+        expr->literals = calc_realloc(expr->literals, expr->literal_capacity * sizeof(double), capacity * sizeof(double));
+        expr->literal_capacity = capacity;
+    }
+    expr->literals[expr->literal_count++] = value;
+    parser_emit(parser, POSTFIX_PUSH);
+    return NULL;
+}
+
+ASTNode* parser_make_binary(Parser* parser, char op, ASTNode* left, ASTNode* right) {
+    if (parser->postfix == NULL) {
+        return astnode_create_binary(op, left, right);
+    }
+    switch (op) {
+        case '+': parser_emit(parser, POSTFIX_ADD); break;
+        case '-': parser_emit(parser, POSTFIX_SUB); break;
+        case '*': parser_emit(parser, POSTFIX_MUL); break;
+        case '/': parser_emit(parser, POSTFIX_DIV); break;
+    }
+    return NULL;
+}
+
+ASTNode* parser_make_unary(Parser* parser, char op, ASTNode* operand) {
+    if (parser->postfix == NULL) {
+        return astnode_create_unary(op, operand);
+    }
+    parser_emit(parser, op == '-' ? POSTFIX_NEG : POSTFIX_POS);
+    return NULL;
+}
+
+ASTNode* parser_make_null(Parser* parser) {
+    if (parser->postfix != NULL) {
+        parser_emit(parser, POSTFIX_NULL);
+    }
+    return NULL;
 }
 
 void parser_eat(Parser* parser, TokenType token_type) {
     if (parser->curr_token.type == token_type) {
         parser->curr_token = lexer_get_next_token(parser->lexer);
     } else {
+        calc_stats_add(CALC_STAT_SYNTAX_ERRORS, 1);
         fprintf(stderr, "Syntax error\n");
         exit(1);
     }
@@ -191,12 +471,13 @@ ASTNode* parser_factor(Parser* parser) {
     switch (token.type) {
         case TOKEN_NUMBER:
             parser_eat(parser, TOKEN_NUMBER);
-            return astnode_create_number(token.value);
+            return parser_make_number(parser, token.value);
             
         case TOKEN_LPAREN:
             parser_eat(parser, TOKEN_LPAREN);
             node = parser_expr(parser);
             if (ALLOW_INVALID_TREE && parser->curr_token.type != TOKEN_RPAREN) {
+                parser->invalid = true;
                 return node;
             }
             parser_eat(parser, TOKEN_RPAREN);
@@ -204,16 +485,18 @@ ASTNode* parser_factor(Parser* parser) {
             
         case TOKEN_MINUS:
             parser_eat(parser, TOKEN_MINUS);
-            return astnode_create_unary('-', parser_factor(parser));
+            return parser_make_unary(parser, '-', parser_factor(parser));
 
         case TOKEN_PLUS:
             parser_eat(parser, TOKEN_PLUS);
-            return astnode_create_unary('+', parser_factor(parser));
+            return parser_make_unary(parser, '+', parser_factor(parser));
 
         default:
             if (ALLOW_INVALID_TREE) {
-                return NULL;
+                parser->invalid = true;
+                return parser_make_null(parser);
             }
+            calc_stats_add(CALC_STAT_SYNTAX_ERRORS, 1);
             fprintf(stderr, "Syntax error in factor\n");
             exit(1);
     }
@@ -226,7 +509,7 @@ ASTNode* parser_term(Parser* parser) {
         Token token = parser->curr_token;
         char op = (token.type == TOKEN_MULTIPLY) ? '*' : '/';
         parser_eat(parser, token.type);
-        node = astnode_create_binary(op, node, parser_factor(parser));
+        node = parser_make_binary(parser, op, node, parser_factor(parser));
     }
     
     return node;
@@ -239,7 +522,7 @@ ASTNode* parser_expr(Parser* parser) {
         Token token = parser->curr_token;
         char op = (token.type == TOKEN_PLUS) ? '+' : '-';
         parser_eat(parser, token.type);
-        node = astnode_create_binary(op, node, parser_term(parser));
+        node = parser_make_binary(parser, op, node, parser_term(parser));
     }
     
     return node;
@@ -256,9 +539,12 @@ void ast_print(ASTNode* node, int depth) {
     }
     
     switch (node->type) {
-        case NODE_NUMBER:
-            printf("Number: %.2f\n", node->number);
+        case NODE_NUMBER: {
+            char number[CALC_FORMAT_DOUBLE_MAX];
+            calc_format_double(node->number, number);
+            printf("Number: %s\n", number);
             break;
+        }
         case NODE_BINARY_OP:
             printf("Binary Op: %c\n", node->binary.operator);
             ast_print(node->binary.left, depth + 1);
@@ -271,7 +557,7 @@ void ast_print(ASTNode* node, int depth) {
     }
 }
 
-double ast_eval(ASTNode* node) {
+static double ast_eval_node(ASTNode* node) {
     if (node == NULL) {
         fprintf(stderr, "Error: NULL node in evaluation\n");
         exit(1);
@@ -281,8 +567,8 @@ double ast_eval(ASTNode* node) {
         case NODE_NUMBER:
             return node->number;   
         case NODE_BINARY_OP: {
-            double left = ast_eval(node->binary.left);
-            double right = ast_eval(node->binary.right);
+            double left = ast_eval_node(node->binary.left);
+            double right = ast_eval_node(node->binary.right);
             
             switch (node->binary.operator) {
                 case '+': return left + right;
@@ -290,6 +576,7 @@ double ast_eval(ASTNode* node) {
                 case '*': return left * right;
                 case '/':
                     if (right == 0) {
+                        calc_stats_add(CALC_STAT_DIVISION_BY_ZERO, 1);
                         fprintf(stderr, "Error: Division by zero\n");
                         exit(1);
                     }
@@ -300,7 +587,7 @@ double ast_eval(ASTNode* node) {
             }
         }
         case NODE_UNARY_OP: {
-            double operand = ast_eval(node->unary.operand);
+            double operand = ast_eval_node(node->unary.operand);
             
             switch (node->unary.operator) {
                 case '-': return -operand;
@@ -316,6 +603,20 @@ double ast_eval(ASTNode* node) {
     }
 }
 
+double ast_eval(ASTNode* node) {
+    calc_stats_add(CALC_STAT_EVALUATIONS, 1);
+    CALC_HISTOGRAM_START(histogram_start);
+    CALC_TRACE_BEGIN(trace_start);
+    double result = ast_eval_node(node);
+    CALC_TRACE_END(trace_start, "ast_eval", "eval");
+    CALC_HISTOGRAM_STOP(histogram_start, CALC_PHASE_EVAL);
+    return result;
+}
+
+double ast_eval_subtree(ASTNode* node) {
+    return ast_eval_node(node);
+}
+
 void ast_free(ASTNode* node) {
     if (node == NULL) return;
     
@@ -331,49 +632,624 @@ void ast_free(ASTNode* node) {
             break;
     }
     
-    free(node);
+    astnode_release(node);
+}
+
+// Counts a parse that stopped before the end of its input
+static void parser_finish(Parser* parser) {
+    if (parser->invalid || parser->curr_token.type != TOKEN_EOF) {
+        calc_stats_add(CALC_STAT_SYNTAX_ERRORS, 1);
+    }
 }
 
 ASTNode *ast_build(const char* expression) {
-    Lexer* lexer = lexer_create(expression);
-    Parser* parser = parser_create(lexer);
-    ASTNode* root = parser_expr(parser);
+    CALC_CAPTURE(expression);
+    return ast_build_uncaptured(expression);
+}
 
-    free(parser);
-    free(lexer);
+ASTNode *ast_build_uncaptured(const char* expression) {
+    CALC_HISTOGRAM_START(histogram_start);
+    CALC_TRACE_BEGIN(trace_start);
+    Lexer lexer;
+    lexer_init(&lexer, expression);
+    Parser parser;
+    parser_init(&parser, &lexer);
+    ASTNode* root = parser_expr(&parser);
+    parser_finish(&parser);
+    CALC_TRACE_END(trace_start, "ast_build", "parse");
+    CALC_HISTOGRAM_STOP(histogram_start, CALC_PHASE_PARSE);
     return root;
 }
 
-ASTNode *ast_build_with_token_limit(const char* expression, size_t token_max) {
-    Lexer* lexer = lexer_create(expression);
-    lexer->token_max = token_max;
-    Parser* parser = parser_create(lexer);
-    ASTNode* root = parser_expr(parser);
+ASTNode *ast_build_strict(const char* expression) {
+    CALC_CAPTURE(expression);
+    CALC_HISTOGRAM_START(histogram_start);
+    CALC_TRACE_BEGIN(trace_start);
+    Lexer lexer;
+    lexer_init(&lexer, expression);
+    Parser parser;
+    parser_init(&parser, &lexer);
+    ASTNode* root = parser_expr(&parser);
+    parser_finish(&parser);
 
-    free(parser);
-    free(lexer);
+    if (parser.invalid || parser.curr_token.type != TOKEN_EOF) {
+        ast_free(root);
+        root = NULL;
+    }
+    CALC_TRACE_END(trace_start, "ast_build_strict", "parse");
+    CALC_HISTOGRAM_STOP(histogram_start, CALC_PHASE_PARSE);
     return root;
 }
 
+ASTNode *ast_build_sum_chunk(const char* expression, size_t length, bool leading, ASTNode** hole) {
+    Lexer lexer;
+    lexer_init_range(&lexer, expression, length);
+    Parser parser;
+    parser_init(&parser, &lexer);
+
+    ASTNode* node = NULL;
+    *hole = NULL;
+    if (!leading) {
+        node = parser_term(&parser);
+    }
+    while (parser.curr_token.type == TOKEN_PLUS || parser.curr_token.type == TOKEN_MINUS) {
+        char op = (parser.curr_token.type == TOKEN_PLUS) ? '+' : '-';
+        parser_eat(&parser, parser.curr_token.type);
+        node = astnode_create_binary(op, node, parser_term(&parser));
+        if (*hole == NULL && leading) *hole = node;
+    }
+
+    if (node == NULL || parser.invalid || parser.curr_token.type != TOKEN_EOF || (leading && *hole == NULL)) {
+        ast_free(node);
+        *hole = NULL;
+        return NULL;
+    }
+    return node;
+}
+
+/* ===== Parse stages ===== */
+// ast_build_stages runs the parser above once, as an explicit stack with
+// one StageLevel per open parenthesis holding the state of its
+// parser_expr and parser_term loops. The tree for the first k tokens is
+// that state closed as if the input ended there, so completed subtrees
+// are shared by every later stage and only the open spine is new.
+typedef struct {
+    ASTNode* sum;           // Left operand of sum_op
+    ASTNode* term;          // Left operand of term_op, or the last complete term
+    char sum_op;            // Pending + or -, 0 if none
+    char term_op;           // Pending * or /, 0 if none
+    bool expecting;         // The next token starts a factor
+    size_t unary_start;     // First of this level's pending unary operators
+} StageLevel;
+
+typedef struct {
+    ASTNodeList* list;      // Allocates every node
+    StageLevel* levels;
+    size_t level_count;
+    size_t level_capacity;
+    char* unary;            // Unary operators waiting for their factor
+    size_t unary_count;
+    size_t unary_capacity;
+    bool done;              // A token ended the top-level expression
+    ASTNode* root;
+} StageParser;
+
+static ASTNode* nodelist_alloc_node(ASTNodeList *list) {
+    ASTNodeBlock* block = list->blocks;
+    if (block == NULL || block->used == block->capacity) {
+        size_t capacity = block ? block->capacity * 2 : NODE_BLOCK_MIN;
+        if (capacity > NODE_BLOCK_MAX) capacity = NODE_BLOCK_MAX;
+        block = calc_alloc(sizeof(ASTNodeBlock) + capacity * sizeof(ASTNode));
+        block->next = list->blocks;
+        block->used = 0;
+        block->capacity = capacity;
+        list->blocks = block;
+    }
+    calc_stats_add(CALC_STAT_NODES_ALLOCATED, 1);
+    return &block->nodes[block->used++];
+}
+
+static ASTNode* stage_binary(StageParser* stage, char op, ASTNode* left, ASTNode* right) {
+    return astnode_init_binary(nodelist_alloc_node(stage->list), op, left, right);
+}
+
+static ASTNode* stage_unary(StageParser* stage, char op, ASTNode* operand) {
+    return astnode_init_unary(nodelist_alloc_node(stage->list), op, operand);
+}
+
+static void stage_push_level(StageParser* stage) {
+    if (stage->level_count == stage->level_capacity) {
+        size_t capacity = stage->level_capacity ? stage->level_capacity * 2 : 16;
+        stage->levels = calc_realloc(stage->levels, stage->level_capacity * sizeof(StageLevel), capacity * sizeof(StageLevel));
+        stage->level_capacity = capacity;
+    }
+    stage->levels[stage->level_count++] = (StageLevel){NULL, NULL, 0, 0, true, stage->unary_count};
+}
+
+static void stage_push_unary(StageParser* stage, char op) {
+    if (stage->unary_count == stage->unary_capacity) {
+        size_t capacity = stage->unary_capacity ? stage->unary_capacity * 2 : 16;
+        stage->unary = calc_realloc(stage->unary, stage->unary_capacity, capacity);
+        stage->unary_capacity = capacity;
+    }
+    stage->unary[stage->unary_count++] = op;
+}
+
+// Ends parser_factor in the innermost level with `factor`
+static void stage_complete_factor(StageParser* stage, ASTNode* factor) {
+    StageLevel* level = &stage->levels[stage->level_count - 1];
+    while (stage->unary_count > level->unary_start) {
+        factor = stage_unary(stage, stage->unary[--stage->unary_count], factor);
+    }
+    level->term = level->term_op ? stage_binary(stage, level->term_op, level->term, factor) : factor;
+    level->term_op = 0;
+    level->expecting = false;
+}
+
+// Consumes one token the way parser_expr would, unwinding levels the
+// token does not continue
+static void stage_feed(StageParser* stage, Token token) {
+    for (;;) {
+        StageLevel* level = &stage->levels[stage->level_count - 1];
+        if (level->expecting) {
+            switch (token.type) {
+                case TOKEN_NUMBER:
+                    stage_complete_factor(stage, astnode_init_number(nodelist_alloc_node(stage->list), token.value));
+                    return;
+                case TOKEN_MINUS: stage_push_unary(stage, '-'); return;
+                case TOKEN_PLUS: stage_push_unary(stage, '+'); return;
+                case TOKEN_LPAREN: stage_push_level(stage); return;
+                default:
+                    // parser_factor returns NULL without consuming
+                    stage_complete_factor(stage, NULL);
+                    continue;
+            }
+        }
+
+        switch (token.type) {
+            case TOKEN_MULTIPLY: level->term_op = '*'; level->expecting = true; return;
+            case TOKEN_DIVIDE: level->term_op = '/'; level->expecting = true; return;
+            case TOKEN_PLUS:
+            case TOKEN_MINUS:
+                level->sum = level->sum_op ? stage_binary(stage, level->sum_op, level->sum, level->term) : level->term;
+                level->sum_op = token.type == TOKEN_PLUS ? '+' : '-';
+                level->expecting = true;
+                return;
+            default: {
+                ASTNode* value = level->sum_op ? stage_binary(stage, level->sum_op, level->sum, level->term) : level->term;
+                if (stage->level_count == 1) {
+                    stage->root = value;
+                    stage->done = true;
+                    return;
+                }
+                stage->level_count--;
+                stage_complete_factor(stage, value);
+                if (token.type == TOKEN_RPAREN) return;
+                continue;
+            }
+        }
+    }
+}
+
+// Tree for the tokens fed so far, leaving the state untouched. Every
+// level but the innermost is waiting for the parenthesis it opened.
+static ASTNode* stage_close(StageParser* stage) {
+    if (stage->done) return stage->root;
+
+    ASTNode* value = NULL;
+    size_t unary_end = stage->unary_count;
+    for (size_t i = stage->level_count; i-- > 0;) {
+        StageLevel* level = &stage->levels[i];
+        ASTNode* term = level->term;
+        if (level->expecting) {
+            ASTNode* factor = value;
+            for (size_t u = unary_end; u > level->unary_start; u--) {
+                factor = stage_unary(stage, stage->unary[u - 1], factor);
+            }
+            unary_end = level->unary_start;
+            term = level->term_op ? stage_binary(stage, level->term_op, level->term, factor) : factor;
+        }
+        value = level->sum_op ? stage_binary(stage, level->sum_op, level->sum, term) : term;
+    }
+    return value;
+}
+
 ASTNodeList *ast_build_stages(const char* expression) {
-    // Count tokens
-    Lexer* lexer = lexer_create(expression);
-    size_t token_count = 0;
-    while (lexer_get_next_token(lexer).type != TOKEN_EOF) token_count++;
-    free(lexer);
-    
-    // Build ast stages list
+    CALC_TRACE_BEGIN(trace_start);
     ASTNodeList *list = nodelist_create();
-    for (size_t i = 0; i <= token_count; i++) {
-        nodelist_append(list, ast_build_with_token_limit(expression, i));
+    StageParser stage = {list, NULL, 0, 0, NULL, 0, 0, false, NULL};
+    stage_push_level(&stage);
+
+    Lexer lexer;
+    lexer_init(&lexer, expression);
+    nodelist_append(list, stage_close(&stage));
+    for (;;) {
+        Token token = lexer_get_next_token(&lexer);
+        if (token.type == TOKEN_EOF || token.type == TOKEN_ERROR) break;
+        if (!stage.done) stage_feed(&stage, token);
+        nodelist_append(list, stage_close(&stage));
     }
-    
+
+    calc_free(stage.levels, stage.level_capacity * sizeof(StageLevel));
+    calc_free(stage.unary, stage.unary_capacity);
+    CALC_TRACE_END(trace_start, "ast_build_stages", "parse");
     return list;
 }
 
+/* ===== Optimizer ===== */
+ASTNode *ast_fold(ASTNode* node) {
+    if (node == NULL) return NULL;
+
+    double value;
+    switch (node->type) {
+        case NODE_NUMBER:
+            return node;
+        case NODE_BINARY_OP: {
+            node->binary.left = ast_fold(node->binary.left);
+            node->binary.right = ast_fold(node->binary.right);
+            astnode_update_size(node);
+            ASTNode* left = node->binary.left;
+            ASTNode* right = node->binary.right;
+            if (left == NULL || right == NULL || left->type != NODE_NUMBER || right->type != NODE_NUMBER) {
+                return node;
+            }
+
+            switch (node->binary.operator) {
+                case '+': value = left->number + right->number; break;
+                case '-': value = left->number - right->number; break;
+                case '*': value = left->number * right->number; break;
+                case '/':
+                    // Leave division by zero for ast_eval to report
+                    if (right->number == 0) return node;
+                    value = left->number / right->number;
+                    break;
+                default:
+                    return node;
+            }
+            ast_free(left);
+            ast_free(right);
+            break;
+        }
+        case NODE_UNARY_OP: {
+            node->unary.operand = ast_fold(node->unary.operand);
+            astnode_update_size(node);
+            ASTNode* operand = node->unary.operand;
+            if (operand == NULL || operand->type != NODE_NUMBER) {
+                return node;
+            }
+
+            switch (node->unary.operator) {
+                case '-': value = -operand->number; break;
+                case '+': value = operand->number; break;
+                default:
+                    return node;
+            }
+            ast_free(operand);
+            break;
+        }
+        default:
+            return node;
+    }
+
+    node->type = NODE_NUMBER;
+    node->size = 1;
+    node->number = value;
+    return node;
+}
+
+typedef struct {
+    ASTNode* node;
+    bool negative;
+} ChainTerm;
+
+typedef struct {
+    size_t size;
+    size_t capacity;
+    ChainTerm* data;
+} ChainTerms;
+
+ASTNode* ast_reassociate(ASTNode* node);
+
+void chain_append(ChainTerms* terms, ASTNode* node, bool negative) {
+    if (terms->size == terms->capacity) {
+        size_t capacity = terms->capacity ? terms->capacity * 2 : 16;
+        terms->data = calc_realloc(terms->data, terms->capacity * sizeof(ChainTerm), capacity * sizeof(ChainTerm));
+        terms->capacity = capacity;
+    }
+    terms->data[terms->size++] = (ChainTerm){node, negative};
+}
+
+// Flattens a chain of `op` nodes into its operands, releasing the chain
+// nodes themselves. For '+' chains, '-' and unary minus flip the sign.
+void chain_collect(ChainTerms* terms, ASTNode* node, char op, bool negative) {
+    if (node != NULL && node->type == NODE_BINARY_OP &&
+        (node->binary.operator == op || (op == '+' && node->binary.operator == '-'))) {
+        ASTNode* left = node->binary.left;
+        ASTNode* right = node->binary.right;
+        bool flip = node->binary.operator == '-';
+        astnode_release(node);
+        chain_collect(terms, left, op, negative);
+        chain_collect(terms, right, op, flip ? !negative : negative);
+        return;
+    }
+    if (op == '+' && node != NULL && node->type == NODE_UNARY_OP) {
+        ASTNode* operand = node->unary.operand;
+        bool flip = node->unary.operator == '-';
+        astnode_release(node);
+        chain_collect(terms, operand, op, flip ? !negative : negative);
+        return;
+    }
+    chain_append(terms, ast_reassociate(node), negative);
+}
+
+ASTNode* chain_build(ASTNode** nodes, size_t count, char op) {
+    if (count == 1) return nodes[0];
+    size_t half = count / 2;
+    ASTNode* left = chain_build(nodes, half, op);
+    ASTNode* right = chain_build(nodes + half, count - half, op);
+    return astnode_create_binary(op, left, right);
+}
+
+ASTNode* ast_reassociate(ASTNode* node) {
+    if (node == NULL || node->type == NODE_NUMBER) return node;
+
+    if (node->type == NODE_UNARY_OP) {
+        node->unary.operand = ast_reassociate(node->unary.operand);
+        astnode_update_size(node);
+        return node;
+    }
+
+    char op = node->binary.operator;
+    if (op == '/') {
+        node->binary.left = ast_reassociate(node->binary.left);
+        node->binary.right = ast_reassociate(node->binary.right);
+        astnode_update_size(node);
+        return node;
+    }
+
+    ChainTerms terms = {0, 0, NULL};
+    chain_collect(&terms, node, op == '*' ? '*' : '+', false);
+
+    // a - b + c - d becomes (a + c) - (b + d), each side balanced
+    ASTNode** positive = calc_alloc(terms.size * sizeof(ASTNode*));
+    ASTNode** negative = calc_alloc(terms.size * sizeof(ASTNode*));
+    size_t positive_count = 0;
+    size_t negative_count = 0;
+    for (size_t i = 0; i < terms.size; i++) {
+        if (terms.data[i].negative) {
+            negative[negative_count++] = terms.data[i].node;
+        } else {
+            positive[positive_count++] = terms.data[i].node;
+        }
+    }
+
+    ASTNode* result;
+    if (op == '*') {
+        result = chain_build(positive, positive_count, '*');
+    } else if (negative_count == 0) {
+        result = chain_build(positive, positive_count, '+');
+    } else if (positive_count == 0) {
+        result = astnode_create_unary('-', chain_build(negative, negative_count, '+'));
+    } else {
+        result = astnode_create_binary('-', chain_build(positive, positive_count, '+'),
+                                       chain_build(negative, negative_count, '+'));
+    }
+
+    calc_free(positive, terms.size * sizeof(ASTNode*));
+    calc_free(negative, terms.size * sizeof(ASTNode*));
+    calc_free(terms.data, terms.capacity * sizeof(ChainTerm));
+    return result;
+}
+
+ASTNode *ast_optimize(ASTNode* root, unsigned flags) {
+    if (flags & CALC_OPT_UNSAFE_REASSOCIATE) {
+        CALC_TRACE_BEGIN(trace_start);
+        root = ast_reassociate(root);
+        CALC_TRACE_END(trace_start, "reassociate", "optimize");
+    }
+    if (flags & CALC_OPT_FOLD) {
+        CALC_TRACE_BEGIN(trace_start);
+        root = ast_fold(root);
+        CALC_TRACE_END(trace_start, "fold", "optimize");
+    }
+    return root;
+}
+
+size_t ast_count_tokens(const char* expression) {
+    CALC_TRACE_BEGIN(trace_start);
+    Lexer lexer;
+    lexer_init(&lexer, expression);
+    size_t token_count = 0;
+    for (;;) {
+        TokenType type = lexer_get_next_token(&lexer).type;
+        if (type == TOKEN_EOF || type == TOKEN_ERROR) break;
+        token_count++;
+    }
+    CALC_TRACE_END(trace_start, "tokenize", "lex");
+    return token_count;
+}
+
+
 double eval(const char* expression) {
     ASTNode* root = ast_build(expression);
     double result = ast_eval(root);
     ast_free(root);
     return result;
-}
\ No newline at end of file
+}
+
+PostfixExpr *ast_build_postfix(const char* expression) {
+    CALC_CAPTURE(expression);
+    Lexer lexer;
+    lexer_init(&lexer, expression);
+    Parser parser;
+    parser_init(&parser, &lexer);
+    CALC_TRACE_BEGIN(trace_start);
+    parser.postfix = postfix_create();
+    parser_expr(&parser);
+    parser_finish(&parser);
+    CALC_TRACE_END(trace_start, "ast_build_postfix", "parse");
+    return parser.postfix;
+}
+
+double postfix_eval(const PostfixExpr *expr) {
+    double small_stack[64];
+    double* stack = expr->max_depth <= 64 ? small_stack : calc_alloc(expr->max_depth * sizeof(double));
+    size_t top = 0;
+    size_t literal = 0;
+
+    for (size_t i = 0; i < expr->size; i++) {
+        switch ((PostfixOp)expr->ops[i]) {
+            case POSTFIX_PUSH:
+                stack[top++] = expr->literals[literal++];
+                break;
+            case POSTFIX_ADD:
+                top--;
+                stack[top - 1] += stack[top];
+                break;
+            case POSTFIX_SUB:
+                top--;
+                stack[top - 1] -= stack[top];
+                break;
+            case POSTFIX_MUL:
+                top--;
+                stack[top - 1] *= stack[top];
+                break;
+            case POSTFIX_DIV:
+                top--;
+                if (stack[top] == 0) {
+                    fprintf(stderr, "Error: Division by zero\n");
+                    exit(1);
+                }
+                stack[top - 1] /= stack[top];
+                break;
+            case POSTFIX_NEG:
+                stack[top - 1] = -stack[top - 1];
+                break;
+            case POSTFIX_POS:
+                break;
+            case POSTFIX_NULL:
+                fprintf(stderr, "Error: NULL node in evaluation\n");
+                exit(1);
+        }
+    }
+
+    if (top == 0) {
+        fprintf(stderr, "Error: NULL node in evaluation\n");
+        exit(1);
+    }
+    double result = stack[top - 1];
+    if (stack != small_stack) calc_free(stack, expr->max_depth * sizeof(double));
+    return result;
+}
+
+void postfix_free(PostfixExpr *expr) {
+    if (expr == NULL) return;
+    calc_free(expr->ops, expr->capacity);
+    calc_free(expr->literals, expr->literal_capacity * sizeof(double));
+    calc_free(expr, sizeof(PostfixExpr));
+}
+
+uint64_t calc_time_ns() {
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+    timespec_get(&ts, TIME_UTC);
+#endif
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* ===== Budgeted evaluation ===== */
+typedef struct {
+    uint64_t nodes_left;
+    uint64_t deadline_ns;
+    uint64_t until_check;   // Nodes left before the clock is read again
+    CalcStatus status;
+} BudgetState;
+
+static double budget_eval(BudgetState* state, ASTNode* node) {
+    if (state->status != CALC_OK) return 0;
+
+    // A subtree that fits in both the node budget and the current check
+    // interval cannot overrun either, so it runs at full speed
+    if (node != NULL && node->size != UINT32_MAX && node->size <= state->until_check && node->size <= state->nodes_left) {
+        state->until_check -= node->size;
+        state->nodes_left -= node->size;
+        return ast_eval_node(node);
+    }
+
+    if (state->nodes_left == 0) {
+        state->status = CALC_BUDGET_EXCEEDED;
+        return 0;
+    }
+    state->nodes_left--;
+    if (state->until_check == 0) {
+        if (calc_time_ns() >= state->deadline_ns) {
+            state->status = CALC_DEADLINE_EXCEEDED;
+            return 0;
+        }
+        state->until_check = CALC_BUDGET_CHECK_INTERVAL;
+    } else {
+        state->until_check--;
+    }
+
+    if (node == NULL || node->type == NODE_NUMBER) {
+        return ast_eval_node(node);
+    }
+    if (node->type == NODE_UNARY_OP) {
+        double operand = budget_eval(state, node->unary.operand);
+        if (state->status != CALC_OK) return 0;
+        switch (node->unary.operator) {
+            case '-': return -operand;
+            case '+': return operand;
+            default:
+                fprintf(stderr, "Error: Unknown unary operator %c\n", node->unary.operator);
+                exit(1);
+        }
+    }
+
+    double left = budget_eval(state, node->binary.left);
+    double right = budget_eval(state, node->binary.right);
+    if (state->status != CALC_OK) return 0;
+    switch (node->binary.operator) {
+        case '+': return left + right;
+        case '-': return left - right;
+        case '*': return left * right;
+        case '/':
+            if (right == 0) {
+                calc_stats_add(CALC_STAT_DIVISION_BY_ZERO, 1);
+                fprintf(stderr, "Error: Division by zero\n");
+                exit(1);
+            }
+            return left / right;
+        default:
+            fprintf(stderr, "Error: Unknown binary operator %c\n", node->binary.operator);
+            exit(1);
+    }
+}
+
+CalcStatus ast_eval_budget(ASTNode* root, const CalcBudget* budget, double* result) {
+    BudgetState state = {UINT64_MAX, UINT64_MAX, UINT64_MAX, CALC_OK};
+    if (budget->max_nodes > 0) state.nodes_left = budget->max_nodes;
+    if (budget->deadline_ns > 0) {
+        if (calc_time_ns() >= budget->deadline_ns) return CALC_DEADLINE_EXCEEDED;
+        state.deadline_ns = budget->deadline_ns;
+        state.until_check = CALC_BUDGET_CHECK_INTERVAL;
+    }
+
+    calc_stats_add(CALC_STAT_EVALUATIONS, 1);
+    CALC_HISTOGRAM_START(histogram_start);
+    CALC_TRACE_BEGIN(trace_start);
+    double value = budget_eval(&state, root);
+    CALC_TRACE_END(trace_start, "ast_eval_budget", "eval");
+    CALC_HISTOGRAM_STOP(histogram_start, CALC_PHASE_EVAL);
+    if (state.status == CALC_OK) *result = value;
+    return state.status;
+}
+
+CalcStatus eval_budget(const char* expression, const CalcBudget* budget, double* result) {
+    ASTNode* root = ast_build(expression);
+    CalcStatus status = ast_eval_budget(root, budget, result);
+    ast_free(root);
+    return status;
+}
@@ -1,7 +1,9 @@
 #ifndef CALC_H
 #define CALC_H
 
-#define NODE_LIST_MAX_SIZE 64
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 typedef enum {
     NODE_NUMBER, NODE_BINARY_OP, NODE_UNARY_OP
@@ -9,6 +11,7 @@ typedef enum {
 
 typedef struct ASTNode {
     NodeType type;
+    uint32_t size;  // Nodes in this subtree, saturating at UINT32_MAX
     union {
         double number;  // For NUMBER nodes
         struct {       // For BINARY_OP nodes
@@ -25,21 +28,141 @@ typedef struct ASTNode {
 
 typedef struct {
     size_t size;
-    ASTNode *data[NODE_LIST_MAX_SIZE];
+    size_t capacity;
+    ASTNode **data;
+    struct ASTNodeBlock *blocks;    // Storage for the nodes of every tree in `data`
 } ASTNodeList;
 
+// Memory functions used for every allocation the library makes. `free`
+// and `realloc` receive the size originally requested; `realloc` may be
+// NULL, in which case calc_realloc copies through `alloc` and `free`.
+typedef struct {
+    void *(*alloc)(size_t size, void *ctx);
+    void *(*realloc)(void *ptr, size_t old_size, size_t new_size, void *ctx);
+    void (*free)(void *ptr, size_t size, void *ctx);
+    void *ctx;
+} CalcAllocator;
+
+// Passes run by ast_optimize
+typedef enum {
+    CALC_OPT_FOLD = 1 << 0,     // Fold constant subtrees, keeping division by zero
+
+    // Not IEEE-strict: rebalances chains of + and - and of * into trees
+    // of logarithmic depth. Results may differ from ast_eval in the last
+    // bits, and intermediate overflow can change where it happens.
+    CALC_OPT_UNSAFE_REASSOCIATE = 1 << 1
+} CalcOptFlags;
+
+typedef enum {
+    CALC_OK,
+    CALC_BUDGET_EXCEEDED,       // More than CalcBudget.max_nodes nodes visited
+    CALC_DEADLINE_EXCEEDED      // calc_time_ns() passed CalcBudget.deadline_ns
+} CalcStatus;
+
+// Limits for the budgeted evaluators; zero disables a limit
+typedef struct {
+    uint64_t max_nodes;
+    uint64_t deadline_ns;       // Absolute time on the calc_time_ns() clock
+} CalcBudget;
+
+#define CALC_BUDGET_CHECK_INTERVAL 1024  // Nodes evaluated between clock reads
+
+typedef enum {
+    POSTFIX_PUSH, POSTFIX_ADD, POSTFIX_SUB, POSTFIX_MUL, POSTFIX_DIV,
+    POSTFIX_NEG, POSTFIX_POS, POSTFIX_NULL
+} PostfixOp;
+
+// Expression linearized in post-order. Each POSTFIX_PUSH consumes the next
+// literal, so evaluation is one forward loop over an operand stack.
+typedef struct {
+    size_t size;
+    size_t capacity;
+    uint8_t *ops;
+    size_t literal_count;
+    size_t literal_capacity;
+    double *literals;
+    size_t max_depth;   // Operand stack slots needed by postfix_eval
+} PostfixExpr;
+
+// Installs `allocator` for all later allocations, or restores malloc/free
+// when NULL. Memory must be released by the allocator that provided it,
+// so switch before building trees or after freeing them all.
+void calc_set_allocator(const CalcAllocator *allocator);
+
+void *calc_alloc(size_t size);
+
+void *calc_realloc(void *ptr, size_t old_size, size_t new_size);
+
+void calc_free(void *ptr, size_t size);
+
 ASTNode *ast_build(const char* expression);
 
+// ast_build without CALC_CAPTURE, for front ends that record the
+// expression themselves before parsing it
+ASTNode *ast_build_uncaptured(const char* expression);
+
+// Like ast_build, but returns NULL instead of a partial tree when the
+// expression has a syntax error or trailing input
+ASTNode *ast_build_strict(const char* expression);
+
+// Parses `length` bytes of a top-level sum the way parser_expr would,
+// for front ends that split the input. A `leading` chunk starts with a
+// binary + or -; its bottom-left node is returned in `*hole` with a NULL
+// left child for the caller to link to the preceding chunk. Returns NULL
+// unless the range is a complete run of terms.
+ASTNode *ast_build_sum_chunk(const char* expression, size_t length, bool leading, ASTNode** hole);
+
+ASTNode* astnode_create_number(double value);
+
+ASTNode* astnode_create_binary(char op, ASTNode* left, ASTNode* right);
+
+ASTNode* astnode_create_unary(char op, ASTNode* operand);
+
 void ast_print(ASTNode* node, int depth);
 
 void ast_free(ASTNode* node);
 
 double ast_eval(ASTNode* node);
 
+// ast_eval without the stats, histogram and trace hooks, for engines that
+// evaluate the pieces of one top-level call and record it themselves
+double ast_eval_subtree(ASTNode* node);
+
+ASTNode *ast_optimize(ASTNode* root, unsigned flags);
+
 double eval(const char* expression);
 
+// Trees for every prefix of the tokens of `expression`, from the empty
+// one (NULL) to all of them, as ast_build would parse the prefix alone.
+// The trees share subtrees, so release them only through nodelist_free.
+// Runs in time and memory linear in the tokens times the nesting depth.
 ASTNodeList *ast_build_stages(const char* expression);
 
+// Number of tokens the lexer reads from `expression`, up to the first
+// character it cannot tokenize
+size_t ast_count_tokens(const char* expression);
+
 void nodelist_free(ASTNodeList *list);
 
+// Frees the nodes the calling thread keeps cached for reuse
+void calc_pool_trim();
+
+PostfixExpr *ast_build_postfix(const char* expression);
+
+double postfix_eval(const PostfixExpr *expr);
+
+void postfix_free(PostfixExpr *expr);
+
+// Monotonic clock in nanoseconds, for instrumentation and deadlines
+uint64_t calc_time_ns();
+
+// Like ast_eval, but stops as soon as `budget` is exhausted and returns
+// why. `*result` is written only on CALC_OK. The deadline is checked on
+// entry and then every CALC_BUDGET_CHECK_INTERVAL nodes, so an expired
+// deadline is noticed within that many nodes.
+CalcStatus ast_eval_budget(ASTNode* root, const CalcBudget* budget, double* result);
+
+// eval with a budget; parsing is not interrupted but counts against the deadline
+CalcStatus eval_budget(const char* expression, const CalcBudget* budget, double* result);
+
 #endif
\ No newline at end of file
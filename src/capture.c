@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "calc.h"
+#include "capture.h"
+
+#define CAPTURE_BUFFER_SIZE (1 << 20)
+#define CAPTURE_MAX_EXPRESSION (1u << 30)  // Longer lengths mean a corrupt log
+
+atomic_bool calc_capture_enabled = false;
+
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *capture_file = NULL;
+static uint64_t capture_last_ns = 0;
+static bool capture_atexit_registered = false;
+
+static void capture_write_varint(FILE *file, uint64_t value) {
+    unsigned char bytes[10];
+    size_t length = 0;
+    do {
+        unsigned char byte = value & 0x7f;
+        value >>= 7;
+        bytes[length++] = byte | (value ? 0x80 : 0);
+    } while (value);
+    fwrite(bytes, 1, length, file);
+}
+
+bool calc_capture_start(const char *path) {
+    calc_capture_stop();
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) return false;
+    setvbuf(file, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+    fwrite(CAPTURE_MAGIC, 1, strlen(CAPTURE_MAGIC), file);
+
+    pthread_mutex_lock(&capture_lock);
+    capture_file = file;
+    capture_last_ns = 0;
+    if (!capture_atexit_registered) {
+        atexit(calc_capture_stop);
+        capture_atexit_registered = true;
+    }
+    pthread_mutex_unlock(&capture_lock);
+
+    atomic_store(&calc_capture_enabled, true);
+    return true;
+}
+
+void calc_capture_stop() {
+    atomic_store(&calc_capture_enabled, false);
+
+    pthread_mutex_lock(&capture_lock);
+    if (capture_file != NULL) {
+        fclose(capture_file);
+        capture_file = NULL;
+    }
+    pthread_mutex_unlock(&capture_lock);
+}
+
+void calc_capture_record(const char *expression) {
+    size_t length = strlen(expression);
+
+    pthread_mutex_lock(&capture_lock);
+    if (capture_file != NULL) {
+        // Read the clock under the lock so deltas are never negative
+        uint64_t now = calc_time_ns();
+        capture_write_varint(capture_file, capture_last_ns ? now - capture_last_ns : 0);
+        capture_write_varint(capture_file, length);
+        fwrite(expression, 1, length, capture_file);
+        capture_last_ns = now;
+    }
+    pthread_mutex_unlock(&capture_lock);
+}
+
+CaptureReader *capture_open(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    char magic[sizeof(CAPTURE_MAGIC) - 1];
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0) {
+        fclose(file);
+        return NULL;
+    }
+
+    CaptureReader *reader = calc_alloc(sizeof(CaptureReader));
+    reader->file = file;
+    reader->time_ns = 0;
+    reader->capacity = 256;
+    reader->expression = calc_alloc(reader->capacity);
+    return reader;
+}
+
+static bool capture_read_varint(FILE *file, uint64_t *value) {
+    *value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        int byte = fgetc(file);
+        if (byte == EOF) return false;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+const char *capture_next(CaptureReader *reader, uint64_t *time_ns) {
+    uint64_t delta;
+    uint64_t length;
+    if (!capture_read_varint(reader->file, &delta) || !capture_read_varint(reader->file, &length)) return NULL;
+    if (length > CAPTURE_MAX_EXPRESSION) return NULL;
+
+    if (length + 1 > reader->capacity) {
+        size_t capacity = reader->capacity;
+        while (capacity < length + 1) capacity *= 2;
+        reader->expression = calc_realloc(reader->expression, reader->capacity, capacity);
+        reader->capacity = capacity;
+    }
+    if (fread(reader->expression, 1, length, reader->file) != length) return NULL;
+    reader->expression[length] = '\0';
+
+    reader->time_ns += delta;
+    *time_ns = reader->time_ns;
+    return reader->expression;
+}
+
+void capture_close(CaptureReader *reader) {
+    if (reader == NULL) return;
+    fclose(reader->file);
+    calc_free(reader->expression, reader->capacity);
+    calc_free(reader, sizeof(CaptureReader));
+}
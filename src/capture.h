@@ -0,0 +1,46 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+// Workload capture: while active, every expression passed to ast_build,
+// ast_build_strict, ast_build_postfix or ast_build_parallel is appended
+// once to a log with its arrival time. The log is the magic "CALCCAP1"
+// followed by one record per expression: the nanoseconds since the
+// previous record and the expression length, both as LEB128 varints, then
+// the expression bytes.
+#define CAPTURE_MAGIC "CALCCAP1"
+
+extern atomic_bool calc_capture_enabled;
+
+// Returns false if `path` cannot be created
+bool calc_capture_start(const char *path);
+
+// Flushes and closes the log; also runs at exit
+void calc_capture_stop();
+
+void calc_capture_record(const char *expression);
+
+#define CALC_CAPTURE(expression) \
+    do { if (atomic_load_explicit(&calc_capture_enabled, memory_order_relaxed)) calc_capture_record(expression); } while (0)
+
+typedef struct {
+    FILE *file;
+    uint64_t time_ns;       // Since the first record
+    char *expression;
+    size_t capacity;
+} CaptureReader;
+
+// Returns NULL if the file is missing or not a capture log
+CaptureReader *capture_open(const char *path);
+
+// Advances to the next record. The expression stays valid until the next
+// call. Returns NULL at the end of the log or on a truncated record.
+const char *capture_next(CaptureReader *reader, uint64_t *time_ns);
+
+void capture_close(CaptureReader *reader);
+
+#endif
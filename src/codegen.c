@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include "codegen.h"
+
+void codegen_emit_number(FILE *out, double value) {
+    if (isnan(value)) {
+        fprintf(out, "NAN");
+        return;
+    }
+    if (isinf(value)) {
+        fprintf(out, value < 0 ? "(-HUGE_VAL)" : "HUGE_VAL");
+        return;
+    }
+
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.17g", value);
+    if (strpbrk(buffer, ".e") == NULL) {
+        strcat(buffer, ".0");
+    }
+    fprintf(out, signbit(value) ? "(%s)" : "%s", buffer);
+}
+
+static void codegen_emit_node(FILE *out, ASTNode *node, bool checked) {
+    if (node == NULL) {
+        if (checked) {
+            fprintf(out, "calc_null()");
+            return;
+        }
+        fprintf(stderr, "Error: NULL node in code generation\n");
+        exit(1);
+    }
+
+    switch (node->type) {
+        case NODE_NUMBER:
+            codegen_emit_number(out, node->number);
+            break;
+        case NODE_BINARY_OP:
+            if (checked && node->binary.operator == '/') {
+                fprintf(out, "calc_div(");
+                codegen_emit_node(out, node->binary.left, checked);
+                fprintf(out, ", ");
+                codegen_emit_node(out, node->binary.right, checked);
+                fprintf(out, ")");
+                break;
+            }
+            fprintf(out, "(");
+            codegen_emit_node(out, node->binary.left, checked);
+            fprintf(out, " %c ", node->binary.operator);
+            codegen_emit_node(out, node->binary.right, checked);
+            fprintf(out, ")");
+            break;
+        case NODE_UNARY_OP:
+            fprintf(out, "(%c", node->unary.operator);
+            codegen_emit_node(out, node->unary.operand, checked);
+            fprintf(out, ")");
+            break;
+    }
+}
+
+void codegen_emit_expr(FILE *out, ASTNode *node) {
+    codegen_emit_node(out, node, false);
+}
+
+void codegen_emit_checked_expr(FILE *out, ASTNode *node) {
+    codegen_emit_node(out, node, true);
+}
+
+void codegen_emit_function(FILE *out, const char *name, ASTNode *node) {
+    fprintf(out, "static inline double %s(void) {\n    return ", name);
+    codegen_emit_expr(out, node);
+    fprintf(out, ";\n}\n");
+}
@@ -0,0 +1,22 @@
+#ifndef CODEGEN_H
+#define CODEGEN_H
+
+#include <stdio.h>
+#include "calc.h"
+
+// Writes `value` as a C double literal that reads back to the same bits
+void codegen_emit_number(FILE *out, double value);
+
+// Writes `node` as a fully parenthesized C expression. The tree must not
+// contain NULL holes.
+void codegen_emit_expr(FILE *out, ASTNode *node);
+
+// Like codegen_emit_expr, but divisions go through calc_div() and NULL
+// holes through calc_null(), so generated code can report errors the way
+// ast_eval does. The caller must define both helpers.
+void codegen_emit_checked_expr(FILE *out, ASTNode *node);
+
+// Writes `static inline double name(void)` returning `node`
+void codegen_emit_function(FILE *out, const char *name, ASTNode *node);
+
+#endif
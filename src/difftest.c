@@ -0,0 +1,420 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include "difftest.h"
+#include "vm.h"
+#include "native.h"
+#include "stream.h"
+#include "tier.h"
+
+#define DIFF_STREAM_CHUNK 3     // Bytes per calc_parser_feed call
+#define DIFF_PARSE_GRAIN 8      // Bytes per ast_build_parallel chunk
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} DiffBuffer;
+
+static void diff_append(DiffBuffer *buffer, const char *text) {
+    size_t length = strlen(text);
+    if (buffer->length + length + 1 > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 64;
+        while (buffer->length + length + 1 > capacity) capacity *= 2;
+        buffer->data = calc_realloc(buffer->data, buffer->capacity, capacity);
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->length, text, length + 1);
+    buffer->length += length;
+}
+
+static int diff_precedence(const ASTNode *node) {
+    if (node->type != NODE_BINARY_OP) return 3;
+    return (node->binary.operator == '+' || node->binary.operator == '-') ? 1 : 2;
+}
+
+// Fewest decimals that read back as the same double. The lexer has no
+// exponents, so %g is out.
+static void diff_append_number(DiffBuffer *buffer, double value) {
+    char text[400];
+    for (int precision = 0; precision <= 30; precision++) {
+        snprintf(text, sizeof(text), "%.*f", precision, value);
+        if (strtod(text, NULL) == value) break;
+    }
+    diff_append(buffer, text);
+}
+
+// Parenthesizes a child only where the parser would otherwise build a
+// different tree: lower precedence, or equal precedence on the right
+static void diff_append_node(DiffBuffer *buffer, const ASTNode *node, int min_precedence) {
+    bool parens = diff_precedence(node) < min_precedence;
+    if (parens) diff_append(buffer, "(");
+
+    switch (node->type) {
+        case NODE_NUMBER:
+            diff_append_number(buffer, node->number);
+            break;
+        case NODE_BINARY_OP: {
+            int precedence = diff_precedence(node);
+            char op[] = {' ', node->binary.operator, ' ', '\0'};
+            diff_append_node(buffer, node->binary.left, precedence);
+            diff_append(buffer, op);
+            diff_append_node(buffer, node->binary.right, precedence + 1);
+            break;
+        }
+        case NODE_UNARY_OP: {
+            char op[] = {node->unary.operator, '\0'};
+            diff_append(buffer, op);
+            diff_append_node(buffer, node->unary.operand, 3);
+            break;
+        }
+    }
+
+    if (parens) diff_append(buffer, ")");
+}
+
+static char *diff_format(const ASTNode *root) {
+    DiffBuffer buffer = {NULL, 0, 0};
+    diff_append_node(&buffer, root, 0);
+    // Trimmed so diff_free can recover the size from the length
+    return calc_realloc(buffer.data, buffer.capacity, buffer.length + 1);
+}
+
+// Evaluates in ast_eval's order, clearing `*defined` instead of exiting
+// on division by zero
+static double diff_value(const ASTNode *node, bool *defined) {
+    switch (node->type) {
+        case NODE_NUMBER:
+            return node->number;
+        case NODE_UNARY_OP: {
+            double operand = diff_value(node->unary.operand, defined);
+            return node->unary.operator == '-' ? -operand : operand;
+        }
+        case NODE_BINARY_OP: {
+            double left = diff_value(node->binary.left, defined);
+            double right = diff_value(node->binary.right, defined);
+            switch (node->binary.operator) {
+                case '+': return left + right;
+                case '-': return left - right;
+                case '*': return left * right;
+                default:
+                    if (right == 0) *defined = false;
+                    return right == 0 ? 0 : left / right;
+            }
+        }
+    }
+    return 0;
+}
+
+static bool diff_has_division(const ASTNode *node) {
+    switch (node->type) {
+        case NODE_NUMBER:
+            return false;
+        case NODE_UNARY_OP:
+            return diff_has_division(node->unary.operand);
+        case NODE_BINARY_OP:
+            return node->binary.operator == '/' ||
+                diff_has_division(node->binary.left) || diff_has_division(node->binary.right);
+    }
+    return false;
+}
+
+// S in the reassociation bound of diff_check
+static double diff_magnitude(const ASTNode *node) {
+    switch (node->type) {
+        case NODE_NUMBER:
+            return fabs(node->number);
+        case NODE_UNARY_OP:
+            return diff_magnitude(node->unary.operand);
+        case NODE_BINARY_OP:
+            if (node->binary.operator == '*') {
+                return diff_magnitude(node->binary.left) * diff_magnitude(node->binary.right);
+            }
+            return diff_magnitude(node->binary.left) + diff_magnitude(node->binary.right);
+    }
+    return 0;
+}
+
+static ASTNode *diff_random_tree(unsigned *seed, size_t leaves, const char *ops) {
+    ASTNode *node;
+    if (leaves == 1) {
+        double whole = rand_r(seed) % 100;
+        node = astnode_create_number(rand_r(seed) % 2 ? whole : whole + (rand_r(seed) % 100) / 100.0);
+    } else {
+        size_t left = 1 + (size_t)rand_r(seed) % (leaves - 1);
+        char op = ops[(size_t)rand_r(seed) % strlen(ops)];
+        ASTNode *right = diff_random_tree(seed, leaves - left, ops);
+        bool defined = true;
+        if (op == '/' && diff_value(right, &defined) == 0) op = '*';
+        node = astnode_create_binary(op, diff_random_tree(seed, left, ops), right);
+    }
+    if (rand_r(seed) % 8 == 0) node = astnode_create_unary(rand_r(seed) % 2 ? '-' : '+', node);
+    return node;
+}
+
+char *diff_generate(unsigned *seed, size_t leaves, const char *ops) {
+    for (;;) {
+        ASTNode *root = diff_random_tree(seed, leaves ? leaves : 1, ops);
+        char *expression = diff_format(root);
+        ast_free(root);
+        // Divisors are checked as they are built, but a zero divisor
+        // inside a divisor only shows up in the whole tree
+        if (diff_valid(expression)) return expression;
+        diff_free(expression);
+    }
+}
+
+void diff_free(char *expression) {
+    if (expression != NULL) calc_free(expression, strlen(expression) + 1);
+}
+
+bool diff_valid(const char *expression) {
+    ASTNode *root = ast_build_strict(expression);
+    if (root == NULL) return false;
+    bool defined = true;
+    diff_value(root, &defined);
+    ast_free(root);
+    return defined;
+}
+
+static bool diff_same(double a, double b) {
+    if (isnan(a) && isnan(b)) return true;
+    return memcmp(&a, &b, sizeof(double)) == 0;
+}
+
+typedef enum {
+    DIFF_RAN,
+    DIFF_SKIPPED,       // Not enabled in DiffOptions, or no compiler
+    DIFF_REJECTED       // Refused an input ast_build_strict accepts
+} DiffStatus;
+
+typedef struct {
+    const char *name;
+    DiffStatus (*run)(const char *expression, const DiffOptions *options, double *result);
+} DiffEngine;
+
+static DiffStatus diff_run_fold(const char *expression, const DiffOptions *options, double *result) {
+    (void)options;
+    ASTNode *root = ast_optimize(ast_build_strict(expression), CALC_OPT_FOLD);
+    *result = ast_eval(root);
+    ast_free(root);
+    return DIFF_RAN;
+}
+
+static DiffStatus diff_run_budget(const char *expression, const DiffOptions *options, double *result) {
+    (void)options;
+    CalcBudget budget = {0, 0};
+    return eval_budget(expression, &budget, result) == CALC_OK ? DIFF_RAN : DIFF_REJECTED;
+}
+
+static DiffStatus diff_run_stream(const char *expression, const DiffOptions *options, double *result) {
+    (void)options;
+    CalcParser *parser = calc_parser_create();
+    size_t length = strlen(expression);
+    bool accepted = true;
+    for (size_t offset = 0; offset < length && accepted; offset += DIFF_STREAM_CHUNK) {
+        size_t chunk = length - offset < DIFF_STREAM_CHUNK ? length - offset : DIFF_STREAM_CHUNK;
+        accepted = calc_parser_feed(parser, expression + offset, chunk);
+    }
+    ASTNode *root = accepted ? calc_parser_finish(parser) : NULL;
+    calc_parser_free(parser);
+    if (root == NULL) return DIFF_REJECTED;
+    *result = ast_eval(root);
+    ast_free(root);
+    return DIFF_RAN;
+}
+
+static DiffStatus diff_run_parallel_eval(const char *expression, const DiffOptions *options, double *result) {
+    if (options->pool == NULL) return DIFF_SKIPPED;
+    ASTNode *root = ast_build_strict(expression);
+    *result = ast_eval_parallel(options->pool, root, 1);
+    ast_free(root);
+    return DIFF_RAN;
+}
+
+static DiffStatus diff_run_parallel_parse(const char *expression, const DiffOptions *options, double *result) {
+    if (options->pool == NULL) return DIFF_SKIPPED;
+    ASTNode *root = ast_build_parallel(options->pool, expression, DIFF_PARSE_GRAIN);
+    *result = ast_eval(root);
+    ast_free(root);
+    return DIFF_RAN;
+}
+
+static DiffStatus diff_run_native(const char *expression, const DiffOptions *options, double *result) {
+    if (!options->native) return DIFF_SKIPPED;
+    ASTNode *root = ast_build_strict(expression);
+    NativeExpr *native = native_compile(root);
+    ast_free(root);
+    if (native == NULL) return DIFF_SKIPPED;
+    *result = native_run(native);
+    native_free(native);
+    return DIFF_RAN;
+}
+
+// Runs the expression up through every tier the options allow, reporting
+// the first result that differs from the runs before it
+static DiffStatus diff_run_tier(const char *expression, const DiffOptions *options, double *result) {
+    TierConfig config = {.bytecode_threshold = 1, .native_threshold = options->native ? 2 : 0, .capacity = 1};
+    TierCache *cache = tier_create(config);
+    *result = tier_eval(cache, expression);
+    for (int run = 0; run < 2; run++) {
+        double actual = tier_eval(cache, expression);
+        if (!diff_same(*result, actual)) {
+            *result = actual;
+            break;
+        }
+    }
+    tier_free(cache);
+    return DIFF_RAN;
+}
+
+static const DiffEngine diff_engines[] = {
+    {"fold", diff_run_fold},
+    {"budget", diff_run_budget},
+    {"stream", diff_run_stream},
+    {"parallel-eval", diff_run_parallel_eval},
+    {"parallel-parse", diff_run_parallel_parse},
+    {"native", diff_run_native},
+    {"tier", diff_run_tier}
+};
+
+bool diff_check(const char *expression, const DiffOptions *options, DiffFailure *failure) {
+    ASTNode *root = ast_build_strict(expression);
+    double expected = ast_eval(root);
+    failure->expected = expected;
+
+    for (int engine = 0; engine < CALC_ENGINE_COUNT; engine++) {
+        double actual = eval_engine(expression, (CalcEngine)engine);
+        if (!diff_same(expected, actual)) {
+            failure->engine = calc_engine_name((CalcEngine)engine);
+            failure->actual = actual;
+            ast_free(root);
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(diff_engines) / sizeof(diff_engines[0]); i++) {
+        double actual = NAN;
+        DiffStatus status = diff_engines[i].run(expression, options, &actual);
+        if (status == DIFF_SKIPPED) continue;
+        if (status == DIFF_REJECTED || !diff_same(expected, actual)) {
+            failure->engine = diff_engines[i].name;
+            failure->actual = actual;
+            ast_free(root);
+            return false;
+        }
+    }
+
+    bool same = true;
+    double magnitude = diff_magnitude(root);
+    if (!diff_has_division(root) && isfinite(expected) && isfinite(magnitude)) {
+        double bound = (root->size + 1.0) * (DBL_EPSILON * magnitude + DBL_TRUE_MIN);
+        ASTNode *reassociated = ast_optimize(ast_build_strict(expression), CALC_OPT_UNSAFE_REASSOCIATE);
+        double actual = ast_eval(reassociated);
+        ast_free(reassociated);
+        if (!(fabs(actual - expected) <= bound)) {
+            failure->engine = "reassociate";
+            failure->actual = actual;
+            same = false;
+        }
+    }
+    ast_free(root);
+    return same;
+}
+
+static void diff_collect(ASTNode **slot, ASTNode ***slots, size_t *count) {
+    slots[(*count)++] = slot;
+    ASTNode *node = *slot;
+    if (node->type == NODE_BINARY_OP) {
+        diff_collect(&node->binary.left, slots, count);
+        diff_collect(&node->binary.right, slots, count);
+    } else if (node->type == NODE_UNARY_OP) {
+        diff_collect(&node->unary.operand, slots, count);
+    }
+}
+
+static char *diff_try(const ASTNode *root, DiffPredicate fails, void *ctx) {
+    char *candidate = diff_format(root);
+    if (diff_valid(candidate) && fails(candidate, ctx)) return candidate;
+    diff_free(candidate);
+    return NULL;
+}
+
+// Tries every child in place of each node, largest subtrees first, then
+// simpler literals. Returns the first candidate that still fails.
+static char *diff_shrink_step(ASTNode *root, DiffPredicate fails, void *ctx) {
+    size_t count = 0;
+    ASTNode ***slots = calc_alloc(root->size * sizeof(ASTNode **));
+    diff_collect(&root, slots, &count);
+
+    char *accepted = NULL;
+    for (size_t i = 0; i < count && accepted == NULL; i++) {
+        ASTNode **slot = slots[i];
+        ASTNode *node = *slot;
+        ASTNode *children[2] = {NULL, NULL};
+        if (node->type == NODE_BINARY_OP) {
+            children[0] = node->binary.left;
+            children[1] = node->binary.right;
+        } else if (node->type == NODE_UNARY_OP) {
+            children[0] = node->unary.operand;
+        }
+        for (int j = 0; j < 2 && children[j] != NULL && accepted == NULL; j++) {
+            *slot = children[j];
+            accepted = diff_try(root, fails, ctx);
+            *slot = node;
+        }
+    }
+
+    // Each replacement is strictly simpler (fraction, integer, 1, 0), so
+    // the literals cannot cycle
+    for (size_t i = 0; i < count && accepted == NULL; i++) {
+        ASTNode *node = *slots[i];
+        if (node->type != NODE_NUMBER) continue;
+        double value = node->number;
+        double simpler[] = {0, value != 0 ? 1 : 0, trunc(value)};
+        for (int j = 0; j < 3 && accepted == NULL; j++) {
+            if (simpler[j] == value) continue;
+            node->number = simpler[j];
+            accepted = diff_try(root, fails, ctx);
+            node->number = value;
+        }
+    }
+
+    calc_free(slots, root->size * sizeof(ASTNode **));
+    return accepted;
+}
+
+char *diff_shrink(const char *expression, DiffPredicate fails, void *ctx) {
+    size_t length = strlen(expression);
+    char *current = calc_alloc(length + 1);
+    memcpy(current, expression, length + 1);
+
+    for (;;) {
+        ASTNode *root = ast_build_strict(current);
+        if (root == NULL) return current;
+        char *smaller = diff_shrink_step(root, fails, ctx);
+        ast_free(root);
+        if (smaller == NULL) return current;
+        diff_free(current);
+        current = smaller;
+    }
+}
+
+typedef struct {
+    const DiffOptions *options;
+    const char *engine;
+} DiffMinimize;
+
+static bool diff_fails_engine(const char *expression, void *ctx) {
+    DiffMinimize *minimize = ctx;
+    DiffFailure failure;
+    return !diff_check(expression, minimize->options, &failure) && strcmp(failure.engine, minimize->engine) == 0;
+}
+
+char *diff_minimize(const char *expression, const DiffOptions *options, const char *engine) {
+    DiffMinimize minimize = {options, engine};
+    return diff_shrink(expression, diff_fails_engine, &minimize);
+}
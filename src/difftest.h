@@ -0,0 +1,59 @@
+#ifndef DIFFTEST_H
+#define DIFFTEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "calc.h"
+#include "parallel.h"
+
+// Engines beyond those of eval_engine that diff_check also runs. The
+// tier cache always runs, through the native tier only with `native`.
+typedef struct {
+    bool native;        // native_compile; slow, and skipped when it fails
+    ThreadPool *pool;   // ast_eval_parallel and ast_build_parallel when set
+} DiffOptions;
+
+// First disagreement found by diff_check
+typedef struct {
+    const char *engine;
+    double expected;    // ast_eval of ast_build_strict
+    double actual;
+} DiffFailure;
+
+// Random expression with `leaves` literals joined by operators drawn
+// from `ops` (any of "+-*/"), with unary signs and the fewest parentheses
+// that keep the tree shape. Never divides by zero. Returns a string to
+// release with diff_free.
+char *diff_generate(unsigned *seed, size_t leaves, const char *ops);
+
+// Releases a string returned by this module
+void diff_free(char *expression);
+
+// False if `expression` does not parse strictly or divides by zero, the
+// inputs on which engines exit instead of returning a value
+bool diff_valid(const char *expression);
+
+// Runs every engine on a valid `expression` and compares it with ast_eval.
+// Results must match bit for bit, with any two NaNs considered equal.
+// The one exception is CALC_OPT_UNSAFE_REASSOCIATE, which is checked only
+// on expressions without division and a finite result. Reordering n nodes
+// moves each side at most n * DBL_EPSILON / 2 * S away from the exact
+// value, where S is the expression evaluated on the magnitudes of its
+// literals with every - read as +, so the two may differ by at most
+// (n + 1) * (DBL_EPSILON * S + DBL_TRUE_MIN), the extra terms covering
+// rounding in S itself and underflow. Returns false and fills `failure`
+// on the first mismatch.
+bool diff_check(const char *expression, const DiffOptions *options, DiffFailure *failure);
+
+typedef bool (*DiffPredicate)(const char *expression, void *ctx);
+
+// Shrinks `expression` while `fails` keeps holding, by replacing nodes
+// with their children and literals with 0, 1 or their integer part until
+// no single step is left that still fails. Only valid candidates are
+// offered to `fails`. Returns a string to release with diff_free.
+char *diff_shrink(const char *expression, DiffPredicate fails, void *ctx);
+
+// diff_shrink on "diff_check still reports `engine`"
+char *diff_minimize(const char *expression, const DiffOptions *options, const char *engine);
+
+#endif
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "flat.h"
+
+static FlatAST *flat_create() {
+    FlatAST *flat = calc_alloc(sizeof(FlatAST));
+    flat->size = 0;
+    flat->capacity = 0;
+    flat->ops = NULL;
+    flat->left = NULL;
+    flat->right = NULL;
+    flat->literal_count = 0;
+    flat->literal_capacity = 0;
+    flat->literals = NULL;
+    flat->root = FLAT_NONE;
+    return flat;
+}
+
+static uint32_t flat_push_node(FlatAST *flat, FlatOpcode op, uint32_t left, uint32_t right) {
+    if (flat->size == flat->capacity) {
+        size_t capacity = flat->capacity ? flat->capacity * 2 : 16;
+        flat->ops = calc_realloc(flat->ops, flat->capacity * sizeof(uint8_t), capacity * sizeof(uint8_t));
+        flat->left = calc_realloc(flat->left, flat->capacity * sizeof(uint32_t), capacity * sizeof(uint32_t));
+        flat->right = calc_realloc(flat->right, flat->capacity * sizeof(uint32_t), capacity * sizeof(uint32_t));
+        flat->capacity = capacity;
+    }
+    flat->ops[flat->size] = (uint8_t)op;
+    flat->left[flat->size] = left;
+    flat->right[flat->size] = right;
+    return (uint32_t)flat->size++;
+}
+
+static uint32_t flat_push_literal(FlatAST *flat, double value) {
+    if (flat->literal_count == flat->literal_capacity) {
+        size_t capacity = flat->literal_capacity ? flat->literal_capacity * 2 : 16;
+        flat->literals = calc_realloc(flat->literals, flat->literal_capacity * sizeof(double), capacity * sizeof(double));
+        flat->literal_capacity = capacity;
+    }
+    flat->literals[flat->literal_count] = value;
+    return (uint32_t)flat->literal_count++;
+}
+
+static FlatOpcode flat_binary_opcode(char op) {
+    switch (op) {
+        case '+': return FLAT_ADD;
+        case '-': return FLAT_SUB;
+        case '*': return FLAT_MUL;
+        case '/': return FLAT_DIV;
+        default:
+            fprintf(stderr, "Error: Unknown binary operator %c\n", op);
+            exit(1);
+    }
+}
+
+static FlatOpcode flat_unary_opcode(char op) {
+    switch (op) {
+        case '-': return FLAT_NEG;
+        case '+': return FLAT_POS;
+        default:
+            fprintf(stderr, "Error: Unknown unary operator %c\n", op);
+            exit(1);
+    }
+}
+
+// Emits children before their parent and returns the index of `node`
+static uint32_t flat_emit(FlatAST *flat, ASTNode *node) {
+    if (node == NULL) return FLAT_NONE;
+
+    switch (node->type) {
+        case NODE_NUMBER:
+            return flat_push_node(flat, FLAT_NUMBER, flat_push_literal(flat, node->number), FLAT_NONE);
+        case NODE_BINARY_OP: {
+            uint32_t left = flat_emit(flat, node->binary.left);
+            uint32_t right = flat_emit(flat, node->binary.right);
+            return flat_push_node(flat, flat_binary_opcode(node->binary.operator), left, right);
+        }
+        case NODE_UNARY_OP: {
+            uint32_t operand = flat_emit(flat, node->unary.operand);
+            return flat_push_node(flat, flat_unary_opcode(node->unary.operator), operand, FLAT_NONE);
+        }
+    }
+
+    fprintf(stderr, "Error: Unknown node type\n");
+    exit(1);
+}
+
+FlatAST *flat_from_ast(ASTNode *root) {
+    FlatAST *flat = flat_create();
+    flat->root = flat_emit(flat, root);
+    return flat;
+}
+
+static ASTNode *flat_build_node(const FlatAST *flat, uint32_t index) {
+    if (index == FLAT_NONE) return NULL;
+
+    switch ((FlatOpcode)flat->ops[index]) {
+        case FLAT_NUMBER:
+            return astnode_create_number(flat->literals[flat->left[index]]);
+        case FLAT_ADD:
+            return astnode_create_binary('+', flat_build_node(flat, flat->left[index]), flat_build_node(flat, flat->right[index]));
+        case FLAT_SUB:
+            return astnode_create_binary('-', flat_build_node(flat, flat->left[index]), flat_build_node(flat, flat->right[index]));
+        case FLAT_MUL:
+            return astnode_create_binary('*', flat_build_node(flat, flat->left[index]), flat_build_node(flat, flat->right[index]));
+        case FLAT_DIV:
+            return astnode_create_binary('/', flat_build_node(flat, flat->left[index]), flat_build_node(flat, flat->right[index]));
+        case FLAT_NEG:
+            return astnode_create_unary('-', flat_build_node(flat, flat->left[index]));
+        case FLAT_POS:
+            return astnode_create_unary('+', flat_build_node(flat, flat->left[index]));
+    }
+
+    fprintf(stderr, "Error: Unknown flat opcode %d\n", flat->ops[index]);
+    exit(1);
+}
+
+ASTNode *flat_to_ast(const FlatAST *flat) {
+    return flat_build_node(flat, flat->root);
+}
+
+double flat_eval(const FlatAST *flat) {
+    if (flat->root == FLAT_NONE) {
+        fprintf(stderr, "Error: NULL node in evaluation\n");
+        exit(1);
+    }
+
+    // Children always precede their parent, so a single forward pass
+    // over the arrays sees every operand before it is used.
+    double *values = calc_alloc(flat->size * sizeof(double));
+    for (size_t i = 0; i < flat->size; i++) {
+        uint8_t op = flat->ops[i];
+        uint32_t left = flat->left[i];
+        uint32_t right = flat->right[i];
+
+        if (op == FLAT_NUMBER) {
+            values[i] = flat->literals[left];
+            continue;
+        }
+        if (left == FLAT_NONE || (op <= FLAT_DIV && right == FLAT_NONE)) {
+            fprintf(stderr, "Error: NULL node in evaluation\n");
+            exit(1);
+        }
+
+        switch ((FlatOpcode)op) {
+            case FLAT_ADD: values[i] = values[left] + values[right]; break;
+            case FLAT_SUB: values[i] = values[left] - values[right]; break;
+            case FLAT_MUL: values[i] = values[left] * values[right]; break;
+            case FLAT_DIV:
+                if (values[right] == 0) {
+                    fprintf(stderr, "Error: Division by zero\n");
+                    exit(1);
+                }
+                values[i] = values[left] / values[right];
+                break;
+            case FLAT_NEG: values[i] = -values[left]; break;
+            case FLAT_POS: values[i] = values[left]; break;
+            default:
+                fprintf(stderr, "Error: Unknown flat opcode %d\n", op);
+                exit(1);
+        }
+    }
+
+    double result = values[flat->root];
+    calc_free(values, flat->size * sizeof(double));
+    return result;
+}
+
+void flat_free(FlatAST *flat) {
+    if (flat == NULL) return;
+    calc_free(flat->ops, flat->capacity * sizeof(uint8_t));
+    calc_free(flat->left, flat->capacity * sizeof(uint32_t));
+    calc_free(flat->right, flat->capacity * sizeof(uint32_t));
+    calc_free(flat->literals, flat->literal_capacity * sizeof(double));
+    calc_free(flat, sizeof(FlatAST));
+}
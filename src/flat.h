@@ -0,0 +1,36 @@
+#ifndef FLAT_H
+#define FLAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "calc.h"
+
+#define FLAT_NONE UINT32_MAX
+
+typedef enum {
+    FLAT_NUMBER, FLAT_ADD, FLAT_SUB, FLAT_MUL, FLAT_DIV, FLAT_NEG, FLAT_POS
+} FlatOpcode;
+
+// Index-based AST stored as parallel arrays. Nodes are laid out children
+// first, so every child index is smaller than its parent's.
+typedef struct {
+    size_t size;
+    size_t capacity;
+    uint8_t *ops;       // FlatOpcode of each node
+    uint32_t *left;     // Left child, unary operand or literal index
+    uint32_t *right;    // Right child, FLAT_NONE for non-binary nodes
+    size_t literal_count;
+    size_t literal_capacity;
+    double *literals;
+    uint32_t root;      // FLAT_NONE for an empty tree
+} FlatAST;
+
+FlatAST *flat_from_ast(ASTNode *root);
+
+ASTNode *flat_to_ast(const FlatAST *flat);
+
+double flat_eval(const FlatAST *flat);
+
+void flat_free(FlatAST *flat);
+
+#endif
@@ -0,0 +1,378 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "calc.h"
+#include "format.h"
+
+/* ===== Grisu3 ===== */
+// Florian Loitsch, "Printing Floating-Point Numbers Quickly and Accurately
+// with Integers" (PLDI 2010). The value and its rounding boundaries are
+// scaled by a cached power of ten into 64-bit fixed point and digits are
+// generated until they fall inside the boundaries. When the imprecision
+// of the scaling makes it unclear whether the digits are the shortest,
+// format_grisu3 gives up and the caller falls back to snprintf.
+
+typedef struct {
+    uint64_t f;
+    int e;
+} DiyFp;    // f * 2^e
+
+typedef struct {
+    uint64_t significand;
+    int16_t binary_exponent;
+    int16_t decimal_exponent;
+} CachedPower;
+
+// 10^k for k = -348, -340, ..., 340 as significand * 2^binary_exponent,
+// rounded to nearest. Generated with exact rational arithmetic.
+static const CachedPower format_cached_powers[] = {
+    {0xfa8fd5a0081c0288ULL, -1220, -348}, {0xbaaee17fa23ebf76ULL, -1193, -340},
+    {0x8b16fb203055ac76ULL, -1166, -332}, {0xcf42894a5dce35eaULL, -1140, -324},
+    {0x9a6bb0aa55653b2dULL, -1113, -316}, {0xe61acf033d1a45dfULL, -1087, -308},
+    {0xab70fe17c79ac6caULL, -1060, -300}, {0xff77b1fcbebcdc4fULL, -1034, -292},
+    {0xbe5691ef416bd60cULL, -1007, -284}, {0x8dd01fad907ffc3cULL, -980, -276},
+    {0xd3515c2831559a83ULL, -954, -268}, {0x9d71ac8fada6c9b5ULL, -927, -260},
+    {0xea9c227723ee8bcbULL, -901, -252}, {0xaecc49914078536dULL, -874, -244},
+    {0x823c12795db6ce57ULL, -847, -236}, {0xc21094364dfb5637ULL, -821, -228},
+    {0x9096ea6f3848984fULL, -794, -220}, {0xd77485cb25823ac7ULL, -768, -212},
+    {0xa086cfcd97bf97f4ULL, -741, -204}, {0xef340a98172aace5ULL, -715, -196},
+    {0xb23867fb2a35b28eULL, -688, -188}, {0x84c8d4dfd2c63f3bULL, -661, -180},
+    {0xc5dd44271ad3cdbaULL, -635, -172}, {0x936b9fcebb25c996ULL, -608, -164},
+    {0xdbac6c247d62a584ULL, -582, -156}, {0xa3ab66580d5fdaf6ULL, -555, -148},
+    {0xf3e2f893dec3f126ULL, -529, -140}, {0xb5b5ada8aaff80b8ULL, -502, -132},
+    {0x87625f056c7c4a8bULL, -475, -124}, {0xc9bcff6034c13053ULL, -449, -116},
+    {0x964e858c91ba2655ULL, -422, -108}, {0xdff9772470297ebdULL, -396, -100},
+    {0xa6dfbd9fb8e5b88fULL, -369, -92}, {0xf8a95fcf88747d94ULL, -343, -84},
+    {0xb94470938fa89bcfULL, -316, -76}, {0x8a08f0f8bf0f156bULL, -289, -68},
+    {0xcdb02555653131b6ULL, -263, -60}, {0x993fe2c6d07b7facULL, -236, -52},
+    {0xe45c10c42a2b3b06ULL, -210, -44}, {0xaa242499697392d3ULL, -183, -36},
+    {0xfd87b5f28300ca0eULL, -157, -28}, {0xbce5086492111aebULL, -130, -20},
+    {0x8cbccc096f5088ccULL, -103, -12}, {0xd1b71758e219652cULL, -77, -4},
+    {0x9c40000000000000ULL, -50, 4}, {0xe8d4a51000000000ULL, -24, 12},
+    {0xad78ebc5ac620000ULL, 3, 20}, {0x813f3978f8940984ULL, 30, 28},
+    {0xc097ce7bc90715b3ULL, 56, 36}, {0x8f7e32ce7bea5c70ULL, 83, 44},
+    {0xd5d238a4abe98068ULL, 109, 52}, {0x9f4f2726179a2245ULL, 136, 60},
+    {0xed63a231d4c4fb27ULL, 162, 68}, {0xb0de65388cc8ada8ULL, 189, 76},
+    {0x83c7088e1aab65dbULL, 216, 84}, {0xc45d1df942711d9aULL, 242, 92},
+    {0x924d692ca61be758ULL, 269, 100}, {0xda01ee641a708deaULL, 295, 108},
+    {0xa26da3999aef774aULL, 322, 116}, {0xf209787bb47d6b85ULL, 348, 124},
+    {0xb454e4a179dd1877ULL, 375, 132}, {0x865b86925b9bc5c2ULL, 402, 140},
+    {0xc83553c5c8965d3dULL, 428, 148}, {0x952ab45cfa97a0b3ULL, 455, 156},
+    {0xde469fbd99a05fe3ULL, 481, 164}, {0xa59bc234db398c25ULL, 508, 172},
+    {0xf6c69a72a3989f5cULL, 534, 180}, {0xb7dcbf5354e9beceULL, 561, 188},
+    {0x88fcf317f22241e2ULL, 588, 196}, {0xcc20ce9bd35c78a5ULL, 614, 204},
+    {0x98165af37b2153dfULL, 641, 212}, {0xe2a0b5dc971f303aULL, 667, 220},
+    {0xa8d9d1535ce3b396ULL, 694, 228}, {0xfb9b7cd9a4a7443cULL, 720, 236},
+    {0xbb764c4ca7a44410ULL, 747, 244}, {0x8bab8eefb6409c1aULL, 774, 252},
+    {0xd01fef10a657842cULL, 800, 260}, {0x9b10a4e5e9913129ULL, 827, 268},
+    {0xe7109bfba19c0c9dULL, 853, 276}, {0xac2820d9623bf429ULL, 880, 284},
+    {0x80444b5e7aa7cf85ULL, 907, 292}, {0xbf21e44003acdd2dULL, 933, 300},
+    {0x8e679c2f5e44ff8fULL, 960, 308}, {0xd433179d9c8cb841ULL, 986, 316},
+    {0x9e19db92b4e31ba9ULL, 1013, 324}, {0xeb96bf6ebadf77d9ULL, 1039, 332},
+    {0xaf87023b9bf0ee6bULL, 1066, 340}
+};
+
+#define FORMAT_CACHED_POWERS_OFFSET 348   // -decimal_exponent of the first entry
+#define FORMAT_CACHED_POWERS_STEP 8
+#define FORMAT_MIN_TARGET_EXPONENT (-60)  // Binary exponent range after scaling
+#define FORMAT_MAX_TARGET_EXPONENT (-32)
+
+static const uint32_t format_powers_of_ten[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+// Shifts the significand, which is never zero, until its top bit is set
+static DiyFp diyfp_normalize(DiyFp x) {
+#if defined(__GNUC__)
+    int shift = __builtin_clzll(x.f);
+#else
+    int shift = 0;
+    while ((x.f << shift) >> 63 == 0) shift++;
+#endif
+    return (DiyFp){x.f << shift, x.e - shift};
+}
+
+// Product rounded to the upper 64 bits
+static DiyFp diyfp_multiply(DiyFp x, DiyFp y) {
+    uint64_t a = x.f >> 32, b = x.f & 0xFFFFFFFFu;
+    uint64_t c = y.f >> 32, d = y.f & 0xFFFFFFFFu;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t middle = (bd >> 32) + (ad & 0xFFFFFFFFu) + (bc & 0xFFFFFFFFu) + (1u << 31);
+    return (DiyFp){ac + (ad >> 32) + (bc >> 32) + (middle >> 32), x.e + y.e + 64};
+}
+
+// Moves the last digit down while that brings it closer to w, then checks
+// that the result is the unique closest choice within the safe interval
+static bool format_round_weed(char *digits, int length, uint64_t distance_too_high_w, uint64_t unsafe_interval,
+                              uint64_t rest, uint64_t ten_kappa, uint64_t unit) {
+    uint64_t small_distance = distance_too_high_w - unit;
+    uint64_t big_distance = distance_too_high_w + unit;
+
+    while (rest < small_distance && unsafe_interval - rest >= ten_kappa &&
+           (rest + ten_kappa < small_distance || small_distance - rest >= rest + ten_kappa - small_distance)) {
+        digits[length - 1]--;
+        rest += ten_kappa;
+    }
+    if (rest < big_distance && unsafe_interval - rest >= ten_kappa &&
+        (rest + ten_kappa < big_distance || big_distance - rest > rest + ten_kappa - big_distance)) {
+        return false;
+    }
+    return 2 * unit <= rest && rest <= unsafe_interval - 4 * unit;
+}
+
+static bool format_digit_gen(DiyFp low, DiyFp w, DiyFp high, char *digits, int *length, int *kappa) {
+    uint64_t unit = 1;
+    DiyFp too_low = {low.f - unit, low.e};
+    DiyFp too_high = {high.f + unit, high.e};
+    uint64_t unsafe_interval = too_high.f - too_low.f;
+    int shift = -w.e;
+    uint64_t one = 1ULL << shift;
+    uint32_t integrals = (uint32_t)(too_high.f >> shift);
+    uint64_t fractionals = too_high.f & (one - 1);
+
+    *kappa = 0;
+    while (*kappa < 10 && integrals >= format_powers_of_ten[*kappa]) (*kappa)++;
+    uint32_t divisor = *kappa > 0 ? format_powers_of_ten[*kappa - 1] : 0;
+
+    *length = 0;
+    while (*kappa > 0) {
+        digits[(*length)++] = (char)('0' + integrals / divisor);
+        integrals %= divisor;
+        (*kappa)--;
+        uint64_t rest = ((uint64_t)integrals << shift) + fractionals;
+        if (rest < unsafe_interval) {
+            return format_round_weed(digits, *length, too_high.f - w.f, unsafe_interval, rest,
+                                     (uint64_t)divisor << shift, unit);
+        }
+        divisor /= 10;
+    }
+
+    for (;;) {
+        fractionals *= 10;
+        unit *= 10;
+        unsafe_interval *= 10;
+        digits[(*length)++] = (char)('0' + (fractionals >> shift));
+        fractionals &= one - 1;
+        (*kappa)--;
+        if (fractionals < unsafe_interval) {
+            return format_round_weed(digits, *length, (too_high.f - w.f) * unit, unsafe_interval, fractionals,
+                                     one, unit);
+        }
+    }
+}
+
+// Shortest digits of a positive finite `value`, which equals
+// digits * 10^exponent. Returns false when the result is not certain.
+static bool format_grisu3(double value, char *digits, int *length, int *exponent) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint64_t fraction = bits & ((1ULL << 52) - 1);
+    int biased = (int)(bits >> 52) & 0x7FF;
+    DiyFp v = biased ? (DiyFp){fraction | (1ULL << 52), biased - 1075} : (DiyFp){fraction, -1074};
+
+    // Halfway points to the neighbouring doubles; the lower one is closer
+    // when the value is a power of two above the smallest normal
+    DiyFp plus = diyfp_normalize((DiyFp){(v.f << 1) + 1, v.e - 1});
+    DiyFp minus = (fraction == 0 && biased > 1) ? (DiyFp){(v.f << 2) - 1, v.e - 2} : (DiyFp){(v.f << 1) - 1, v.e - 1};
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+    DiyFp w = diyfp_normalize(v);
+
+    // Cached power that scales w into [FORMAT_MIN_TARGET_EXPONENT, FORMAT_MAX_TARGET_EXPONENT]
+    int min_exponent = FORMAT_MIN_TARGET_EXPONENT - (w.e + 64);
+    int k = (int)ceil((min_exponent + 63) * 0.30102999566398114);
+    int index = (FORMAT_CACHED_POWERS_OFFSET + k - 1) / FORMAT_CACHED_POWERS_STEP + 1;
+    const CachedPower *power = &format_cached_powers[index];
+    DiyFp ten_mk = {power->significand, power->binary_exponent};
+
+    int kappa;
+    bool exact = format_digit_gen(diyfp_multiply(minus, ten_mk), diyfp_multiply(w, ten_mk),
+                                  diyfp_multiply(plus, ten_mk), digits, length, &kappa);
+    *exponent = kappa - power->decimal_exponent;
+    return exact;
+}
+
+// Shortest "%.*e" that reads back as `value`
+static void format_fallback(double value, char *digits, int *length, int *exponent) {
+    char text[40];
+    for (int precision = 0; precision < 17; precision++) {
+        snprintf(text, sizeof(text), "%.*e", precision, value);
+        if (strtod(text, NULL) == value) break;
+    }
+    *length = 0;
+    const char *c = text;
+    for (; *c != 'e'; c++) {
+        if (*c != '.') digits[(*length)++] = *c;
+    }
+    *exponent = atoi(c + 1) - (*length - 1);
+}
+
+/* ===== Output ===== */
+static char *format_exponent(char *out, int exponent) {
+    *out++ = 'e';
+    *out++ = exponent < 0 ? '-' : '+';
+    unsigned magnitude = (unsigned)(exponent < 0 ? -exponent : exponent);
+    if (magnitude >= 100) *out++ = (char)('0' + magnitude / 100);
+    if (magnitude >= 10) *out++ = (char)('0' + magnitude / 10 % 10);
+    *out++ = (char)('0' + magnitude % 10);
+    return out;
+}
+
+size_t calc_format_double(double value, char *out) {
+    char *p = out;
+    if (isnan(value)) {
+        memcpy(out, "nan", 4);
+        return 3;
+    }
+    if (signbit(value)) {
+        *p++ = '-';
+        value = -value;
+    }
+    if (isinf(value)) {
+        memcpy(p, "inf", 4);
+        return (size_t)(p - out) + 3;
+    }
+    if (value == 0) {
+        memcpy(p, "0", 2);
+        return (size_t)(p - out) + 1;
+    }
+
+    char digits[20];
+    int length;
+    int exponent;
+    if (!format_grisu3(value, digits, &length, &exponent)) {
+        format_fallback(value, digits, &length, &exponent);
+    }
+
+    // Digits before the decimal point
+    int point = length + exponent;
+    if (length <= point && point <= 21) {
+        memcpy(p, digits, (size_t)length);
+        memset(p + length, '0', (size_t)(point - length));
+        p += point;
+    } else if (0 < point && point <= 21) {
+        memcpy(p, digits, (size_t)point);
+        p[point] = '.';
+        memcpy(p + point + 1, digits + point, (size_t)(length - point));
+        p += length + 1;
+    } else if (-6 < point && point <= 0) {
+        *p++ = '0';
+        *p++ = '.';
+        memset(p, '0', (size_t)-point);
+        p += -point;
+        memcpy(p, digits, (size_t)length);
+        p += length;
+    } else {
+        *p++ = digits[0];
+        if (length > 1) {
+            *p++ = '.';
+            memcpy(p, digits + 1, (size_t)(length - 1));
+            p += length - 1;
+        }
+        p = format_exponent(p, point - 1);
+    }
+    *p = '\0';
+    return (size_t)(p - out);
+}
+
+void calc_writer_init(CalcWriter *writer, FILE *file) {
+    writer->file = file;
+    writer->used = 0;
+    writer->failed = false;
+}
+
+static void calc_writer_drain(CalcWriter *writer) {
+    if (writer->used > 0 && fwrite(writer->buffer, 1, writer->used, writer->file) != writer->used) {
+        writer->failed = true;
+    }
+    writer->used = 0;
+}
+
+void calc_writer_write(CalcWriter *writer, const void *data, size_t length) {
+    if (writer->used + length > CALC_WRITER_BUFFER) {
+        calc_writer_drain(writer);
+        if (length > CALC_WRITER_BUFFER) {
+            if (fwrite(data, 1, length, writer->file) != length) writer->failed = true;
+            return;
+        }
+    }
+    memcpy(writer->buffer + writer->used, data, length);
+    writer->used += length;
+}
+
+void calc_writer_double(CalcWriter *writer, double value, char terminator) {
+    if (writer->used + CALC_FORMAT_DOUBLE_MAX > CALC_WRITER_BUFFER) calc_writer_drain(writer);
+    writer->used += calc_format_double(value, writer->buffer + writer->used);
+    writer->buffer[writer->used++] = terminator;
+}
+
+bool calc_writer_flush(CalcWriter *writer) {
+    calc_writer_drain(writer);
+    if (fflush(writer->file) != 0) writer->failed = true;
+    return !writer->failed;
+}
+
+/* ===== Binary results ===== */
+// Byte by byte so the layout is the same on any host; compilers turn this
+// into a single store on little-endian machines
+static void format_store_le64(unsigned char *out, uint64_t value) {
+    for (int i = 0; i < 8; i++) out[i] = (unsigned char)(value >> (8 * i));
+}
+
+bool calc_results_begin(CalcResultsWriter *results, FILE *file) {
+    results->start = ftell(file);
+    if (results->start < 0) return false;
+    calc_writer_init(&results->writer, file);
+    results->count = 0;
+    results->errors = NULL;
+    results->errors_capacity = 0;
+
+    unsigned char header[CALC_RESULTS_HEADER_SIZE] = {0};
+    memcpy(header, CALC_RESULTS_MAGIC, 8);
+    calc_writer_write(&results->writer, header, sizeof(header));
+    return true;
+}
+
+void calc_results_add(CalcResultsWriter *results, double value, bool error) {
+    size_t byte = (size_t)(results->count / 8);
+    if (byte == results->errors_capacity) {
+        size_t capacity = results->errors_capacity ? results->errors_capacity * 2 : 4096;
+        results->errors = calc_realloc(results->errors, results->errors_capacity, capacity);
+        memset(results->errors + results->errors_capacity, 0, capacity - results->errors_capacity);
+        results->errors_capacity = capacity;
+    }
+    if (error) {
+        results->errors[byte] |= (unsigned char)(1u << (results->count % 8));
+        value = NAN;
+    }
+
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    unsigned char encoded[8];
+    format_store_le64(encoded, bits);
+    calc_writer_write(&results->writer, encoded, sizeof(encoded));
+    results->count++;
+}
+
+bool calc_results_finish(CalcResultsWriter *results) {
+    if (results->count > 0) {
+        calc_writer_write(&results->writer, results->errors, (size_t)((results->count + 7) / 8));
+    }
+    calc_writer_drain(&results->writer);
+    calc_free(results->errors, results->errors_capacity);
+    results->errors = NULL;
+    results->errors_capacity = 0;
+
+    unsigned char fields[16];
+    format_store_le64(fields, results->count);
+    format_store_le64(fields + 8, CALC_RESULTS_HEADER_SIZE + 8 * results->count);
+    FILE *file = results->writer.file;
+    long end = ftell(file);
+    if (end < 0 || fseek(file, results->start + 8, SEEK_SET) != 0 ||
+        fwrite(fields, 1, sizeof(fields), file) != sizeof(fields) || fseek(file, end, SEEK_SET) != 0) {
+        results->writer.failed = true;
+    }
+    return calc_writer_flush(&results->writer);
+}
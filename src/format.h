@@ -0,0 +1,69 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CALC_FORMAT_DOUBLE_MAX 32   // Longest calc_format_double output, with the NUL
+#define CALC_WRITER_BUFFER 65536
+
+// Writes the shortest decimal that reads back as `value`, formatted like
+// JavaScript's Number#toString: fixed notation for magnitudes from 1e-6
+// up to 1e21, otherwise "1.5e-7" or "1e+21". Also "-0", "inf", "-inf"
+// and "nan". Grisu3 finds the digits and the rare values it cannot
+// prove shortest go through snprintf. Returns the length, without the
+// NUL.
+size_t calc_format_double(double value, char *out);
+
+// Buffered output, flushed to `file` in CALC_WRITER_BUFFER sized writes
+typedef struct {
+    FILE *file;
+    size_t used;
+    bool failed;        // A write to `file` came up short
+    char buffer[CALC_WRITER_BUFFER];
+} CalcWriter;
+
+void calc_writer_init(CalcWriter *writer, FILE *file);
+
+void calc_writer_write(CalcWriter *writer, const void *data, size_t length);
+
+// Appends calc_format_double(value) followed by `terminator`
+void calc_writer_double(CalcWriter *writer, double value, char terminator);
+
+// Writes out the buffer. Returns false if any write so far failed.
+bool calc_writer_flush(CalcWriter *writer);
+
+// Binary results for consumers that mmap the file instead of parsing
+// text. All integers and doubles are little-endian:
+//   [0, 8)               magic CALC_RESULTS_MAGIC
+//   [8, 16)              uint64 count
+//   [16, 24)             uint64 errors_offset
+//   [24, 24 + 8 count)   double results, NaN where the input failed
+//   [errors_offset, +ceil(count / 8))  bit i % 8 of byte i / 8 is set
+//                        when result i failed
+// The results start 8-byte aligned, so a mapped file can be read as an
+// array of doubles in place on little-endian hosts.
+#define CALC_RESULTS_MAGIC "CALCRES1"
+#define CALC_RESULTS_HEADER_SIZE 24
+
+typedef struct {
+    CalcWriter writer;
+    long start;         // Offset of the header in the file
+    uint64_t count;
+    unsigned char *errors;
+    size_t errors_capacity;
+} CalcResultsWriter;
+
+// Writes a placeholder header that calc_results_finish fills in, which
+// needs `file` to be seekable. Returns false when it is not.
+bool calc_results_begin(CalcResultsWriter *results, FILE *file);
+
+void calc_results_add(CalcResultsWriter *results, double value, bool error);
+
+// Appends the error bitmap, writes the header and flushes. Returns false
+// if any write failed.
+bool calc_results_finish(CalcResultsWriter *results);
+
+#endif
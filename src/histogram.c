@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "histogram.h"
+
+// Each thread writes only its own counters, so relaxed loads and stores
+// are enough; readers see every sample up to the last few in flight.
+typedef struct ThreadHistograms {
+    _Atomic uint64_t counts[CALC_PHASE_COUNT][CALC_HISTOGRAM_BUCKETS];
+    _Atomic uint64_t sum[CALC_PHASE_COUNT];
+    _Atomic uint64_t max[CALC_PHASE_COUNT];
+    struct ThreadHistograms *next;
+} ThreadHistograms;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t registry_once = PTHREAD_ONCE_INIT;
+static pthread_key_t registry_key;
+static ThreadHistograms *registry = NULL;
+static CalcHistogram retired[CALC_PHASE_COUNT];     // Samples from threads that exited
+static CalcHistogram baseline[CALC_PHASE_COUNT];    // Totals at the last reset
+
+static _Thread_local ThreadHistograms *local = NULL;
+
+static void histogram_merge_thread(CalcHistogram *out, ThreadHistograms *thread, CalcPhase phase) {
+    for (size_t i = 0; i < CALC_HISTOGRAM_BUCKETS; i++) {
+        uint64_t count = atomic_load_explicit(&thread->counts[phase][i], memory_order_relaxed);
+        out->counts[i] += count;
+        out->total += count;
+    }
+    out->sum += atomic_load_explicit(&thread->sum[phase], memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&thread->max[phase], memory_order_relaxed);
+    if (max > out->max) out->max = max;
+}
+
+static void histogram_thread_exit(void *arg) {
+    ThreadHistograms *thread = arg;
+
+    pthread_mutex_lock(&registry_lock);
+    for (int phase = 0; phase < CALC_PHASE_COUNT; phase++) {
+        histogram_merge_thread(&retired[phase], thread, (CalcPhase)phase);
+    }
+    for (ThreadHistograms **link = &registry; *link != NULL; link = &(*link)->next) {
+        if (*link == thread) {
+            *link = thread->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    free(thread);
+}
+
+static void histogram_registry_init() {
+    pthread_key_create(&registry_key, histogram_thread_exit);
+}
+
+// Per-thread counters use malloc directly, like trace buffers: they live
+// until the thread exits, past any arena reset or allocator switch
+static ThreadHistograms *histogram_local() {
+    if (local != NULL) return local;
+
+    pthread_once(&registry_once, histogram_registry_init);
+    local = calloc(1, sizeof(ThreadHistograms));
+    if (local == NULL) return NULL;
+
+    pthread_mutex_lock(&registry_lock);
+    local->next = registry;
+    registry = local;
+    pthread_mutex_unlock(&registry_lock);
+
+    pthread_setspecific(registry_key, local);
+    return local;
+}
+
+static unsigned histogram_msb(uint64_t value) {
+#if defined(__GNUC__)
+    return 63 - (unsigned)__builtin_clzll(value);
+#else
+    unsigned msb = 0;
+    while (value >>= 1) msb++;
+    return msb;
+#endif
+}
+
+static size_t histogram_bucket(uint64_t value) {
+    if (value < CALC_HISTOGRAM_SUB_COUNT) return (size_t)value;
+    unsigned msb = histogram_msb(value);
+    unsigned shift = msb - CALC_HISTOGRAM_SUB_BITS;
+    size_t sub = (size_t)(value >> shift) & (CALC_HISTOGRAM_SUB_COUNT - 1);
+    return CALC_HISTOGRAM_SUB_COUNT * (shift + 1) + sub;
+}
+
+// Largest value that lands in `bucket`
+static uint64_t histogram_bucket_max(size_t bucket) {
+    if (bucket < CALC_HISTOGRAM_SUB_COUNT) return bucket;
+    unsigned shift = (unsigned)(bucket / CALC_HISTOGRAM_SUB_COUNT) - 1;
+    uint64_t sub = bucket % CALC_HISTOGRAM_SUB_COUNT;
+    uint64_t low = ((uint64_t)CALC_HISTOGRAM_SUB_COUNT | sub) << shift;
+    return low + ((1ULL << shift) - 1);
+}
+
+void calc_histogram_record(CalcPhase phase, uint64_t ns) {
+    ThreadHistograms *thread = histogram_local();
+    if (thread == NULL) return;
+    _Atomic uint64_t *count = &thread->counts[phase][histogram_bucket(ns)];
+    atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_store_explicit(&thread->sum[phase], atomic_load_explicit(&thread->sum[phase], memory_order_relaxed) + ns, memory_order_relaxed);
+    if (ns > atomic_load_explicit(&thread->max[phase], memory_order_relaxed)) {
+        atomic_store_explicit(&thread->max[phase], ns, memory_order_relaxed);
+    }
+}
+
+// Totals since the process started; callers hold registry_lock
+static void histogram_merge_all(CalcPhase phase, CalcHistogram *out) {
+    *out = retired[phase];
+    for (ThreadHistograms *thread = registry; thread != NULL; thread = thread->next) {
+        histogram_merge_thread(out, thread, phase);
+    }
+}
+
+void calc_histogram_snapshot(CalcPhase phase, CalcHistogram *out) {
+    pthread_mutex_lock(&registry_lock);
+    histogram_merge_all(phase, out);
+    for (size_t i = 0; i < CALC_HISTOGRAM_BUCKETS; i++) {
+        out->counts[i] -= baseline[phase].counts[i];
+    }
+    out->total -= baseline[phase].total;
+    out->sum -= baseline[phase].sum;
+    // A maximum cannot be rolled back, so it is kept only while samples
+    // since the reset could have produced it
+    if (out->total == 0) {
+        out->max = 0;
+    } else {
+        for (size_t i = CALC_HISTOGRAM_BUCKETS; i-- > 0;) {
+            if (out->counts[i] == 0) continue;
+            if (out->max > histogram_bucket_max(i)) out->max = histogram_bucket_max(i);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+// Writers never block on a reset; it only moves the baseline
+void calc_histogram_reset() {
+    pthread_mutex_lock(&registry_lock);
+    for (int phase = 0; phase < CALC_PHASE_COUNT; phase++) {
+        histogram_merge_all((CalcPhase)phase, &baseline[phase]);
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+uint64_t calc_histogram_percentile(const CalcHistogram *histogram, double percentile) {
+    if (histogram->total == 0) return 0;
+
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)histogram->total + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > histogram->total) rank = histogram->total;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < CALC_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            uint64_t value = histogram_bucket_max(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
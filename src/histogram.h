@@ -0,0 +1,48 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include "calc.h"
+
+// Log-linear buckets: values below 32 get their own bucket, larger ones
+// share a bucket with values within 1/32 of them
+#define CALC_HISTOGRAM_SUB_BITS 5
+#define CALC_HISTOGRAM_SUB_COUNT (1u << CALC_HISTOGRAM_SUB_BITS)
+#define CALC_HISTOGRAM_BUCKETS (CALC_HISTOGRAM_SUB_COUNT * (64 - CALC_HISTOGRAM_SUB_BITS + 1))
+
+typedef enum {
+    CALC_PHASE_PARSE,   // ast_build and ast_build_strict
+    CALC_PHASE_EVAL,    // ast_eval
+    CALC_PHASE_COUNT
+} CalcPhase;
+
+typedef struct {
+    uint64_t counts[CALC_HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} CalcHistogram;
+
+// Adds one latency sample to the calling thread's histogram. Building
+// with -DCALC_HISTOGRAMS makes ast_build and ast_eval record every call;
+// without it the hooks compile to nothing. ast_eval_budget and
+// ast_eval_parallel also record one sample per call.
+void calc_histogram_record(CalcPhase phase, uint64_t ns);
+
+// Merges every thread's samples since the last reset into `out`
+void calc_histogram_snapshot(CalcPhase phase, CalcHistogram *out);
+
+void calc_histogram_reset();
+
+// Value at `percentile` (0-100), accurate to the bucket width
+uint64_t calc_histogram_percentile(const CalcHistogram *histogram, double percentile);
+
+#ifdef CALC_HISTOGRAMS
+#define CALC_HISTOGRAM_START(name) uint64_t name = calc_time_ns()
+#define CALC_HISTOGRAM_STOP(name, phase) calc_histogram_record(phase, calc_time_ns() - (name))
+#else
+#define CALC_HISTOGRAM_START(name) ((void)0)
+#define CALC_HISTOGRAM_STOP(name, phase) ((void)0)
+#endif
+
+#endif
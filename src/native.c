@@ -0,0 +1,301 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <errno.h>
+#include "native.h"
+#include "codegen.h"
+#include "trace.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#include <process.h>
+#define NATIVE_LIB_EXT ".dll"
+#define NATIVE_CC_FLAGS "-O2 -ffp-contract=off -shared"
+#else
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define NATIVE_LIB_EXT ".so"
+#define NATIVE_CC_FLAGS "-O2 -ffp-contract=off -shared -fPIC"
+#endif
+
+#define NATIVE_PATH_MAX 1024
+#define NATIVE_MAX_ARGS 64
+
+static const char *native_prelude =
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "#include <math.h>\n"
+    "\n"
+    "static double calc_div(double left, double right) {\n"
+    "    if (right == 0) {\n"
+    "        fprintf(stderr, \"Error: Division by zero\\n\");\n"
+    "        exit(1);\n"
+    "    }\n"
+    "    return left / right;\n"
+    "}\n"
+    "\n"
+    "static double calc_null(void) {\n"
+    "    fprintf(stderr, \"Error: NULL node in evaluation\\n\");\n"
+    "    exit(1);\n"
+    "}\n"
+    "\n";
+
+static char *native_generate(ASTNode *root, size_t *length, size_t *capacity) {
+    FILE *file = tmpfile();
+    if (file == NULL) return NULL;
+
+    fputs(native_prelude, file);
+    fputs("double calc_expr(void) {\n    return ", file);
+    codegen_emit_checked_expr(file, root);
+    fputs(";\n}\n", file);
+
+    long size = ftell(file);
+    char *source = calc_alloc((size_t)size + 1);
+    rewind(file);
+    *length = fread(source, 1, (size_t)size, file);
+    source[*length] = '\0';
+    *capacity = (size_t)size + 1;
+    fclose(file);
+    return source;
+}
+
+static uint64_t native_hash(const char *data, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// snprintf that fails instead of truncating, so a long $HOME can never
+// make the build or dlopen target a different file
+static bool native_format(char *out, size_t size, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(out, size, format, args);
+    va_end(args);
+    return written >= 0 && (size_t)written < size;
+}
+
+#ifdef _WIN32
+static bool native_ensure_dir(const char *dir) {
+    return _mkdir(dir) == 0 || errno == EEXIST;
+}
+
+// %TEMP% is already private to the user
+static bool native_cache_dir(char *path, size_t size) {
+    const char *dir = getenv("CALC_NATIVE_CACHE");
+    bool fits;
+    if (dir != NULL && *dir != '\0') {
+        fits = native_format(path, size, "%s", dir);
+    } else {
+        const char *temp = getenv("TEMP");
+        fits = native_format(path, size, "%s\\calc-native", temp ? temp : ".");
+    }
+    return fits && native_ensure_dir(path);
+}
+
+static bool native_trusted(const char *path, bool directory) {
+    (void)directory;
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return false;
+    fclose(file);
+    return true;
+}
+#else
+static bool native_ensure_dir(const char *dir) {
+    return mkdir(dir, 0700) == 0 || errno == EEXIST;
+}
+
+// Whatever is loaded from the cache runs in this process, so only files
+// and directories that no other user could have written are used
+static bool native_trusted(const char *path, bool directory) {
+    struct stat info;
+    if (lstat(path, &info) != 0) return false;
+    if (directory ? !S_ISDIR(info.st_mode) : !S_ISREG(info.st_mode)) return false;
+    return info.st_uid == geteuid() && (info.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+// $CALC_NATIVE_CACHE, else calc-native under $XDG_CACHE_HOME or
+// $HOME/.cache. False when there is none or it is not private.
+static bool native_cache_dir(char *path, size_t size) {
+    const char *dir = getenv("CALC_NATIVE_CACHE");
+    if (dir != NULL && *dir != '\0') {
+        if (!native_format(path, size, "%s", dir)) return false;
+    } else {
+        char base[NATIVE_PATH_MAX];
+        const char *xdg = getenv("XDG_CACHE_HOME");
+        if (xdg != NULL && *xdg != '\0') {
+            if (!native_format(base, sizeof(base), "%s", xdg)) return false;
+        } else {
+            const char *home = getenv("HOME");
+            if (home == NULL || *home == '\0') return false;
+            if (!native_format(base, sizeof(base), "%s/.cache", home)) return false;
+        }
+        if (!native_ensure_dir(base) || !native_format(path, size, "%s/calc-native", base)) return false;
+    }
+    return native_ensure_dir(path) && native_trusted(path, true);
+}
+#endif
+
+// Runs $CALC_CC (default "cc"), split on spaces, with NATIVE_CC_FLAGS.
+// The paths are passed as arguments of their own rather than through a
+// shell, so no character in them is ever interpreted.
+static bool native_run_compiler(const char *output, const char *input) {
+    const char *cc = getenv("CALC_CC");
+    char words[NATIVE_PATH_MAX];
+    if (!native_format(words, sizeof(words), "%s " NATIVE_CC_FLAGS, cc && *cc ? cc : "cc")) return false;
+
+    char *argv[NATIVE_MAX_ARGS];
+    size_t argc = 0;
+    for (char *c = words; *c != '\0';) {
+        if (*c == ' ') {
+            *c++ = '\0';
+            continue;
+        }
+        if (argc + 4 > NATIVE_MAX_ARGS) return false;
+        argv[argc++] = c;
+        while (*c != '\0' && *c != ' ') c++;
+    }
+    argv[argc++] = "-o";
+#ifdef _WIN32
+    // _spawnvp joins its arguments into one command line, so the paths
+    // are quoted and a quote inside them is refused
+    char quoted_output[NATIVE_PATH_MAX + 2];
+    char quoted_input[NATIVE_PATH_MAX + 2];
+    if (strchr(output, '"') != NULL || strchr(input, '"') != NULL ||
+        !native_format(quoted_output, sizeof(quoted_output), "\"%s\"", output) ||
+        !native_format(quoted_input, sizeof(quoted_input), "\"%s\"", input)) {
+        return false;
+    }
+    argv[argc++] = quoted_output;
+    argv[argc++] = quoted_input;
+    argv[argc] = NULL;
+    return _spawnvp(_P_WAIT, argv[0], (const char *const *)argv) == 0;
+#else
+    argv[argc++] = (char *)output;
+    argv[argc++] = (char *)input;
+    argv[argc] = NULL;
+
+    pid_t pid = fork();
+    if (pid < 0) return false;
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return false;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#endif
+}
+
+static bool native_build(const char *dir, const char *source, size_t length, uint64_t hash, const char *library) {
+    char source_path[NATIVE_PATH_MAX];
+    char temp_path[NATIVE_PATH_MAX];
+
+#ifdef _WIN32
+    int id = (int)GetCurrentProcessId();
+#else
+    int id = (int)getpid();
+#endif
+
+    if (!native_format(source_path, sizeof(source_path), "%s/calc_%016llx_%d.c", dir, (unsigned long long)hash, id) ||
+        !native_format(temp_path, sizeof(temp_path), "%s/calc_%016llx_%d" NATIVE_LIB_EXT, dir, (unsigned long long)hash, id)) {
+        return false;
+    }
+
+    FILE *file = fopen(source_path, "wb");
+    if (file == NULL) return false;
+    bool written = fwrite(source, 1, length, file) == length;
+    fclose(file);
+    if (!written) {
+        remove(source_path);
+        return false;
+    }
+
+    bool compiled = native_run_compiler(temp_path, source_path);
+    remove(source_path);
+
+    // Compile under a per-process name and rename into place, so processes
+    // sharing the cache never load a half-written library. The rename also
+    // replaces a cached file that failed native_trusted.
+#ifndef _WIN32
+    if (compiled) compiled = chmod(temp_path, 0700) == 0;
+#endif
+    if (!compiled || rename(temp_path, library) != 0) {
+        remove(temp_path);
+        return false;
+    }
+    return true;
+}
+
+NativeExpr *native_compile(ASTNode *root) {
+    size_t length;
+    size_t capacity;
+    char *source = native_generate(root, &length, &capacity);
+    if (source == NULL) return NULL;
+
+    uint64_t hash = native_hash(source, length);
+    char dir[NATIVE_PATH_MAX];
+    char library[NATIVE_PATH_MAX];
+    if (!native_cache_dir(dir, sizeof(dir)) ||
+        !native_format(library, sizeof(library), "%s/calc_%016llx" NATIVE_LIB_EXT, dir, (unsigned long long)hash)) {
+        calc_free(source, capacity);
+        return NULL;
+    }
+
+    CALC_TRACE_BEGIN(trace_start);
+    bool ready = native_trusted(library, false) ||
+                 (native_build(dir, source, length, hash, library) && native_trusted(library, false));
+    CALC_TRACE_END(trace_start, "native_compile", "compile");
+    calc_free(source, capacity);
+    if (!ready) return NULL;
+
+#ifdef _WIN32
+    HMODULE handle = LoadLibraryA(library);
+    if (handle == NULL) return NULL;
+    NativeFn fn = (NativeFn)GetProcAddress(handle, "calc_expr");
+    if (fn == NULL) {
+        FreeLibrary(handle);
+        return NULL;
+    }
+#else
+    void *handle = dlopen(library, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL) return NULL;
+    NativeFn fn;
+    *(void **)&fn = dlsym(handle, "calc_expr");
+    if (fn == NULL) {
+        dlclose(handle);
+        return NULL;
+    }
+#endif
+
+    NativeExpr *expr = calc_alloc(sizeof(NativeExpr));
+    expr->handle = (void *)handle;
+    expr->fn = fn;
+    expr->hash = hash;
+    return expr;
+}
+
+double native_run(const NativeExpr *expr) {
+    return expr->fn();
+}
+
+void native_free(NativeExpr *expr) {
+    if (expr == NULL) return;
+#ifdef _WIN32
+    FreeLibrary((HMODULE)expr->handle);
+#else
+    dlclose(expr->handle);
+#endif
+    calc_free(expr, sizeof(NativeExpr));
+}
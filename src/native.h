@@ -0,0 +1,31 @@
+#ifndef NATIVE_H
+#define NATIVE_H
+
+#include <stdint.h>
+#include "calc.h"
+
+typedef double (*NativeFn)(void);
+
+// Expression compiled to a shared library by the system C compiler
+typedef struct {
+    void *handle;
+    NativeFn fn;
+    uint64_t hash;  // FNV-1a of the generated source, names the cache entry
+} NativeExpr;
+
+// Emits C for `root`, compiles it with $CALC_CC (default "cc", split on
+// spaces and run without a shell) into the cache directory and loads it. The cache is $CALC_NATIVE_CACHE, or
+// calc-native under $XDG_CACHE_HOME or $HOME/.cache, created mode 0700.
+// Libraries already in the cache are loaded without recompiling when
+// they and the directory belong to the user and are not group or world
+// writable; otherwise the library is rebuilt, and a directory that fails
+// the check is not used at all. Returns NULL when compiling or loading
+// fails, or a cache path does not fit, so callers can fall back to
+// another engine.
+NativeExpr *native_compile(ASTNode *root);
+
+double native_run(const NativeExpr *expr);
+
+void native_free(NativeExpr *expr);
+
+#endif
@@ -0,0 +1,520 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <ctype.h>
+#include "parallel.h"
+#include "histogram.h"
+#include "stats.h"
+#include "trace.h"
+#include "capture.h"
+
+typedef struct Worker Worker;
+
+typedef struct Task {
+    void (*run)(struct Task *task, Worker *worker);
+    atomic_bool done;
+} Task;
+
+typedef struct {
+    Task task;
+    ASTNode *node;
+    double result;
+} EvalTask;
+
+// One index of a parallel_for loop
+typedef struct {
+    Task task;
+    void (*body)(void *arg, size_t index);
+    void *arg;
+    size_t index;
+} ForTask;
+
+// Owner pushes and pops at the bottom, thieves take from the top
+typedef struct {
+    pthread_mutex_t lock;
+    Task **tasks;
+    size_t top;
+    size_t bottom;
+    size_t capacity;
+} TaskDeque;
+
+struct Worker {
+    ThreadPool *pool;
+    size_t index;
+    unsigned seed;
+};
+
+struct ThreadPool {
+    size_t thread_count;
+    pthread_t *threads;
+    Worker *workers;
+    TaskDeque *deques;
+    size_t grain;
+    pthread_mutex_t job_lock;       // Serializes ast_eval_parallel calls
+    pthread_mutex_t state_lock;
+    pthread_cond_t state_changed;
+    bool active;                    // A parallel evaluation is running
+    bool stopping;
+};
+
+static void deque_init(TaskDeque *deque) {
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->capacity = 64;
+    deque->tasks = calc_alloc(deque->capacity * sizeof(Task *));
+    deque->top = 0;
+    deque->bottom = 0;
+}
+
+static void deque_destroy(TaskDeque *deque) {
+    pthread_mutex_destroy(&deque->lock);
+    calc_free(deque->tasks, deque->capacity * sizeof(Task *));
+}
+
+static void deque_push(TaskDeque *deque, Task *task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom == deque->capacity) {
+        // Slide live entries down before growing
+        size_t live = deque->bottom - deque->top;
+        if (deque->top > deque->capacity / 2) {
+            for (size_t i = 0; i < live; i++) deque->tasks[i] = deque->tasks[deque->top + i];
+        } else {
+            size_t capacity = deque->capacity * 2;
+            deque->tasks = calc_realloc(deque->tasks, deque->capacity * sizeof(Task *), capacity * sizeof(Task *));
+            deque->capacity = capacity;
+            for (size_t i = 0; i < live; i++) deque->tasks[i] = deque->tasks[deque->top + i];
+        }
+        deque->top = 0;
+        deque->bottom = live;
+    }
+    deque->tasks[deque->bottom++] = task;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static Task *deque_pop(TaskDeque *deque) {
+    Task *task = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) {
+        task = deque->tasks[--deque->bottom];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+static Task *deque_steal(TaskDeque *deque) {
+    Task *task = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top) {
+        task = deque->tasks[deque->top++];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+static void parallel_run_task(Worker *worker, Task *task) {
+    task->run(task, worker);
+    atomic_store_explicit(&task->done, true, memory_order_release);
+}
+
+static bool parallel_steal_one(Worker *worker) {
+    ThreadPool *pool = worker->pool;
+    size_t start = (size_t)rand_r(&worker->seed) % pool->thread_count;
+
+    for (size_t i = 0; i < pool->thread_count; i++) {
+        size_t victim = (start + i) % pool->thread_count;
+        if (victim == worker->index) continue;
+        Task *task = deque_steal(&pool->deques[victim]);
+        if (task != NULL) {
+            parallel_run_task(worker, task);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Runs `task` here if nobody stole it, otherwise helps with other work
+// until the thief finishes it
+static void parallel_join(Worker *worker, Task *task) {
+    if (deque_pop(&worker->pool->deques[worker->index]) == task) {
+        parallel_run_task(worker, task);
+        return;
+    }
+    while (!atomic_load_explicit(&task->done, memory_order_acquire)) {
+        if (!parallel_steal_one(worker)) sched_yield();
+    }
+}
+
+static void parallel_for_run(Task *task, Worker *worker) {
+    (void)worker;
+    ForTask *item = (ForTask *)task;
+    item->body(item->arg, item->index);
+}
+
+// Calls body(arg, i) for every i below `count` across the pool. Only
+// valid between parallel_begin and parallel_end.
+static void parallel_for(ThreadPool *pool, size_t count, void (*body)(void *arg, size_t index), void *arg) {
+    Worker *worker = &pool->workers[0];
+    ForTask *items = calc_alloc(count * sizeof(ForTask));
+    for (size_t i = 0; i < count; i++) {
+        items[i] = (ForTask){{parallel_for_run, false}, body, arg, i};
+        deque_push(&pool->deques[0], &items[i].task);
+    }
+    for (size_t i = count; i-- > 0;) {
+        parallel_join(worker, &items[i].task);
+    }
+    calc_free(items, count * sizeof(ForTask));
+}
+
+static double parallel_apply_binary(char op, double left, double right) {
+    switch (op) {
+        case '+': return left + right;
+        case '-': return left - right;
+        case '*': return left * right;
+        case '/':
+            if (right == 0) {
+                fprintf(stderr, "Error: Division by zero\n");
+                exit(1);
+            }
+            return left / right;
+        default:
+            fprintf(stderr, "Error: Unknown binary operator %c\n", op);
+            exit(1);
+    }
+}
+
+static double parallel_eval_node(Worker *worker, ASTNode *node);
+
+static void parallel_eval_run(Task *task, Worker *worker) {
+    EvalTask *eval = (EvalTask *)task;
+    eval->result = parallel_eval_node(worker, eval->node);
+}
+
+static double parallel_eval_node(Worker *worker, ASTNode *node) {
+    size_t grain = worker->pool->grain;
+    if (node == NULL || node->size <= grain) {
+        return ast_eval_subtree(node);
+    }
+
+    if (node->type == NODE_UNARY_OP) {
+        double operand = parallel_eval_node(worker, node->unary.operand);
+        switch (node->unary.operator) {
+            case '-': return -operand;
+            case '+': return operand;
+            default:
+                fprintf(stderr, "Error: Unknown unary operator %c\n", node->unary.operator);
+                exit(1);
+        }
+    }
+    if (node->type != NODE_BINARY_OP) {
+        return ast_eval_subtree(node);
+    }
+
+    ASTNode *left = node->binary.left;
+    ASTNode *right = node->binary.right;
+    if (left == NULL || right == NULL || left->size <= grain || right->size <= grain) {
+        // Forking a small side would cost more than evaluating it here
+        double left_value = parallel_eval_node(worker, left);
+        double right_value = parallel_eval_node(worker, right);
+        return parallel_apply_binary(node->binary.operator, left_value, right_value);
+    }
+
+    EvalTask task = {{parallel_eval_run, false}, right, 0};
+    deque_push(&worker->pool->deques[worker->index], &task.task);
+    double left_value = parallel_eval_node(worker, left);
+    parallel_join(worker, &task.task);
+
+    return parallel_apply_binary(node->binary.operator, left_value, task.result);
+}
+
+static void *parallel_worker_main(void *arg) {
+    Worker *worker = arg;
+    ThreadPool *pool = worker->pool;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->state_lock);
+        while (!pool->active && !pool->stopping) {
+            pthread_cond_wait(&pool->state_changed, &pool->state_lock);
+        }
+        bool stopping = pool->stopping;
+        pthread_mutex_unlock(&pool->state_lock);
+        if (stopping) return NULL;
+
+        // Steal until the evaluation that woke us completes
+        for (;;) {
+            pthread_mutex_lock(&pool->state_lock);
+            bool active = pool->active;
+            pthread_mutex_unlock(&pool->state_lock);
+            if (!active) break;
+            if (!parallel_steal_one(worker)) sched_yield();
+        }
+    }
+}
+
+ThreadPool *thread_pool_create(size_t threads) {
+    if (threads == 0) threads = 1;
+
+    ThreadPool *pool = calc_alloc(sizeof(ThreadPool));
+    pool->thread_count = threads;
+    pool->threads = calc_alloc(threads * sizeof(pthread_t));
+    pool->workers = calc_alloc(threads * sizeof(Worker));
+    pool->deques = calc_alloc(threads * sizeof(TaskDeque));
+    pool->grain = PARALLEL_DEFAULT_GRAIN;
+    pool->active = false;
+    pool->stopping = false;
+    pthread_mutex_init(&pool->job_lock, NULL);
+    pthread_mutex_init(&pool->state_lock, NULL);
+    pthread_cond_init(&pool->state_changed, NULL);
+
+    for (size_t i = 0; i < threads; i++) {
+        deque_init(&pool->deques[i]);
+        pool->workers[i] = (Worker){pool, i, (unsigned)i * 2654435761u + 1};
+    }
+    for (size_t i = 1; i < threads; i++) {
+        pthread_create(&pool->threads[i], NULL, parallel_worker_main, &pool->workers[i]);
+    }
+    return pool;
+}
+
+void thread_pool_destroy(ThreadPool *pool) {
+    if (pool == NULL) return;
+
+    pthread_mutex_lock(&pool->state_lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->state_changed);
+    pthread_mutex_unlock(&pool->state_lock);
+
+    for (size_t i = 1; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    for (size_t i = 0; i < pool->thread_count; i++) {
+        deque_destroy(&pool->deques[i]);
+    }
+
+    pthread_cond_destroy(&pool->state_changed);
+    pthread_mutex_destroy(&pool->state_lock);
+    pthread_mutex_destroy(&pool->job_lock);
+    calc_free(pool->deques, pool->thread_count * sizeof(TaskDeque));
+    calc_free(pool->workers, pool->thread_count * sizeof(Worker));
+    calc_free(pool->threads, pool->thread_count * sizeof(pthread_t));
+    calc_free(pool, sizeof(ThreadPool));
+}
+
+// Wakes the workers for one job; the caller runs as worker 0
+static void parallel_begin(ThreadPool *pool) {
+    pthread_mutex_lock(&pool->job_lock);
+    pthread_mutex_lock(&pool->state_lock);
+    pool->active = true;
+    pthread_cond_broadcast(&pool->state_changed);
+    pthread_mutex_unlock(&pool->state_lock);
+}
+
+static void parallel_end(ThreadPool *pool) {
+    pthread_mutex_lock(&pool->state_lock);
+    pool->active = false;
+    pthread_mutex_unlock(&pool->state_lock);
+    pthread_mutex_unlock(&pool->job_lock);
+}
+
+double ast_eval_parallel(ThreadPool *pool, ASTNode *root, size_t grain) {
+    if (pool->thread_count == 1 || root == NULL || root->size <= grain) {
+        return ast_eval(root);
+    }
+
+    calc_stats_add(CALC_STAT_EVALUATIONS, 1);
+    CALC_HISTOGRAM_START(histogram_start);
+    CALC_TRACE_BEGIN(trace_start);
+    parallel_begin(pool);
+    pool->grain = grain;
+    double result = parallel_eval_node(&pool->workers[0], root);
+    parallel_end(pool);
+    CALC_TRACE_END(trace_start, "ast_eval_parallel", "eval");
+    CALC_HISTOGRAM_STOP(histogram_start, CALC_PHASE_EVAL);
+    return result;
+}
+
+/* ===== Parallel parsing ===== */
+// The input is cut into blocks. A first pass finds each block's net
+// parenthesis depth; a prefix sum over those gives every block its
+// starting depth, so a second pass can find the first top-level binary
+// + or - in each block independently. Those operators split the sum into
+// chunks that parse separately into left spines, and linking each spine's
+// bottom node to the previous chunk rebuilds parser_expr's tree exactly.
+typedef struct {
+    const char *input;
+    size_t length;
+    size_t block_count;
+    long *depth;            // Net depth change, then depth at block start
+    long *min_depth;        // Lowest depth reached, relative to block start
+    bool *malformed;
+    size_t *split;          // First top-level additive operator, or SIZE_MAX
+    ASTNode **roots;
+    ASTNode **holes;
+    uint64_t *offsets;      // Nodes in all earlier chunks
+} ParallelParse;
+
+static size_t parse_block_start(const ParallelParse *parse, size_t block) {
+    return (size_t)((uint64_t)parse->length * block / parse->block_count);
+}
+
+static void parse_scan_depth(void *arg, size_t block) {
+    ParallelParse *parse = arg;
+    size_t end = parse_block_start(parse, block + 1);
+    long depth = 0;
+    long min_depth = 0;
+    bool malformed = false;
+
+    for (size_t i = parse_block_start(parse, block); i < end; i++) {
+        char c = parse->input[i];
+        if (c == '(') {
+            depth++;
+        } else if (c == ')') {
+            if (--depth < min_depth) min_depth = depth;
+        } else if (!isdigit((unsigned char)c) && !isspace((unsigned char)c) && strchr(".+-*/", c) == NULL) {
+            malformed = true;
+        }
+    }
+    parse->depth[block] = depth;
+    parse->min_depth[block] = min_depth;
+    parse->malformed[block] = malformed;
+}
+
+// A + or - is binary when the previous token ends an operand
+static bool parse_is_binary(const char *input, size_t position) {
+    while (position > 0 && isspace((unsigned char)input[position - 1])) position--;
+    if (position == 0) return false;
+    char c = input[position - 1];
+    return isdigit((unsigned char)c) || c == '.' || c == ')';
+}
+
+static void parse_find_split(void *arg, size_t block) {
+    ParallelParse *parse = arg;
+    size_t end = parse_block_start(parse, block + 1);
+    long depth = parse->depth[block];
+
+    parse->split[block] = SIZE_MAX;
+    for (size_t i = parse_block_start(parse, block); i < end; i++) {
+        char c = parse->input[i];
+        if (c == '(') {
+            depth++;
+        } else if (c == ')') {
+            depth--;
+        } else if (depth == 0 && (c == '+' || c == '-') && parse_is_binary(parse->input, i)) {
+            parse->split[block] = i;
+            return;
+        }
+    }
+}
+
+static void parse_chunk(void *arg, size_t block) {
+    ParallelParse *parse = arg;
+    size_t start = parse->split[block];
+    if (start == SIZE_MAX) {
+        parse->roots[block] = NULL;
+        return;
+    }
+
+    size_t end = parse->length;
+    for (size_t next = block + 1; next < parse->block_count; next++) {
+        if (parse->split[next] != SIZE_MAX) {
+            end = parse->split[next];
+            break;
+        }
+    }
+    CALC_TRACE_BEGIN(trace_start);
+    parse->roots[block] = ast_build_sum_chunk(parse->input + start, end - start, block != 0, &parse->holes[block]);
+    CALC_TRACE_END(trace_start, "parse_chunk", "parse");
+}
+
+// Adds the nodes of earlier chunks to the sizes along a chunk's spine
+static void parse_fix_sizes(void *arg, size_t block) {
+    ParallelParse *parse = arg;
+    uint64_t offset = parse->offsets[block];
+    if (parse->roots[block] == NULL || offset == 0) return;
+
+    for (ASTNode *node = parse->roots[block];; node = node->binary.left) {
+        uint64_t size = node->size + offset;
+        node->size = size > UINT32_MAX ? UINT32_MAX : (uint32_t)size;
+        if (node == parse->holes[block]) break;
+    }
+}
+
+ASTNode *ast_build_parallel(ThreadPool *pool, const char *expression, size_t grain) {
+    CALC_CAPTURE(expression);
+    size_t length = strlen(expression);
+    size_t block_count = pool->thread_count * 4;
+    if (grain > 0 && length / grain < block_count) block_count = length / grain;
+    if (pool->thread_count == 1 || block_count < 2) {
+        return ast_build_uncaptured(expression);
+    }
+
+    ParallelParse parse;
+    parse.input = expression;
+    parse.length = length;
+    parse.block_count = block_count;
+    parse.depth = calc_alloc(block_count * sizeof(long));
+    parse.min_depth = calc_alloc(block_count * sizeof(long));
+    parse.malformed = calc_alloc(block_count * sizeof(bool));
+    parse.split = calc_alloc(block_count * sizeof(size_t));
+    parse.roots = calc_alloc(block_count * sizeof(ASTNode *));
+    parse.holes = calc_alloc(block_count * sizeof(ASTNode *));
+    parse.offsets = calc_alloc(block_count * sizeof(uint64_t));
+
+    CALC_TRACE_BEGIN(trace_start);
+    parallel_begin(pool);
+    parallel_for(pool, block_count, parse_scan_depth, &parse);
+
+    // Unbalanced or unexpected input goes to the sequential parser, which
+    // decides how much of it forms a tree
+    bool sequential = false;
+    long depth = 0;
+    for (size_t i = 0; i < block_count; i++) {
+        long delta = parse.depth[i];
+        if (parse.malformed[i] || depth + parse.min_depth[i] < 0) sequential = true;
+        parse.depth[i] = depth;
+        depth += delta;
+    }
+    if (depth != 0) sequential = true;
+
+    ASTNode *root = NULL;
+    if (!sequential) {
+        parallel_for(pool, block_count, parse_find_split, &parse);
+        parse.split[0] = 0;
+        parallel_for(pool, block_count, parse_chunk, &parse);
+
+        for (size_t i = 0; i < block_count; i++) {
+            if (parse.split[i] != SIZE_MAX && parse.roots[i] == NULL) sequential = true;
+        }
+
+        uint64_t nodes = 0;
+        for (size_t i = 0; i < block_count; i++) {
+            if (parse.split[i] == SIZE_MAX) continue;
+            if (sequential) {
+                ast_free(parse.roots[i]);
+                continue;
+            }
+            if (root != NULL) parse.holes[i]->binary.left = root;
+            parse.offsets[i] = nodes;
+            nodes += parse.roots[i]->size;
+            root = parse.roots[i];
+        }
+        if (!sequential) {
+            parallel_for(pool, block_count, parse_fix_sizes, &parse);
+        }
+    }
+    parallel_end(pool);
+    CALC_TRACE_END(trace_start, "ast_build_parallel", "parse");
+
+    calc_free(parse.offsets, block_count * sizeof(uint64_t));
+    calc_free(parse.holes, block_count * sizeof(ASTNode *));
+    calc_free(parse.roots, block_count * sizeof(ASTNode *));
+    calc_free(parse.split, block_count * sizeof(size_t));
+    calc_free(parse.malformed, block_count * sizeof(bool));
+    calc_free(parse.min_depth, block_count * sizeof(long));
+    calc_free(parse.depth, block_count * sizeof(long));
+
+    return sequential ? ast_build_uncaptured(expression) : root;
+}
@@ -0,0 +1,31 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stddef.h>
+#include "calc.h"
+
+#define PARALLEL_DEFAULT_GRAIN 16384        // Subtrees smaller than this run sequentially
+#define PARALLEL_PARSE_DEFAULT_GRAIN 65536  // Minimum bytes per parse chunk
+
+typedef struct ThreadPool ThreadPool;
+
+// Starts `threads - 1` workers; the thread calling into the pool is the
+// remaining one. A pool runs one parallel evaluation at a time.
+ThreadPool *thread_pool_create(size_t threads);
+
+void thread_pool_destroy(ThreadPool *pool);
+
+// Evaluates `root` on the pool. Binary nodes whose children both exceed
+// `grain` nodes (see ASTNode.size) fork their right child as a task that
+// idle workers steal; smaller subtrees use ast_eval. The result is
+// bit-identical to ast_eval since the tree shape is unchanged.
+double ast_eval_parallel(ThreadPool *pool, ASTNode *root, size_t grain);
+
+// Parses `expression` into the same tree as ast_build, splitting it at
+// top-level binary + and - into chunks of at least `grain` bytes that
+// parse on the pool. Input that is unbalanced or fails to parse in chunks
+// is handed to ast_build whole. Nodes are allocated on the worker
+// threads, so the installed CalcAllocator must be thread-safe.
+ASTNode *ast_build_parallel(ThreadPool *pool, const char *expression, size_t grain);
+
+#endif
@@ -0,0 +1,85 @@
+#include <pthread.h>
+#include "stats.h"
+
+_Thread_local CalcStatsBlock calc_stats_block;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static CalcStatsBlock *stats_blocks = NULL;
+static uint64_t stats_retired[CALC_STAT_COUNT];     // Counts from threads that exited
+static uint64_t stats_baseline[CALC_STAT_COUNT];    // Totals at the last reset
+
+static void stats_thread_exit(void *arg) {
+    CalcStatsBlock *block = arg;
+
+    pthread_mutex_lock(&stats_lock);
+    for (int i = 0; i < CALC_STAT_COUNT; i++) {
+        stats_retired[i] += atomic_load_explicit(&block->counters[i], memory_order_relaxed);
+        atomic_store_explicit(&block->counters[i], 0, memory_order_relaxed);
+    }
+    for (CalcStatsBlock **link = &stats_blocks; *link != NULL; link = &(*link)->next) {
+        if (*link == block) {
+            *link = block->next;
+            break;
+        }
+    }
+    // Destructors of other keys, such as the node pool's, may still count;
+    // they register the block again and it is folded on the next round
+    block->registered = false;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void stats_init() {
+    pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+void calc_stats_register() {
+    pthread_once(&stats_once, stats_init);
+
+    pthread_mutex_lock(&stats_lock);
+    calc_stats_block.next = stats_blocks;
+    stats_blocks = &calc_stats_block;
+    calc_stats_block.registered = true;
+    pthread_mutex_unlock(&stats_lock);
+
+    pthread_setspecific(stats_key, &calc_stats_block);
+}
+
+// Totals since the process started; callers hold stats_lock
+static void stats_totals(uint64_t totals[CALC_STAT_COUNT]) {
+    for (int i = 0; i < CALC_STAT_COUNT; i++) {
+        totals[i] = stats_retired[i];
+    }
+    for (CalcStatsBlock *block = stats_blocks; block != NULL; block = block->next) {
+        for (int i = 0; i < CALC_STAT_COUNT; i++) {
+            totals[i] += atomic_load_explicit(&block->counters[i], memory_order_relaxed);
+        }
+    }
+}
+
+void calc_stats(CalcStats *out) {
+    uint64_t totals[CALC_STAT_COUNT];
+
+    pthread_mutex_lock(&stats_lock);
+    stats_totals(totals);
+    for (int i = 0; i < CALC_STAT_COUNT; i++) {
+        totals[i] -= stats_baseline[i];
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    out->tokens_lexed = totals[CALC_STAT_TOKENS_LEXED];
+    out->nodes_allocated = totals[CALC_STAT_NODES_ALLOCATED];
+    out->nodes_freed = totals[CALC_STAT_NODES_FREED];
+    out->bytes_allocated = totals[CALC_STAT_BYTES_ALLOCATED];
+    out->bytes_freed = totals[CALC_STAT_BYTES_FREED];
+    out->evaluations = totals[CALC_STAT_EVALUATIONS];
+    out->division_by_zero = totals[CALC_STAT_DIVISION_BY_ZERO];
+    out->syntax_errors = totals[CALC_STAT_SYNTAX_ERRORS];
+}
+
+void calc_stats_reset() {
+    pthread_mutex_lock(&stats_lock);
+    stats_totals(stats_baseline);
+    pthread_mutex_unlock(&stats_lock);
+}
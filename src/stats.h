@@ -0,0 +1,60 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "calc.h"
+
+typedef enum {
+    CALC_STAT_TOKENS_LEXED,
+    CALC_STAT_NODES_ALLOCATED,
+    CALC_STAT_NODES_FREED,
+    CALC_STAT_BYTES_ALLOCATED,
+    CALC_STAT_BYTES_FREED,
+    CALC_STAT_EVALUATIONS,
+    CALC_STAT_DIVISION_BY_ZERO,
+    CALC_STAT_SYNTAX_ERRORS,
+    CALC_STAT_COUNT
+} CalcStat;
+
+// Totals across all threads since the last calc_stats_reset. Nodes and
+// bytes allocated minus freed give what is still live. A pooled node
+// counts as a freed node, but its bytes stay live until the pool is
+// trimmed.
+typedef struct {
+    uint64_t tokens_lexed;
+    uint64_t nodes_allocated;   // astnode_create_* calls
+    uint64_t nodes_freed;       // Nodes handed back to the pool or allocator
+    uint64_t bytes_allocated;   // Through calc_alloc and calc_realloc
+    uint64_t bytes_freed;
+    uint64_t evaluations;       // Top-level ast_eval, ast_eval_budget and ast_eval_parallel calls
+    uint64_t division_by_zero;
+    uint64_t syntax_errors;     // Parses that ast_build had to cut short
+} CalcStats;
+
+void calc_stats(CalcStats *out);
+
+void calc_stats_reset();
+
+// Each thread counts into its own block, registered on first use and
+// folded into a shared total when the thread exits
+typedef struct CalcStatsBlock {
+    _Atomic uint64_t counters[CALC_STAT_COUNT];
+    bool registered;
+    struct CalcStatsBlock *next;
+} CalcStatsBlock;
+
+extern _Thread_local CalcStatsBlock calc_stats_block;
+
+void calc_stats_register();
+
+// Only the owning thread writes its block, so a relaxed load and store
+// is enough and compiles to a plain add
+static inline void calc_stats_add(CalcStat stat, uint64_t amount) {
+    if (!calc_stats_block.registered) calc_stats_register();
+    _Atomic uint64_t *counter = &calc_stats_block.counters[stat];
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+#endif
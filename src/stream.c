@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "stream.h"
+#include "stats.h"
+
+#define STREAM_NUMBER_MAX 255  // Longest numeric literal, as in the Lexer
+
+// Shunting-yard over characters. Operators wait on `ops` until one of
+// lower or equal precedence arrives, which reproduces the left-leaning
+// trees of the recursive descent parser. Unary signs bind to the next
+// factor only, so they are applied as soon as that factor completes.
+struct CalcParser {
+    char *ops;              // Pending '(' , binary + - * / and unary 'p' 'n'
+    size_t op_count;
+    size_t op_capacity;
+    ASTNode **operands;
+    size_t operand_count;
+    size_t operand_capacity;
+    char number[STREAM_NUMBER_MAX + 1];
+    size_t number_length;
+    bool has_decimal;
+    bool expect_operand;    // Next token must start a factor
+    bool failed;
+};
+
+static void stream_reset(CalcParser *parser) {
+    for (size_t i = 0; i < parser->operand_count; i++) {
+        ast_free(parser->operands[i]);
+    }
+    parser->op_count = 0;
+    parser->operand_count = 0;
+    parser->number_length = 0;
+    parser->has_decimal = false;
+    parser->expect_operand = true;
+    parser->failed = false;
+}
+
+CalcParser *calc_parser_create() {
+    CalcParser *parser = calc_alloc(sizeof(CalcParser));
+    parser->ops = NULL;
+    parser->op_capacity = 0;
+    parser->operands = NULL;
+    parser->operand_capacity = 0;
+    parser->operand_count = 0;
+    stream_reset(parser);
+    return parser;
+}
+
+static void stream_push_op(CalcParser *parser, char op) {
+    if (parser->op_count == parser->op_capacity) {
+        size_t capacity = parser->op_capacity ? parser->op_capacity * 2 : 16;
+        parser->ops = calc_realloc(parser->ops, parser->op_capacity, capacity);
+        parser->op_capacity = capacity;
+    }
+    parser->ops[parser->op_count++] = op;
+}
+
+static void stream_push_operand(CalcParser *parser, ASTNode *node) {
+    if (parser->operand_count == parser->operand_capacity) {
+        size_t capacity = parser->operand_capacity ? parser->operand_capacity * 2 : 16;
+        parser->operands = calc_realloc(parser->operands, parser->operand_capacity * sizeof(ASTNode *), capacity * sizeof(ASTNode *));
+        parser->operand_capacity = capacity;
+    }
+    parser->operands[parser->operand_count++] = node;
+}
+
+static int stream_precedence(char op) {
+    return (op == '*' || op == '/') ? 2 : 1;
+}
+
+static bool stream_is_binary(char op) {
+    return op == '+' || op == '-' || op == '*' || op == '/';
+}
+
+static void stream_reduce_binary(CalcParser *parser) {
+    ASTNode *right = parser->operands[--parser->operand_count];
+    ASTNode *left = parser->operands[parser->operand_count - 1];
+    parser->operands[parser->operand_count - 1] = astnode_create_binary(parser->ops[--parser->op_count], left, right);
+}
+
+// A factor just completed: wrap it in the unary signs that precede it
+static void stream_complete_operand(CalcParser *parser) {
+    while (parser->op_count > 0 && (parser->ops[parser->op_count - 1] == 'n' || parser->ops[parser->op_count - 1] == 'p')) {
+        char op = parser->ops[--parser->op_count] == 'n' ? '-' : '+';
+        ASTNode **top = &parser->operands[parser->operand_count - 1];
+        *top = astnode_create_unary(op, *top);
+    }
+    parser->expect_operand = false;
+}
+
+static void stream_end_number(CalcParser *parser) {
+    if (parser->number_length == 0) return;
+    calc_stats_add(CALC_STAT_TOKENS_LEXED, 1);
+    parser->number[parser->number_length] = '\0';
+    stream_push_operand(parser, astnode_create_number(atof(parser->number)));
+    parser->number_length = 0;
+    parser->has_decimal = false;
+    stream_complete_operand(parser);
+}
+
+static bool stream_fail(CalcParser *parser) {
+    calc_stats_add(CALC_STAT_SYNTAX_ERRORS, 1);
+    parser->failed = true;
+    return false;
+}
+
+bool calc_parser_feed(CalcParser *parser, const char *buffer, size_t length) {
+    if (parser->failed) return false;
+
+    for (size_t i = 0; i < length; i++) {
+        char c = buffer[i];
+
+        if (isdigit((unsigned char)c) || (c == '.' && !(parser->number_length > 0 && parser->has_decimal))) {
+            if (parser->number_length == 0 && !parser->expect_operand) return stream_fail(parser);
+            if (parser->number_length == STREAM_NUMBER_MAX) return stream_fail(parser);
+            if (c == '.') parser->has_decimal = true;
+            parser->number[parser->number_length++] = c;
+            continue;
+        }
+        stream_end_number(parser);
+
+        if (isspace((unsigned char)c)) continue;
+        if (c != '\0' && strchr("+-*/()", c) != NULL) calc_stats_add(CALC_STAT_TOKENS_LEXED, 1);
+
+        if (parser->expect_operand) {
+            switch (c) {
+                case '(': stream_push_op(parser, '('); break;
+                case '-': stream_push_op(parser, 'n'); break;
+                case '+': stream_push_op(parser, 'p'); break;
+                default: return stream_fail(parser);
+            }
+            continue;
+        }
+
+        if (stream_is_binary(c)) {
+            while (parser->op_count > 0 && stream_is_binary(parser->ops[parser->op_count - 1]) &&
+                    stream_precedence(parser->ops[parser->op_count - 1]) >= stream_precedence(c)) {
+                stream_reduce_binary(parser);
+            }
+            stream_push_op(parser, c);
+            parser->expect_operand = true;
+        } else if (c == ')') {
+            while (parser->op_count > 0 && parser->ops[parser->op_count - 1] != '(') {
+                stream_reduce_binary(parser);
+            }
+            if (parser->op_count == 0) return stream_fail(parser);
+            parser->op_count--;
+            stream_complete_operand(parser);
+        } else {
+            return stream_fail(parser);
+        }
+    }
+    return true;
+}
+
+ASTNode *calc_parser_finish(CalcParser *parser) {
+    ASTNode *root = NULL;
+
+    if (!parser->failed) {
+        stream_end_number(parser);
+        while (!parser->expect_operand && parser->op_count > 0 && stream_is_binary(parser->ops[parser->op_count - 1])) {
+            stream_reduce_binary(parser);
+        }
+        if (!parser->expect_operand && parser->op_count == 0 && parser->operand_count == 1) {
+            root = parser->operands[--parser->operand_count];
+        } else {
+            calc_stats_add(CALC_STAT_SYNTAX_ERRORS, 1);
+        }
+    }
+
+    stream_reset(parser);
+    return root;
+}
+
+void calc_parser_free(CalcParser *parser) {
+    if (parser == NULL) return;
+    stream_reset(parser);
+    calc_free(parser->ops, parser->op_capacity);
+    calc_free(parser->operands, parser->operand_capacity * sizeof(ASTNode *));
+    calc_free(parser, sizeof(CalcParser));
+}
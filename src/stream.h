@@ -0,0 +1,26 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "calc.h"
+
+// Resumable parser for expressions that arrive in pieces. Input is pushed
+// with calc_parser_feed and may be split anywhere, including inside a
+// number. Apart from the tree, memory grows only with parenthesis nesting.
+typedef struct CalcParser CalcParser;
+
+CalcParser *calc_parser_create();
+
+// Consumes `length` bytes. Returns false once the input so far cannot
+// start a valid expression; later feeds are then ignored.
+bool calc_parser_feed(CalcParser *parser, const char *buffer, size_t length);
+
+// Ends the input and returns the tree ast_build_strict would build for
+// the concatenated chunks, or NULL on a syntax error. The parser is reset
+// and can take the next expression.
+ASTNode *calc_parser_finish(CalcParser *parser);
+
+void calc_parser_free(CalcParser *parser);
+
+#endif
@@ -1,6 +1,27 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdbool.h>
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "calc.h"
+#include "flat.h"
+#include "vm.h"
+#include "native.h"
+#include "tier.h"
+#include "arena.h"
+#include "parallel.h"
+#include "stream.h"
+#include "histogram.h"
+#include "stats.h"
+#include "trace.h"
+#include "capture.h"
+#include "difftest.h"
+#include "format.h"
 
 void test_eval() {
     // Basic arithmetic
@@ -57,6 +78,1122 @@ void test_eval() {
     assert(eval("-0") == 0.0);
     assert(eval("1") == 1.0);
     assert(eval("((1))") == 1.0);
+
+    // Token counting and stages beyond the old 64-entry limit
+    assert(ast_count_tokens("2 * (3 + 4)") == 7);
+    assert(ast_count_tokens("1 + x + 2") == 2);
+    char sum[512] = "1";
+    for (int i = 0; i < 50; i++) strcat(sum, " + 1");
+    ASTNodeList *stages = ast_build_stages(sum);
+    assert(stages->size == 102);
+    assert(ast_eval(stages->data[stages->size - 1]) == 51.0);
+    nodelist_free(stages);
     
     printf("All tests passed successfully!\n");
-}
\ No newline at end of file
+}
+
+static void check_flat(const char *expression) {
+    ASTNode *root = ast_build(expression);
+    FlatAST *flat = flat_from_ast(root);
+    ASTNode *copy = flat_to_ast(flat);
+
+    assert(flat->root == flat->size - 1);
+    assert(flat_eval(flat) == ast_eval(root));
+    assert(ast_eval(copy) == ast_eval(root));
+
+    ast_free(copy);
+    flat_free(flat);
+    ast_free(root);
+}
+
+void test_flat() {
+    check_flat("1 + 2");
+    check_flat("-2 * (3 + -4 * 2) + 7");
+    check_flat("(1 + 2) * (3 - 4) / 2");
+    check_flat("3.14159 + 2.71828");
+    check_flat("((1))");
+
+    printf("All flat AST tests passed successfully!\n");
+}
+
+static void check_postfix(const char *expression) {
+    ASTNode *root = ast_build(expression);
+    PostfixExpr *expr = ast_build_postfix(expression);
+
+    assert(postfix_eval(expr) == ast_eval(root));
+
+    postfix_free(expr);
+    ast_free(root);
+}
+
+void test_postfix() {
+    check_postfix("1 + 2 * 3 - 4 / 2");
+    check_postfix("-2 * (3 + -4 * 2) + 7");
+    check_postfix("2 * (3 + 4 * (5 - 2)) - 6");
+    check_postfix("16 / 4 / 2");
+    check_postfix("+-+1");
+
+    PostfixExpr *expr = ast_build_postfix("1 + 2 * 3");
+    assert(expr->size == 5 && expr->literal_count == 3 && expr->max_depth == 3);
+    assert(expr->ops[3] == POSTFIX_MUL && expr->ops[4] == POSTFIX_ADD);
+    postfix_free(expr);
+
+    printf("All postfix tests passed successfully!\n");
+}
+
+static void check_vm(const char *expression) {
+    ASTNode *root = ast_build(expression);
+    VMProgram *program = vm_compile(root);
+    RegProgram *registers = reg_compile(root);
+
+    assert(vm_run(program) == ast_eval(root));
+    assert(reg_run(registers) == ast_eval(root));
+    for (int engine = 0; engine < CALC_ENGINE_COUNT; engine++) {
+        assert(eval_engine(expression, (CalcEngine)engine) == ast_eval(root));
+    }
+
+    reg_free(registers);
+    vm_free(program);
+    ast_free(root);
+}
+
+void test_vm() {
+    check_vm("1 + 2");
+    check_vm("1 + 2 * 3 - 4 / 2");
+    check_vm("-2 * (3 + -4 * 2) + 7");
+    check_vm("(1 + 2) * (3 - 4) / 2");
+    check_vm("2 * (3 + 4 * (5 - 2)) - 6");
+    check_vm("--2 - -3");
+    check_vm("((1))");
+
+    ASTNode *root = ast_build("1 + 2");
+    VMProgram *program = vm_compile(root);
+    assert(program->size == 3);
+    assert(program->code[0].op == VM_PUSH && program->code[1].op == VM_ADD_CONST);
+    vm_free(program);
+    ast_free(root);
+
+    // Each temporary dies at its only use, so a left-leaning chain
+    // needs no more than two registers
+    root = ast_build("1 * 2 - 3 * 4 + 5 * 6 - 7 * 8");
+    RegProgram *registers = reg_compile(root);
+    assert(registers->register_count == 2);
+    reg_free(registers);
+    ast_free(root);
+
+    CalcEngine engine;
+    assert(calc_engine_parse("register", &engine) && engine == CALC_ENGINE_REGISTER_VM);
+    assert(!calc_engine_parse("jit", &engine));
+
+    printf("All VM tests passed successfully!\n");
+}
+
+void test_optimize() {
+    ASTNode *root = ast_optimize(ast_build("2 * (3 + 4 * (5 - 2)) - 6"), CALC_OPT_FOLD);
+    assert(root->type == NODE_NUMBER && root->number == 24.0);
+    ast_free(root);
+
+    // Division by zero is left for evaluation to report
+    root = ast_optimize(ast_build("1 + 2 / (3 - 3)"), CALC_OPT_FOLD);
+    assert(root->type == NODE_BINARY_OP && root->binary.right->type == NODE_BINARY_OP);
+    assert(root->binary.right->binary.right->type == NODE_NUMBER);
+    ast_free(root);
+
+    root = ast_build_strict("-(1 + 2)");
+    assert(root != NULL && ast_eval(root) == -3.0);
+    ast_free(root);
+    assert(ast_build_strict("1 2") == NULL);
+    assert(ast_build_strict("(1 + 2") == NULL);
+    assert(ast_build_strict("1 +") == NULL);
+    assert(ast_build_strict("") == NULL);
+
+    printf("All optimizer tests passed successfully!\n");
+}
+
+void test_native() {
+    ASTNode *root = ast_build("2 * (3 + 4) - 1 / 4 + -0.1");
+    NativeExpr *expr = native_compile(root);
+    if (expr == NULL) {
+        printf("Native tests skipped: no working C compiler\n");
+        ast_free(root);
+        return;
+    }
+    assert(native_run(expr) == ast_eval(root));
+
+    // The second compile is served from the on-disk cache
+    NativeExpr *cached = native_compile(root);
+    assert(cached != NULL && cached->hash == expr->hash);
+    assert(native_run(cached) == ast_eval(root));
+
+    native_free(cached);
+    native_free(expr);
+
+    // A cached library that other users could have written is rebuilt,
+    // and a cache directory they can write to is not used at all. The
+    // directory name would run a command if it ever reached a shell, and
+    // CALC_CC may carry its own flags.
+    char dir[] = "calc-test-native-$(touch calc-test-pwned)-XXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char *previous = getenv("CALC_NATIVE_CACHE");
+    if (previous != NULL) previous = strdup(previous);
+    setenv("CALC_NATIVE_CACHE", dir, 1);
+    setenv("CALC_CC", "cc  -w", 1);
+    expr = native_compile(root);
+    unsetenv("CALC_CC");
+    assert(expr != NULL);
+    assert(access("calc-test-pwned", F_OK) != 0);
+    char library[256];
+    snprintf(library, sizeof(library), "%s/calc_%016llx.so", dir, (unsigned long long)expr->hash);
+    native_free(expr);
+    FILE *planted = fopen(library, "wb");
+    fputs("not a library", planted);
+    fclose(planted);
+    assert(chmod(library, 0666) == 0);
+    expr = native_compile(root);
+    assert(expr != NULL && native_run(expr) == ast_eval(root));
+    native_free(expr);
+    struct stat info;
+    assert(stat(library, &info) == 0 && (info.st_mode & 0777) == 0700);
+
+    assert(chmod(dir, 0777) == 0);
+    assert(native_compile(root) == NULL);
+
+    // A path too long for the buffers fails instead of being truncated
+    char long_dir[2048];
+    memset(long_dir, 'a', sizeof(long_dir) - 1);
+    long_dir[sizeof(long_dir) - 1] = '\0';
+    setenv("CALC_NATIVE_CACHE", long_dir, 1);
+    assert(native_compile(root) == NULL);
+    remove(library);
+    rmdir(dir);
+    if (previous != NULL) {
+        setenv("CALC_NATIVE_CACHE", previous, 1);
+        free(previous);
+    } else {
+        unsetenv("CALC_NATIVE_CACHE");
+    }
+    ast_free(root);
+
+    printf("All native tests passed successfully!\n");
+}
+
+void test_tier() {
+    TierCache *cache = tier_create((TierConfig){.bytecode_threshold = 2, .native_threshold = 4});
+
+    for (int i = 0; i < 6; i++) {
+        assert(tier_eval(cache, "2 * (3 + 4) - 6 / 4") == 12.5);
+    }
+    assert(tier_eval(cache, "1 + 2") == 3.0);
+
+    assert(cache->size == 2);
+    assert(cache->stats[TIER_INTERPRETER].compiles == 2);
+    assert(cache->stats[TIER_INTERPRETER].runs == 3);
+    assert(cache->stats[TIER_BYTECODE].compiles == 1);
+    assert(cache->stats[TIER_BYTECODE].runs + cache->stats[TIER_NATIVE].runs == 4);
+
+    tier_free(cache);
+
+    // Past the capacity the least recently used entry goes, compiled code
+    // and all, while an expression that keeps running stays cached
+    cache = tier_create((TierConfig){.bytecode_threshold = 1, .native_threshold = 2, .capacity = 3});
+    char expression[32];
+    for (int i = 0; i < 20; i++) {
+        assert(tier_eval(cache, "1 + 1") == 2.0);
+        snprintf(expression, sizeof(expression), "%d + 0.5", i);
+        assert(tier_eval(cache, expression) == i + 0.5);
+        assert(cache->size <= 3);
+    }
+    assert(cache->size == 3 && cache->evictions == 18);
+    assert(cache->stats[TIER_INTERPRETER].compiles == 21);
+    assert(tier_eval(cache, "0 + 0.5") == 0.5);
+    assert(cache->stats[TIER_INTERPRETER].compiles == 22 && cache->evictions == 19);
+    for (int i = 0; i < 3; i++) {
+        snprintf(expression, sizeof(expression), "%d * 2", i);
+        assert(tier_eval(cache, expression) == i * 2.0);
+    }
+    assert(cache->size == 3 && cache->evictions == 22);
+    assert(tier_eval(cache, "1 + 1") == 2.0);
+    assert(cache->stats[TIER_INTERPRETER].compiles == 26);
+    tier_free(cache);
+
+    printf("All tiering tests passed successfully!\n");
+}
+
+typedef struct {
+    size_t live;
+    size_t peak;
+    size_t calls;
+} TrackingStats;
+
+static void *tracking_alloc(size_t size, void *ctx) {
+    TrackingStats *stats = ctx;
+    stats->live += size;
+    stats->calls++;
+    if (stats->live > stats->peak) stats->peak = stats->live;
+    return malloc(size);
+}
+
+static void tracking_free(void *ptr, size_t size, void *ctx) {
+    TrackingStats *stats = ctx;
+    stats->live -= size;
+    free(ptr);
+}
+
+void test_allocator() {
+    TrackingStats stats = {0};
+    CalcAllocator tracking = {tracking_alloc, NULL, tracking_free, &stats};
+    calc_set_allocator(&tracking);
+
+    const char *expression = "1 + 2 * 3 - 4 / 2 + (5 - 6) * 7 - 8 + 9 * 10 - 11 / 12 + 13 * 14 - 15 + 16 * 17";
+    double expected = eval(expression);
+    for (int engine = 0; engine < CALC_ENGINE_COUNT; engine++) {
+        assert(eval_engine(expression, (CalcEngine)engine) == expected);
+    }
+    assert(stats.calls > 0);
+
+    // Every byte handed out comes back with the size it was allocated with
+    calc_pool_trim();
+    assert(stats.live == 0 && stats.peak > 0);
+
+    calc_set_allocator(NULL);
+    assert(eval(expression) == expected);
+
+    printf("All allocator tests passed successfully!\n");
+}
+
+#define ARENA_TEST_BLOCKS 2000
+
+typedef struct {
+    CalcArena *arena;
+    unsigned char mark;
+} ArenaFill;
+
+static void *fill_from_arena(void *arg) {
+    ArenaFill *fill = arg;
+    unsigned char *blocks[ARENA_TEST_BLOCKS];
+    for (int i = 0; i < ARENA_TEST_BLOCKS; i++) {
+        blocks[i] = arena_alloc(fill->arena, 24);
+        memset(blocks[i], fill->mark, 24);
+    }
+    for (int i = 0; i < ARENA_TEST_BLOCKS; i++) {
+        for (int j = 0; j < 24; j++) assert(blocks[i][j] == fill->mark);
+    }
+    return NULL;
+}
+
+void test_arena() {
+    CalcArena *arena = arena_create(1 << 20, true);
+    CalcAllocator allocator = arena_allocator(arena);
+    calc_set_allocator(&allocator);
+
+    assert(eval("2 * (3 + 4 * (5 - 2)) - 6") == 24.0);
+    ASTNode *root = ast_build("(1 + 2) * (3 - 4) / 2");
+    assert((char *)root >= arena->base && (char *)root < arena->base + arena->size);
+    assert(ast_eval(root) == -1.5);
+    ast_free(root);
+    assert(arena->used > 0);
+
+    // Freed arena nodes are not pooled, so a fresh tree comes from new
+    // arena memory rather than from a list that would outlive arena_reset
+    size_t used = arena->used;
+    root = ast_build("1 + 2");
+    assert(arena->used > used);
+    ast_free(root);
+
+    // Threads share the arena without handing out overlapping blocks,
+    // which the parallel builder's workers rely on
+    ThreadPool *pool = thread_pool_create(4);
+    root = ast_build_parallel(pool, "1 + 2 * 3 - 4 / 8 + 5 * 6 - 7 + 8 * 9 - 10", 4);
+    assert(ast_eval(root) == 1 + 2 * 3 - 4 / 8.0 + 5 * 6 - 7 + 8 * 9 - 10);
+    ast_free(root);
+    thread_pool_destroy(pool);
+    calc_set_allocator(NULL);
+    arena_reset(arena);
+    pthread_t threads[4];
+    ArenaFill fills[4];
+    for (int i = 0; i < 4; i++) {
+        fills[i] = (ArenaFill){arena, (unsigned char)(i + 1)};
+        pthread_create(&threads[i], NULL, fill_from_arena, &fills[i]);
+    }
+    for (int i = 0; i < 4; i++) pthread_join(threads[i], NULL);
+    assert(arena->used >= 4 * ARENA_TEST_BLOCKS * 24);
+
+    arena_reset(arena);
+    assert(arena->used == 0);
+    assert(arena_alloc(arena, arena->size + 1) == NULL);
+    arena_destroy(arena);
+
+    printf("All arena tests passed successfully!\n");
+}
+
+static size_t ast_depth(ASTNode *node) {
+    if (node == NULL || node->type == NODE_NUMBER) return 1;
+    if (node->type == NODE_UNARY_OP) return 1 + ast_depth(node->unary.operand);
+    size_t left = ast_depth(node->binary.left);
+    size_t right = ast_depth(node->binary.right);
+    return 1 + (left > right ? left : right);
+}
+
+void test_reassociate() {
+    // Small integers keep every partial sum exact, so the order of
+    // evaluation cannot change the result
+    char expression[8192];
+    size_t length = 0;
+    for (int i = 0; i < 1000; i++) {
+        length += sprintf(expression + length, i == 0 ? "%d" : (i % 3 ? " + %d" : " - %d"), i % 10);
+    }
+
+    ASTNode *chain = ast_build(expression);
+    double expected = ast_eval(chain);
+    assert(ast_depth(chain) == 1000);
+
+    ASTNode *balanced = ast_optimize(chain, CALC_OPT_UNSAFE_REASSOCIATE);
+    assert(ast_depth(balanced) <= 12);
+    assert(ast_eval(balanced) == expected);
+    ast_free(balanced);
+
+    const char *cases[] = {
+        "2 * 3 * 4 * 5 * 6 * 7", "1 - (2 + 3) - -4 + 5", "-(1 + 2) * 3 * (4 - 5 - 6)", "8 / 4 / 2 * 3 * 4", "-1 - 2"
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        ASTNode *root = ast_build(cases[i]);
+        double value = ast_eval(root);
+        root = ast_optimize(root, CALC_OPT_UNSAFE_REASSOCIATE);
+        assert(ast_eval(root) == value);
+        ast_free(root);
+    }
+
+    printf("All reassociation tests passed successfully!\n");
+}
+
+// Appends a balanced random expression over `leaves` operands
+static size_t random_expression(char *out, size_t leaves, unsigned *seed) {
+    if (leaves == 1) return sprintf(out, "%d.%d", rand_r(seed) % 100, rand_r(seed) % 10);
+    static const char ops[] = "+-*+";
+    size_t left = leaves / 2;
+    size_t length = sprintf(out, "(");
+    length += random_expression(out + length, left, seed);
+    length += sprintf(out + length, " %c ", ops[rand_r(seed) % 4]);
+    length += random_expression(out + length, leaves - left, seed);
+    return length + sprintf(out + length, ")");
+}
+
+void test_parallel() {
+    size_t leaves = 20000;
+    char *expression = malloc(leaves * 16);
+    unsigned seed = 42;
+    random_expression(expression, leaves, &seed);
+
+    ASTNode *root = ast_build(expression);
+    assert(root->size == 2 * leaves - 1);
+    double expected = ast_eval(root);
+
+    ThreadPool *pool = thread_pool_create(4);
+    for (int run = 0; run < 8; run++) {
+        assert(ast_eval_parallel(pool, root, 64) == expected);
+    }
+    assert(ast_eval_parallel(pool, root, PARALLEL_DEFAULT_GRAIN) == expected);
+
+    // However many subtrees the workers evaluate, it counts as one call
+    CalcStats stats;
+    calc_stats_reset();
+    assert(ast_eval_parallel(pool, root, 64) == expected);
+    calc_stats(&stats);
+    assert(stats.evaluations == 1);
+    thread_pool_destroy(pool);
+
+    // A single-threaded pool falls back to ast_eval
+    pool = thread_pool_create(1);
+    assert(ast_eval_parallel(pool, root, 64) == expected);
+    thread_pool_destroy(pool);
+
+    ast_free(root);
+    free(expression);
+
+    printf("All parallel tests passed successfully!\n");
+}
+
+static bool ast_equal(const ASTNode *a, const ASTNode *b) {
+    if (a == NULL || b == NULL) return a == b;
+    if (a->type != b->type || a->size != b->size) return false;
+    switch (a->type) {
+        case NODE_NUMBER:
+            return a->number == b->number;
+        case NODE_BINARY_OP:
+            return a->binary.operator == b->binary.operator &&
+                ast_equal(a->binary.left, b->binary.left) && ast_equal(a->binary.right, b->binary.right);
+        case NODE_UNARY_OP:
+            return a->unary.operator == b->unary.operator && ast_equal(a->unary.operand, b->unary.operand);
+    }
+    return false;
+}
+
+void test_parallel_parse() {
+    // A flat sum whose terms hold products, unary signs and nested sums
+    size_t terms = 5000;
+    char *expression = malloc(terms * 48);
+    size_t length = 0;
+    unsigned seed = 7;
+    for (size_t i = 0; i < terms; i++) {
+        static const char *ops[] = {" + ", " - ", "+", "-\n"};
+        if (i > 0) length += sprintf(expression + length, "%s", ops[rand_r(&seed) % 4]);
+        switch (rand_r(&seed) % 4) {
+            case 0: length += sprintf(expression + length, "%d", rand_r(&seed) % 1000); break;
+            case 1: length += sprintf(expression + length, "%d.5 * -%d", rand_r(&seed) % 100, rand_r(&seed) % 9); break;
+            case 2: length += sprintf(expression + length, "(%d - (1 + -%d)) / 4", rand_r(&seed) % 50, rand_r(&seed) % 7); break;
+            case 3: length += sprintf(expression + length, "- %d.", rand_r(&seed) % 10); break;
+        }
+    }
+
+    ThreadPool *pool = thread_pool_create(4);
+    ASTNode *expected = ast_build(expression);
+    for (size_t grain = 1; grain <= 4096; grain *= 8) {
+        ASTNode *root = ast_build_parallel(pool, expression, grain);
+        assert(ast_equal(root, expected));
+        ast_free(root);
+    }
+    ast_free(expected);
+    free(expression);
+
+    // Inputs the chunked parser rejects still match the sequential parser
+    const char *cases[] = {
+        "1 + 2 - 3 + 4 * 5 - 6 / 7 + 8", "1 + (2 - 3", "1 + 2) - 3", "1 2 + 3 - 4", "1 + 2 - x + 4", "-(1 + 2) - -3 + +4"
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        ASTNode *root = ast_build_parallel(pool, cases[i], 1);
+        expected = ast_build(cases[i]);
+        assert(ast_equal(root, expected));
+        ast_free(root);
+        ast_free(expected);
+    }
+    thread_pool_destroy(pool);
+
+    printf("All parallel parsing tests passed successfully!\n");
+}
+
+void test_stream() {
+    const char *cases[] = {
+        "1 + 2 * 3", "(1 + 2) * 3", "10 / 4 - 3 * -2", "-(1.5 + 2.25) * +3", "- - 4 - -(2)",
+        "12345.678 * (9 - (8 / (7 + 6)))", ".5 + 5.", "1 - 2 - 3 * 4 / 5 + 6",
+        "", "1 +", "(1 + 2", "1 + 2)", "1 2", "* 3", "1..2", "1 + x", "()"
+    };
+    CalcParser *parser = calc_parser_create();
+
+    // Every split point, including inside numbers, gives the same tree
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        size_t length = strlen(cases[i]);
+        ASTNode *expected = ast_build_strict(cases[i]);
+        for (size_t split = 0; split <= length; split++) {
+            calc_parser_feed(parser, cases[i], split);
+            calc_parser_feed(parser, cases[i] + split, length - split);
+            ASTNode *root = calc_parser_finish(parser);
+            assert(ast_equal(root, expected));
+            ast_free(root);
+        }
+
+        for (size_t j = 0; j < length; j++) {
+            calc_parser_feed(parser, cases[i] + j, 1);
+        }
+        ASTNode *root = calc_parser_finish(parser);
+        assert(ast_equal(root, expected));
+        ast_free(root);
+        ast_free(expected);
+    }
+
+    // A long expression streamed in uneven chunks
+    size_t leaves = 4000;
+    char *expression = malloc(leaves * 16);
+    unsigned seed = 3;
+    size_t length = random_expression(expression, leaves, &seed);
+    ASTNode *expected = ast_build_strict(expression);
+    for (size_t offset = 0; offset < length;) {
+        size_t chunk = 1 + (size_t)rand_r(&seed) % 97;
+        if (chunk > length - offset) chunk = length - offset;
+        assert(calc_parser_feed(parser, expression + offset, chunk));
+        offset += chunk;
+    }
+    ASTNode *root = calc_parser_finish(parser);
+    assert(ast_equal(root, expected));
+    ast_free(root);
+    ast_free(expected);
+    free(expression);
+
+    assert(!calc_parser_feed(parser, "1 + )", 5));
+    assert(!calc_parser_feed(parser, "2", 1));
+    assert(calc_parser_finish(parser) == NULL);
+    calc_parser_free(parser);
+
+    printf("All stream parser tests passed successfully!\n");
+}
+
+void test_budget() {
+    double result = 0;
+    CalcBudget unlimited = {0, 0};
+    assert(eval_budget("1 + 2 * 3", &unlimited, &result) == CALC_OK && result == 7.0);
+
+    size_t leaves = 10000;
+    char *expression = malloc(leaves * 16);
+    unsigned seed = 11;
+    random_expression(expression, leaves, &seed);
+    ASTNode *root = ast_build(expression);
+    double expected = ast_eval(root);
+
+    CalcBudget exact = {root->size, 0};
+    assert(ast_eval_budget(root, &exact, &result) == CALC_OK && result == expected);
+
+    CalcBudget short_by_one = {root->size - 1, 0};
+    result = -1;
+    assert(ast_eval_budget(root, &short_by_one, &result) == CALC_BUDGET_EXCEEDED && result == -1);
+
+    CalcBudget expired = {0, 1};
+    assert(ast_eval_budget(root, &expired, &result) == CALC_DEADLINE_EXCEEDED);
+    assert(eval_budget("1 + 2", &expired, &result) == CALC_DEADLINE_EXCEEDED);
+
+    CalcBudget generous = {0, calc_time_ns() + 60000000000ULL};
+    assert(ast_eval_budget(root, &generous, &result) == CALC_OK && result == expected);
+
+    ast_free(root);
+    free(expression);
+
+    printf("All budget tests passed successfully!\n");
+}
+
+static void *record_on_thread(void *arg) {
+    (void)arg;
+    for (uint64_t ns = 1000; ns < 2000; ns++) calc_histogram_record(CALC_PHASE_PARSE, ns);
+    return NULL;
+}
+
+static void *record_until_released(void *arg) {
+    pthread_barrier_t *barrier = arg;
+    calc_histogram_record(CALC_PHASE_PARSE, 5);
+    pthread_barrier_wait(barrier);
+    pthread_barrier_wait(barrier);
+    return NULL;
+}
+
+void test_histogram() {
+    CalcHistogram histogram;
+    calc_histogram_reset();
+    calc_histogram_snapshot(CALC_PHASE_PARSE, &histogram);
+    assert(histogram.total == 0);
+
+    // Exact below 32, within 1/32 above
+    for (uint64_t ns = 0; ns < 32; ns++) calc_histogram_record(CALC_PHASE_PARSE, ns);
+    calc_histogram_snapshot(CALC_PHASE_PARSE, &histogram);
+    assert(histogram.total == 32 && histogram.max == 31);
+    assert(calc_histogram_percentile(&histogram, 50) == 15);
+    assert(calc_histogram_percentile(&histogram, 100) == 31);
+
+    // Samples from a thread that has exited are kept
+    pthread_t thread;
+    pthread_create(&thread, NULL, record_on_thread, NULL);
+    pthread_join(thread, NULL);
+    calc_histogram_record(CALC_PHASE_PARSE, 1000000007);
+    calc_histogram_snapshot(CALC_PHASE_PARSE, &histogram);
+    assert(histogram.total == 1033);
+    uint64_t p99 = calc_histogram_percentile(&histogram, 99);
+    assert(p99 >= 1980 && p99 <= 1980 + 1980 / 32);
+    assert(calc_histogram_percentile(&histogram, 100) == 1000000007);
+
+    calc_histogram_reset();
+    calc_histogram_snapshot(CALC_PHASE_PARSE, &histogram);
+    assert(histogram.total == 0 && histogram.sum == 0);
+    calc_histogram_record(CALC_PHASE_PARSE, 40);
+    calc_histogram_snapshot(CALC_PHASE_PARSE, &histogram);
+    assert(histogram.total == 1 && calc_histogram_percentile(&histogram, 50) == 40);
+
+    // A thread's counters outlive an arena that was installed when it
+    // recorded its first sample
+    calc_histogram_reset();
+    CalcArena *arena = arena_create(1 << 20, false);
+    CalcAllocator allocator = arena_allocator(arena);
+    calc_set_allocator(&allocator);
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, 2);
+    pthread_create(&thread, NULL, record_until_released, &barrier);
+    pthread_barrier_wait(&barrier);
+    calc_set_allocator(NULL);
+    arena_reset(arena);
+    memset(arena_alloc(arena, arena->size), 0xff, arena->size);
+    calc_histogram_snapshot(CALC_PHASE_PARSE, &histogram);
+    assert(histogram.total == 1 && histogram.max == 5);
+    pthread_barrier_wait(&barrier);
+    pthread_join(thread, NULL);
+    pthread_barrier_destroy(&barrier);
+    arena_destroy(arena);
+
+#ifdef CALC_HISTOGRAMS
+    calc_histogram_reset();
+    eval("1 + 2");
+    calc_histogram_snapshot(CALC_PHASE_EVAL, &histogram);
+    assert(histogram.total == 1);
+#endif
+
+    printf("All histogram tests passed successfully!\n");
+}
+
+static void *eval_on_thread(void *arg) {
+    (void)arg;
+    eval("(1 + 2) * 3");
+    return NULL;
+}
+
+void test_stats() {
+    CalcStats stats;
+    calc_pool_trim();
+    calc_stats_reset();
+    calc_stats(&stats);
+    assert(stats.tokens_lexed == 0 && stats.evaluations == 0);
+
+    assert(eval("1 + 2 * 3") == 7.0);
+    calc_stats(&stats);
+    assert(stats.tokens_lexed == 5);
+    assert(stats.nodes_allocated == 5 && stats.nodes_freed == 5);
+    assert(stats.evaluations == 1);
+    assert(stats.syntax_errors == 0);
+
+    // Pooled nodes hold their bytes until the pool is trimmed
+    calc_pool_trim();
+    calc_stats(&stats);
+    assert(stats.bytes_allocated > 0 && stats.bytes_allocated == stats.bytes_freed);
+
+    ast_free(ast_build("1 + 2 3"));
+    assert(ast_build_strict("(1 +") == NULL);
+    CalcParser *parser = calc_parser_create();
+    calc_parser_feed(parser, "2 *", 3);
+    assert(calc_parser_finish(parser) == NULL);
+    calc_parser_free(parser);
+    calc_stats(&stats);
+    assert(stats.syntax_errors == 3);
+
+    // Counts from a thread that has exited stay in the totals, and its
+    // node pool is freed without the thread trimming it
+    calc_stats_reset();
+    pthread_t thread;
+    pthread_create(&thread, NULL, eval_on_thread, NULL);
+    pthread_join(thread, NULL);
+    calc_stats(&stats);
+    assert(stats.tokens_lexed == 7 && stats.evaluations == 1);
+    assert(stats.nodes_allocated == stats.nodes_freed);
+    assert(stats.bytes_allocated > 0 && stats.bytes_allocated == stats.bytes_freed);
+
+    printf("All stats tests passed successfully!\n");
+}
+
+void test_trace() {
+    const char *path = "calc-test-trace.json";
+    calc_trace_start(path);
+    ASTNode *root = ast_optimize(ast_build("1 + 2 * 3"), CALC_OPT_FOLD);
+    VMProgram *program = vm_compile(root);
+    assert(vm_run(program) == 7.0);
+    vm_free(program);
+    ast_free(root);
+
+    ThreadPool *pool = thread_pool_create(2);
+    root = ast_build_parallel(pool, "1 + 2 + 3 + 4 + 5 + 6 + 7 + 8", 1);
+    assert(ast_eval(root) == 36.0);
+    ast_free(root);
+    thread_pool_destroy(pool);
+    assert(calc_trace_flush());
+
+    // Recording stops at flush
+    eval("4 - 1");
+
+    FILE *file = fopen(path, "r");
+    assert(file != NULL);
+    char trace[65536];
+    size_t length = fread(trace, 1, sizeof(trace) - 1, file);
+    trace[length] = '\0';
+    fclose(file);
+    remove(path);
+
+    assert(strncmp(trace, "{\"traceEvents\": [", 16) == 0);
+    const char *spans[] = {"\"ast_build\"", "\"fold\"", "\"vm_compile\"", "\"vm_run\"", "\"ast_build_parallel\"", "\"parse_chunk\"", "\"ast_eval\""};
+    for (size_t i = 0; i < sizeof(spans) / sizeof(spans[0]); i++) {
+        assert(strstr(trace, spans[i]) != NULL);
+    }
+    assert(strstr(trace, "\"ph\": \"X\"") != NULL);
+    size_t ast_evals = 0;
+    for (const char *at = trace; (at = strstr(at, "\"ast_eval\"")) != NULL; at++) ast_evals++;
+    assert(ast_evals == 1);
+
+    printf("All trace tests passed successfully!\n");
+}
+
+void test_capture() {
+    const char *path = "calc-test-capture.bin";
+    assert(calc_capture_start(path));
+    assert(eval("1 + 2") == 3.0);
+    ast_free(ast_build_strict("(4 - 1) * 2"));
+    char long_expression[1024] = "1";
+    for (int i = 0; i < 100; i++) strcat(long_expression, " + 1");
+    assert(eval(long_expression) == 101.0);
+
+    // A parallel build is recorded once, whether it splits the input or
+    // falls back to the sequential parser
+    ThreadPool *pool = thread_pool_create(4);
+    ASTNode *root = ast_build_parallel(pool, long_expression, 8);
+    assert(ast_eval(root) == 101.0);
+    ast_free(root);
+    root = ast_build_parallel(pool, "(1 + 2 + 3 + 4 + 5 + 6 + 7 + 8", 4);
+    assert(ast_eval(root) == 36.0);
+    ast_free(root);
+    thread_pool_destroy(pool);
+    calc_capture_stop();
+    eval("9 * 9");
+
+    CaptureReader *reader = capture_open(path);
+    assert(reader != NULL);
+    const char *expected[] = {"1 + 2", "(4 - 1) * 2", long_expression, long_expression, "(1 + 2 + 3 + 4 + 5 + 6 + 7 + 8"};
+    uint64_t previous = 0;
+    uint64_t time_ns;
+    for (size_t i = 0; i < 5; i++) {
+        const char *expression = capture_next(reader, &time_ns);
+        assert(expression != NULL && strcmp(expression, expected[i]) == 0);
+        assert(time_ns >= previous);
+        previous = time_ns;
+    }
+    assert(capture_next(reader, &time_ns) == NULL);
+    capture_close(reader);
+
+    // Anything else is rejected
+    FILE *file = fopen(path, "wb");
+    fputs("not a capture", file);
+    fclose(file);
+    assert(capture_open(path) == NULL);
+    remove(path);
+
+    printf("All capture tests passed successfully!\n");
+}
+
+static bool has_multiply(const char *expression, void *ctx) {
+    (void)ctx;
+    return strchr(expression, '*') != NULL;
+}
+
+void test_differential() {
+    assert(diff_valid("1 / 2"));
+    assert(!diff_valid("1 / 0"));
+    assert(!diff_valid("3 / (2 - 2) + 1"));
+    assert(!diff_valid("1 +"));
+
+    ThreadPool *pool = thread_pool_create(4);
+    DiffOptions options = {false, pool};
+    DiffFailure failure;
+    unsigned seed = 7;
+    for (int run = 0; run < 400; run++) {
+        // Every other run leaves out division so reassociation is checked
+        char *expression = diff_generate(&seed, 1 + run % 40, run % 2 ? "+-*/" : "+-*");
+        assert(diff_valid(expression));
+        options.native = run < 2;
+        if (!diff_check(expression, &options, &failure)) {
+            char *minimal = diff_minimize(expression, &options, failure.engine);
+            fprintf(stderr, "%s disagrees with ast_eval on %s\n", failure.engine, minimal);
+            assert(false);
+        }
+        diff_free(expression);
+    }
+    thread_pool_destroy(pool);
+
+    // Shrinking keeps the failing operator and zeroes everything else
+    char *minimal = diff_shrink("(3.5 + 2) * -7 - 1.25 / 4", has_multiply, NULL);
+    assert(strcmp(minimal, "0 * 0") == 0);
+    diff_free(minimal);
+
+    printf("All differential tests passed successfully!\n");
+}
+
+// Checks every stage against ast_build on the matching prefix of tokens
+static void check_stages(const char *expression) {
+    ASTNodeList *stages = ast_build_stages(expression);
+    assert(stages->size == ast_count_tokens(expression) + 1);
+
+    char *prefix = malloc(2 * strlen(expression) + 1);
+    size_t length = 0;
+    const char *c = expression;
+    prefix[0] = '\0';
+    for (size_t stage = 0; stage < stages->size; stage++) {
+        ASTNode *expected = ast_build(prefix);
+        assert(ast_equal(stages->data[stage], expected));
+        ast_free(expected);
+
+        // Appends the next token, separated by a space
+        while (*c == ' ') c++;
+        if (*c == '\0') break;
+        if (length > 0) prefix[length++] = ' ';
+        if ((*c >= '0' && *c <= '9') || *c == '.') {
+            while ((*c >= '0' && *c <= '9') || *c == '.') prefix[length++] = *c++;
+        } else {
+            prefix[length++] = *c++;
+        }
+        prefix[length] = '\0';
+    }
+
+    free(prefix);
+    nodelist_free(stages);
+}
+
+void test_stages() {
+    check_stages("");
+    check_stages("42");
+    check_stages("2 * (3 + 4) - -5 / +2");
+    check_stages("((1 + 2) * (3 - (4 / 5)))");
+
+    // Prefixes with missing operands, unclosed parentheses and tokens the
+    // parser stops at
+    check_stages("1 + * 2");
+    check_stages("(1 + 2");
+    check_stages("(1 2) + 3");
+    check_stages("1 + ) 2");
+    check_stages("- - (");
+    check_stages("1 + 2 x 3");
+
+    unsigned seed = 5;
+    static const char *tokens[] = {"1", "2.5", "+", "-", "*", "/", "(", ")"};
+    char garbage[256];
+    for (int run = 0; run < 300; run++) {
+        size_t length = 0;
+        for (int i = rand_r(&seed) % 40; i > 0; i--) {
+            length += sprintf(garbage + length, "%s ", tokens[rand_r(&seed) % 8]);
+        }
+        garbage[length] = '\0';
+        check_stages(garbage);
+
+        char *expression = diff_generate(&seed, 1 + run % 30, "+-*/");
+        check_stages(expression);
+        diff_free(expression);
+    }
+
+    printf("All stage tests passed successfully!\n");
+}
+
+#define SCALING_WIDTH 100   // Operands per parenthesized run
+#define SCALING_MARGIN 5.0  // Allowed growth in time per token for 10x the tokens
+#define SCALING_REPEATS 3
+#define SCALING_MIN_NS 20000000
+
+typedef enum {
+    SCALING_LEX, SCALING_PARSE, SCALING_EVAL, SCALING_STAGES, SCALING_PHASES
+} ScalingPhase;
+
+// About `tokens` tokens as runs of up to SCALING_WIDTH operands, each a
+// smaller parenthesized run, so 1M tokens nest only three deep and no
+// tree is deep enough to overflow the recursive evaluators
+static size_t scaling_expression(char *out, size_t tokens, unsigned *seed) {
+    static const char ops[] = "+-*";
+    size_t length = 0;
+    if (tokens < 2 * SCALING_WIDTH) {
+        for (size_t i = 0; i < tokens / 2 + 1; i++) {
+            if (i > 0) length += sprintf(out + length, " %c ", ops[rand_r(seed) % 3]);
+            length += sprintf(out + length, "%d.5", rand_r(seed) % 9);
+        }
+        return length;
+    }
+    for (size_t i = 0; i < SCALING_WIDTH; i++) {
+        if (i > 0) length += sprintf(out + length, " %c ", ops[rand_r(seed) % 3]);
+        out[length++] = '(';
+        length += scaling_expression(out + length, tokens / SCALING_WIDTH - 3, seed);
+        out[length++] = ')';
+    }
+    out[length] = '\0';
+    return length;
+}
+
+// Best time for one run of `phase`, each of SCALING_REPEATS timings
+// looping for at least SCALING_MIN_NS
+static uint64_t scaling_time(ScalingPhase phase, const char *expression) {
+    ASTNode *root = phase == SCALING_EVAL ? ast_build(expression) : NULL;
+    uint64_t best = UINT64_MAX;
+    volatile double sink = 0;
+
+    for (int repeat = 0; repeat < SCALING_REPEATS; repeat++) {
+        uint64_t runs = 0;
+        uint64_t start = calc_time_ns();
+        uint64_t elapsed;
+        do {
+            switch (phase) {
+                case SCALING_LEX: sink += (double)ast_count_tokens(expression); break;
+                case SCALING_PARSE: ast_free(ast_build(expression)); break;
+                case SCALING_EVAL: sink += ast_eval(root); break;
+                case SCALING_STAGES: nodelist_free(ast_build_stages(expression)); break;
+                default: break;
+            }
+            runs++;
+            elapsed = calc_time_ns() - start;
+        } while (elapsed < SCALING_MIN_NS);
+        if (elapsed / runs < best) best = elapsed / runs;
+    }
+
+    ast_free(root);
+    (void)sink;
+    return best;
+}
+
+// Fails when time per token grows more than SCALING_MARGIN times from
+// one size to the next, 10 times larger. A quadratic phase grows 10x;
+// a linear one still slows down 3x or so once its tree outgrows the
+// caches.
+void test_scaling() {
+    static const char *phase_names[] = {"lex", "parse", "eval", "stages"};
+    size_t sizes[] = {1000, 10000, 100000, 1000000};
+    size_t size_count = sizeof(sizes) / sizeof(sizes[0]);
+    double ns_per_token[SCALING_PHASES][4];
+
+    // Each size is checked before the next, so a quadratic phase fails at
+    // 10k tokens instead of running for hours at 1M
+    char *expression = malloc(sizes[size_count - 1] * 8);
+    unsigned seed = 11;
+    for (size_t i = 0; i < size_count; i++) {
+        scaling_expression(expression, sizes[i], &seed);
+        size_t tokens = ast_count_tokens(expression);
+        assert(tokens > sizes[i] / 2 && tokens < sizes[i] * 2);
+
+        for (int phase = 0; phase < SCALING_PHASES; phase++) {
+            uint64_t ns = scaling_time((ScalingPhase)phase, expression);
+            ns_per_token[phase][i] = (double)(ns ? ns : 1) / (double)tokens;
+            if (i == 0) continue;
+
+            double growth = ns_per_token[phase][i] / ns_per_token[phase][i - 1];
+            if (growth > SCALING_MARGIN) {
+                fprintf(stderr, "%s: %.1f ns/token at %zu tokens, %.1f at %zu\n", phase_names[phase],
+                    ns_per_token[phase][i - 1], sizes[i - 1], ns_per_token[phase][i], sizes[i]);
+            }
+            assert(growth <= SCALING_MARGIN);
+        }
+    }
+    free(expression);
+
+    printf("All scaling tests passed successfully!\n");
+}
+
+static void check_format(double value, const char *expected) {
+    char out[CALC_FORMAT_DOUBLE_MAX];
+    size_t length = calc_format_double(value, out);
+    assert(strcmp(out, expected) == 0);
+    assert(length == strlen(expected));
+}
+
+void test_format() {
+    check_format(0.0, "0");
+    check_format(-0.0, "-0");
+    check_format(1.0 / 0.0, "inf");
+    check_format(-1.0 / 0.0, "-inf");
+    check_format(0.0 / 0.0, "nan");
+    check_format(0.1, "0.1");
+    check_format(1.0 / 3.0, "0.3333333333333333");
+    check_format(-123.456, "-123.456");
+    check_format(100, "100");
+    check_format(1e20, "100000000000000000000");
+    check_format(1e21, "1e+21");
+    check_format(0.000001, "0.000001");
+    check_format(1.5e-7, "1.5e-7");
+    check_format(5e-324, "5e-324");
+    check_format(1.7976931348623157e308, "1.7976931348623157e+308");
+    check_format(9007199254740993.0, "9007199254740992");
+
+    // Random bit patterns read back exactly, with no more digits than the
+    // shortest "%.*e" that does
+    unsigned seed = 17;
+    char out[CALC_FORMAT_DOUBLE_MAX];
+    char text[40];
+    for (int i = 0; i < 20000; i++) {
+        uint64_t bits = ((uint64_t)rand_r(&seed) << 62) ^ ((uint64_t)rand_r(&seed) << 31) ^ (uint64_t)rand_r(&seed);
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        if (!isfinite(value) || value == 0) continue;
+
+        calc_format_double(value, out);
+        assert(strtod(out, NULL) == value);
+        int precision = 0;
+        for (; precision < 17; precision++) {
+            snprintf(text, sizeof(text), "%.*e", precision, value);
+            if (strtod(text, NULL) == value) break;
+        }
+        int digits = 0;
+        bool leading = true;
+        for (const char *c = out; *c && *c != 'e'; c++) {
+            if (*c >= '1' && *c <= '9') leading = false;
+            if (*c >= '0' && *c <= '9' && !leading) digits++;
+        }
+        assert(digits == precision + 1 || (strchr(out, 'e') == NULL && strchr(out, '.') == NULL));
+    }
+
+    // The writer flushes in whole buffers and on calc_writer_flush
+    const char *path = "calc-test-format.txt";
+    FILE *file = fopen(path, "w+");
+    CalcWriter *writer = malloc(sizeof(CalcWriter));
+    calc_writer_init(writer, file);
+    for (int i = 0; i < 20000; i++) calc_writer_double(writer, i + 0.25, '\n');
+    calc_writer_write(writer, "end\n", 4);
+    assert(calc_writer_flush(writer));
+    free(writer);
+
+    rewind(file);
+    for (int i = 0; i < 20000; i++) {
+        assert(fgets(text, sizeof(text), file) != NULL);
+        assert(strtod(text, NULL) == i + 0.25);
+    }
+    assert(fgets(text, sizeof(text), file) != NULL && strcmp(text, "end\n") == 0);
+    fclose(file);
+    remove(path);
+
+    printf("All format tests passed successfully!\n");
+}
+
+static uint64_t read_le64(const unsigned char *bytes) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) value = (value << 8) | bytes[i];
+    return value;
+}
+
+void test_results() {
+    // Every seventh input fails and reads back as NaN with its bit set
+    const char *path = "calc-test-results.bin";
+    size_t counts[] = {0, 1, 8, 9, 5000};
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        size_t count = counts[c];
+        FILE *file = fopen(path, "w+b");
+        fputs("prefix", file);
+        CalcResultsWriter *results = malloc(sizeof(CalcResultsWriter));
+        assert(calc_results_begin(results, file));
+        for (size_t i = 0; i < count; i++) calc_results_add(results, i * 0.5 - 3, i % 7 == 3);
+        assert(calc_results_finish(results));
+        free(results);
+
+        size_t errors_size = (count + 7) / 8;
+        size_t size = CALC_RESULTS_HEADER_SIZE + 8 * count + errors_size;
+        unsigned char *bytes = malloc(size + 1);
+        assert(fseek(file, 0, SEEK_END) == 0 && (size_t)ftell(file) == 6 + size);
+        assert(fseek(file, 6, SEEK_SET) == 0 && fread(bytes, 1, size + 1, file) == size);
+        fclose(file);
+
+        assert(memcmp(bytes, CALC_RESULTS_MAGIC, 8) == 0);
+        assert(read_le64(bytes + 8) == count);
+        assert(read_le64(bytes + 16) == CALC_RESULTS_HEADER_SIZE + 8 * count);
+        const unsigned char *errors = bytes + CALC_RESULTS_HEADER_SIZE + 8 * count;
+        for (size_t i = 0; i < count; i++) {
+            uint64_t bits = read_le64(bytes + CALC_RESULTS_HEADER_SIZE + 8 * i);
+            double value;
+            memcpy(&value, &bits, sizeof(value));
+            bool failed = (errors[i / 8] >> (i % 8)) & 1;
+            assert(failed == (i % 7 == 3));
+            assert(failed ? isnan(value) : value == i * 0.5 - 3);
+        }
+        if (count % 8 != 0) assert((errors[count / 8] >> (count % 8)) == 0);
+        free(bytes);
+    }
+    remove(path);
+
+    // Pipes cannot be patched afterwards
+    int fds[2];
+    assert(pipe(fds) == 0);
+    FILE *pipe_file = fdopen(fds[1], "w");
+    CalcResultsWriter *results = malloc(sizeof(CalcResultsWriter));
+    assert(!calc_results_begin(results, pipe_file));
+    free(results);
+    fclose(pipe_file);
+    close(fds[0]);
+
+    printf("All results tests passed successfully!\n");
+}
@@ -3,4 +3,48 @@
 
 void test_eval();
 
+void test_flat();
+
+void test_postfix();
+
+void test_vm();
+
+void test_optimize();
+
+void test_native();
+
+void test_tier();
+
+void test_allocator();
+
+void test_arena();
+
+void test_reassociate();
+
+void test_parallel();
+
+void test_parallel_parse();
+
+void test_stream();
+
+void test_budget();
+
+void test_histogram();
+
+void test_stats();
+
+void test_trace();
+
+void test_capture();
+
+void test_differential();
+
+void test_stages();
+
+void test_scaling();
+
+void test_format();
+
+void test_results();
+
 #endif
\ No newline at end of file
@@ -0,0 +1,210 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include "tier.h"
+
+#define TIER_INITIAL_BUCKETS 64
+
+static const char *tier_names[TIER_COUNT] = {"interpreter", "bytecode", "native"};
+
+TierConfig tier_default_config() {
+    return (TierConfig){
+        .bytecode_threshold = 2,
+        .native_threshold = 100000,
+        .capacity = 4096
+    };
+}
+
+TierCache *tier_create(TierConfig config) {
+    TierCache *cache = calc_alloc(sizeof(TierCache));
+    cache->config = config;
+    cache->bucket_count = TIER_INITIAL_BUCKETS;
+    cache->buckets = calc_alloc(cache->bucket_count * sizeof(TierEntry *));
+    memset(cache->buckets, 0, cache->bucket_count * sizeof(TierEntry *));
+    cache->size = 0;
+    cache->newest = NULL;
+    cache->oldest = NULL;
+    cache->evictions = 0;
+    memset(cache->stats, 0, sizeof(cache->stats));
+    return cache;
+}
+
+static uint64_t tier_hash(const char *text) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *text; text++) {
+        hash ^= (unsigned char)*text;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void tier_grow(TierCache *cache) {
+    size_t bucket_count = cache->bucket_count * 2;
+    TierEntry **buckets = calc_alloc(bucket_count * sizeof(TierEntry *));
+    memset(buckets, 0, bucket_count * sizeof(TierEntry *));
+
+    for (size_t i = 0; i < cache->bucket_count; i++) {
+        TierEntry *entry = cache->buckets[i];
+        while (entry != NULL) {
+            TierEntry *next = entry->next;
+            size_t index = entry->hash & (bucket_count - 1);
+            entry->next = buckets[index];
+            buckets[index] = entry;
+            entry = next;
+        }
+    }
+
+    calc_free(cache->buckets, cache->bucket_count * sizeof(TierEntry *));
+    cache->buckets = buckets;
+    cache->bucket_count = bucket_count;
+}
+
+static void tier_unlink(TierCache *cache, TierEntry *entry) {
+    if (entry->newer != NULL) entry->newer->older = entry->older;
+    else cache->newest = entry->older;
+    if (entry->older != NULL) entry->older->newer = entry->newer;
+    else cache->oldest = entry->newer;
+}
+
+static void tier_push_newest(TierCache *cache, TierEntry *entry) {
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if (cache->newest != NULL) cache->newest->newer = entry;
+    else cache->oldest = entry;
+    cache->newest = entry;
+}
+
+static void tier_entry_free(TierEntry *entry) {
+    native_free(entry->native);
+    vm_free(entry->program);
+    ast_free(entry->root);
+    calc_free(entry->expression, strlen(entry->expression) + 1);
+    calc_free(entry, sizeof(TierEntry));
+}
+
+static void tier_evict_oldest(TierCache *cache) {
+    TierEntry *victim = cache->oldest;
+    tier_unlink(cache, victim);
+    TierEntry **link = &cache->buckets[victim->hash & (cache->bucket_count - 1)];
+    while (*link != victim) link = &(*link)->next;
+    *link = victim->next;
+    tier_entry_free(victim);
+    cache->size--;
+    cache->evictions++;
+}
+
+static TierEntry *tier_lookup(TierCache *cache, const char *expression) {
+    uint64_t hash = tier_hash(expression);
+    size_t index = hash & (cache->bucket_count - 1);
+
+    for (TierEntry *entry = cache->buckets[index]; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->expression, expression) == 0) {
+            if (entry != cache->newest) {
+                tier_unlink(cache, entry);
+                tier_push_newest(cache, entry);
+            }
+            return entry;
+        }
+    }
+
+    if (cache->config.capacity != 0 && cache->size >= cache->config.capacity) {
+        tier_evict_oldest(cache);
+    }
+
+    uint64_t start = calc_time_ns();
+    size_t length = strlen(expression);
+    TierEntry *entry = calc_alloc(sizeof(TierEntry));
+    entry->expression = memcpy(calc_alloc(length + 1), expression, length + 1);
+    entry->hash = hash;
+    entry->runs = 0;
+    entry->tier = TIER_INTERPRETER;
+    entry->native_failed = false;
+    entry->root = ast_build(expression);
+    entry->program = NULL;
+    entry->native = NULL;
+    entry->next = cache->buckets[index];
+    cache->buckets[index] = entry;
+    tier_push_newest(cache, entry);
+    cache->stats[TIER_INTERPRETER].compiles++;
+    cache->stats[TIER_INTERPRETER].compile_ns += calc_time_ns() - start;
+
+    if (++cache->size * 4 > cache->bucket_count * 3) {
+        tier_grow(cache);
+    }
+    return entry;
+}
+
+static void tier_promote(TierCache *cache, TierEntry *entry) {
+    TierConfig config = cache->config;
+
+    if (entry->tier == TIER_INTERPRETER && config.bytecode_threshold != 0 &&
+        entry->runs >= config.bytecode_threshold) {
+        uint64_t start = calc_time_ns();
+        entry->program = vm_compile(entry->root);
+        entry->tier = TIER_BYTECODE;
+        cache->stats[TIER_BYTECODE].compiles++;
+        cache->stats[TIER_BYTECODE].compile_ns += calc_time_ns() - start;
+    }
+
+    if (entry->tier != TIER_NATIVE && !entry->native_failed && config.native_threshold != 0 &&
+        entry->runs >= config.native_threshold) {
+        uint64_t start = calc_time_ns();
+        entry->native = native_compile(entry->root);
+        cache->stats[TIER_NATIVE].compile_ns += calc_time_ns() - start;
+        if (entry->native == NULL) {
+            // No compiler available; stay on the current tier for good
+            entry->native_failed = true;
+            return;
+        }
+        entry->tier = TIER_NATIVE;
+        cache->stats[TIER_NATIVE].compiles++;
+    }
+}
+
+double tier_eval(TierCache *cache, const char *expression) {
+    TierEntry *entry = tier_lookup(cache, expression);
+    tier_promote(cache, entry);
+    entry->runs++;
+
+    double result;
+    uint64_t start = calc_time_ns();
+    switch (entry->tier) {
+        case TIER_NATIVE:
+            result = native_run(entry->native);
+            break;
+        case TIER_BYTECODE:
+            result = vm_run(entry->program);
+            break;
+        default:
+            result = ast_eval(entry->root);
+            break;
+    }
+
+    TierStats *stats = &cache->stats[entry->tier];
+    stats->eval_ns += calc_time_ns() - start;
+    stats->runs++;
+    return result;
+}
+
+void tier_print_stats(const TierCache *cache, FILE *out) {
+    fprintf(out, "%-12s %12s %14s %10s %14s\n", "tier", "runs", "eval ns", "compiles", "compile ns");
+    for (int i = 0; i < TIER_COUNT; i++) {
+        const TierStats *stats = &cache->stats[i];
+        fprintf(out, "%-12s %12llu %14llu %10llu %14llu\n", tier_names[i],
+                (unsigned long long)stats->runs, (unsigned long long)stats->eval_ns,
+                (unsigned long long)stats->compiles, (unsigned long long)stats->compile_ns);
+    }
+    fprintf(out, "%zu cached, %llu evicted\n", cache->size, (unsigned long long)cache->evictions);
+}
+
+void tier_free(TierCache *cache) {
+    if (cache == NULL) return;
+    TierEntry *entry = cache->newest;
+    while (entry != NULL) {
+        TierEntry *next = entry->older;
+        tier_entry_free(entry);
+        entry = next;
+    }
+    calc_free(cache->buckets, cache->bucket_count * sizeof(TierEntry *));
+    calc_free(cache, sizeof(TierCache));
+}
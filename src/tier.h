@@ -0,0 +1,70 @@
+#ifndef TIER_H
+#define TIER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "calc.h"
+#include "vm.h"
+#include "native.h"
+
+typedef enum {
+    TIER_INTERPRETER,   // ast_eval on the cached tree
+    TIER_BYTECODE,      // Stack VM program
+    TIER_NATIVE,        // Library built by native_compile
+    TIER_COUNT
+} CalcTier;
+
+typedef struct {
+    uint64_t bytecode_threshold;  // Runs before compiling to bytecode, 0 disables
+    uint64_t native_threshold;    // Runs before compiling to native code, 0 disables
+    size_t capacity;              // Most entries kept, 0 for no limit
+} TierConfig;
+
+typedef struct {
+    uint64_t runs;
+    uint64_t eval_ns;
+    uint64_t compiles;      // Promotions into this tier (parses for the interpreter)
+    uint64_t compile_ns;
+} TierStats;
+
+typedef struct TierEntry {
+    char *expression;
+    uint64_t hash;
+    uint64_t runs;
+    CalcTier tier;
+    bool native_failed;
+    ASTNode *root;
+    VMProgram *program;
+    NativeExpr *native;
+    struct TierEntry *next;
+    struct TierEntry *newer;    // Recency list, most recently used first
+    struct TierEntry *older;
+} TierEntry;
+
+// Caches expressions passed to tier_eval and moves each one to a faster
+// engine once it has run often enough. Past config.capacity entries the
+// least recently used one is evicted, along with its compiled code. A
+// cache must only be used by one thread at a time.
+typedef struct {
+    TierConfig config;
+    TierEntry **buckets;
+    size_t bucket_count;
+    size_t size;
+    TierEntry *newest;
+    TierEntry *oldest;
+    uint64_t evictions;
+    TierStats stats[TIER_COUNT];
+} TierCache;
+
+TierConfig tier_default_config();
+
+TierCache *tier_create(TierConfig config);
+
+double tier_eval(TierCache *cache, const char *expression);
+
+void tier_print_stats(const TierCache *cache, FILE *out);
+
+void tier_free(TierCache *cache);
+
+#endif
@@ -0,0 +1,131 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "trace.h"
+
+typedef struct {
+    const char *name;       // String literals, so events store no copies
+    const char *category;
+    uint64_t start_ns;
+    uint64_t end_ns;
+} TraceEvent;
+
+typedef struct TraceBuffer {
+    pthread_mutex_t lock;   // Taken by the owner per event, contended only by flush
+    TraceEvent *events;
+    size_t size;
+    size_t capacity;
+    uint32_t tid;
+    struct TraceBuffer *next;
+} TraceBuffer;
+
+atomic_bool calc_trace_enabled = false;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceBuffer *trace_buffers = NULL;   // Kept after their threads exit
+static uint32_t trace_next_tid = 1;
+static char *trace_path = NULL;
+static bool trace_atexit_registered = false;
+
+static _Thread_local TraceBuffer *trace_local = NULL;
+
+static void trace_flush_at_exit() {
+    calc_trace_flush();
+}
+
+void calc_trace_start(const char *path) {
+    pthread_mutex_lock(&trace_lock);
+    free(trace_path);
+    trace_path = strdup(path);
+    if (!trace_atexit_registered) {
+        atexit(trace_flush_at_exit);
+        trace_atexit_registered = true;
+    }
+    pthread_mutex_unlock(&trace_lock);
+    atomic_store(&calc_trace_enabled, true);
+}
+
+// Trace buffers use malloc directly: a CalcAllocator arena may be reset
+// while events that point into the trace are still buffered
+static TraceBuffer *trace_buffer() {
+    if (trace_local != NULL) return trace_local;
+
+    TraceBuffer *buffer = calloc(1, sizeof(TraceBuffer));
+    if (buffer == NULL) return NULL;
+    pthread_mutex_init(&buffer->lock, NULL);
+    pthread_mutex_lock(&trace_lock);
+    buffer->tid = trace_next_tid++;
+    buffer->next = trace_buffers;
+    trace_buffers = buffer;
+    pthread_mutex_unlock(&trace_lock);
+
+    trace_local = buffer;
+    return buffer;
+}
+
+void calc_trace_record(const char *name, const char *category, uint64_t start_ns, uint64_t end_ns) {
+    TraceBuffer *buffer = trace_buffer();
+    if (buffer == NULL || !calc_trace_active()) return;
+
+    pthread_mutex_lock(&buffer->lock);
+    if (buffer->size == buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 1024;
+        TraceEvent *events = realloc(buffer->events, capacity * sizeof(TraceEvent));
+        if (events == NULL) {
+            pthread_mutex_unlock(&buffer->lock);
+            return;
+        }
+        buffer->events = events;
+        buffer->capacity = capacity;
+    }
+    buffer->events[buffer->size++] = (TraceEvent){name, category, start_ns, end_ns};
+    pthread_mutex_unlock(&buffer->lock);
+}
+
+bool calc_trace_flush() {
+    atomic_store(&calc_trace_enabled, false);
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_path == NULL) {
+        pthread_mutex_unlock(&trace_lock);
+        return true;
+    }
+
+    FILE *file = fopen(trace_path, "w");
+    bool ok = file != NULL;
+    if (ok) {
+        // Timestamps are relative to the first event, in microseconds
+        uint64_t origin = UINT64_MAX;
+        for (TraceBuffer *buffer = trace_buffers; buffer != NULL; buffer = buffer->next) {
+            pthread_mutex_lock(&buffer->lock);
+            for (size_t i = 0; i < buffer->size; i++) {
+                if (buffer->events[i].start_ns < origin) origin = buffer->events[i].start_ns;
+            }
+            pthread_mutex_unlock(&buffer->lock);
+        }
+
+        bool first = true;
+        fprintf(file, "{\"traceEvents\": [\n");
+        for (TraceBuffer *buffer = trace_buffers; buffer != NULL; buffer = buffer->next) {
+            pthread_mutex_lock(&buffer->lock);
+            for (size_t i = 0; i < buffer->size; i++) {
+                TraceEvent *event = &buffer->events[i];
+                fprintf(file, "%s{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %u}",
+                    first ? "" : ",\n", event->name, event->category, (double)(event->start_ns - origin) / 1000.0,
+                    (double)(event->end_ns - event->start_ns) / 1000.0, buffer->tid);
+                first = false;
+            }
+            buffer->size = 0;
+            pthread_mutex_unlock(&buffer->lock);
+        }
+        fprintf(file, "\n], \"displayTimeUnit\": \"ns\"}\n");
+        ok = fclose(file) == 0;
+    }
+
+    free(trace_path);
+    trace_path = NULL;
+    pthread_mutex_unlock(&trace_lock);
+    return ok;
+}
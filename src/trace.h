@@ -0,0 +1,32 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "calc.h"
+
+// Span recorder for chrome://tracing and Perfetto. Each thread appends
+// complete events to its own in-memory buffer; nothing is written until
+// calc_trace_flush, which also runs at exit once tracing has started.
+extern atomic_bool calc_trace_enabled;
+
+// Starts recording; the trace is written to `path` on flush
+void calc_trace_start(const char *path);
+
+// Writes every buffered event as trace_event JSON and stops recording.
+// Returns false if the file could not be written.
+bool calc_trace_flush();
+
+void calc_trace_record(const char *name, const char *category, uint64_t start_ns, uint64_t end_ns);
+
+static inline bool calc_trace_active() {
+    return atomic_load_explicit(&calc_trace_enabled, memory_order_relaxed);
+}
+
+// CALC_TRACE_BEGIN(span); ...; CALC_TRACE_END(span, "ast_build", "parse");
+#define CALC_TRACE_BEGIN(name) uint64_t name = calc_trace_active() ? calc_time_ns() : 0
+#define CALC_TRACE_END(name, event, category) \
+    do { if (name != 0) calc_trace_record(event, category, name, calc_time_ns()); } while (0)
+
+#endif
@@ -0,0 +1,670 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "vm.h"
+#include "flat.h"
+#include "trace.h"
+
+// Computed goto is a GNU extension; other compilers fall back to a switch
+#if defined(__GNUC__)
+#define VM_THREADED 1
+#else
+#define VM_THREADED 0
+#endif
+
+static const char *vm_opcode_names[] = {
+    "PUSH", "PUSH2", "ADD", "SUB", "MUL", "DIV", "NEG",
+    "ADD_CONST", "SUB_CONST", "MUL_CONST", "DIV_CONST", "NULL", "HALT"
+};
+
+static VMProgram *vm_create() {
+    VMProgram *program = calc_alloc(sizeof(VMProgram));
+    program->size = 0;
+    program->capacity = 0;
+    program->code = NULL;
+    program->constant_count = 0;
+    program->constant_capacity = 0;
+    program->constants = NULL;
+    program->max_depth = 0;
+    return program;
+}
+
+static void vm_emit(VMProgram *program, VMOpcode op, uint32_t arg) {
+    if (program->size == program->capacity) {
+        size_t capacity = program->capacity ? program->capacity * 2 : 32;
+        program->code = calc_realloc(program->code, program->capacity * sizeof(VMInstr), capacity * sizeof(VMInstr));
+        program->capacity = capacity;
+    }
+    program->code[program->size++] = (VMInstr){(uint8_t)op, arg, NULL};
+}
+
+static uint32_t vm_add_constant(VMProgram *program, double value) {
+    if (program->constant_count == program->constant_capacity) {
+        size_t capacity = program->constant_capacity ? program->constant_capacity * 2 : 16;
+        program->constants = calc_realloc(program->constants, program->constant_capacity * sizeof(double), capacity * sizeof(double));
+        program->constant_capacity = capacity;
+    }
+    program->constants[program->constant_count] = value;
+    return (uint32_t)program->constant_count++;
+}
+
+static void vm_compile_node(VMProgram *program, ASTNode *node, size_t depth) {
+    if (depth + 1 > program->max_depth) {
+        program->max_depth = depth + 1;
+    }
+
+    if (node == NULL) {
+        vm_emit(program, VM_NULL, 0);
+        return;
+    }
+
+    switch (node->type) {
+        case NODE_NUMBER:
+            vm_emit(program, VM_PUSH, vm_add_constant(program, node->number));
+            break;
+        case NODE_BINARY_OP:
+            vm_compile_node(program, node->binary.left, depth);
+            vm_compile_node(program, node->binary.right, depth + 1);
+            switch (node->binary.operator) {
+                case '+': vm_emit(program, VM_ADD, 0); break;
+                case '-': vm_emit(program, VM_SUB, 0); break;
+                case '*': vm_emit(program, VM_MUL, 0); break;
+                case '/': vm_emit(program, VM_DIV, 0); break;
+                default:
+                    fprintf(stderr, "Error: Unknown binary operator %c\n", node->binary.operator);
+                    exit(1);
+            }
+            break;
+        case NODE_UNARY_OP:
+            vm_compile_node(program, node->unary.operand, depth);
+            switch (node->unary.operator) {
+                case '-': vm_emit(program, VM_NEG, 0); break;
+                case '+': break;
+                default:
+                    fprintf(stderr, "Error: Unknown unary operator %c\n", node->unary.operator);
+                    exit(1);
+            }
+            break;
+    }
+}
+
+static bool vm_is_binary(uint8_t op) {
+    return op == VM_ADD || op == VM_SUB || op == VM_MUL || op == VM_DIV;
+}
+
+// Fuses the most frequent opcode pairs. Counting pairs over the test
+// expressions gives push;push first, then push followed by a binary op.
+static void vm_peephole(VMProgram *program) {
+    VMInstr *code = program->code;
+    size_t size = program->size;
+    size_t out = 0;
+
+    for (size_t i = 0; i < size; i++) {
+        VMInstr instr = code[i];
+
+        if (instr.op == VM_PUSH) {
+            // Negating a constant is exact, so fold it into the literal
+            while (i + 1 < size && code[i + 1].op == VM_NEG) {
+                program->constants[instr.arg] = -program->constants[instr.arg];
+                i++;
+            }
+
+            if (i + 1 < size && vm_is_binary(code[i + 1].op)) {
+                instr.op = VM_ADD_CONST + (code[i + 1].op - VM_ADD);
+                i++;
+            } else if (i + 1 < size && code[i + 1].op == VM_PUSH && code[i + 1].arg == instr.arg + 1 &&
+                       !(i + 2 < size && (vm_is_binary(code[i + 2].op) || code[i + 2].op == VM_NEG))) {
+                instr.op = VM_PUSH2;
+                i++;
+            }
+        }
+
+        code[out++] = instr;
+    }
+
+    program->size = out;
+}
+
+static double vm_execute(const VMProgram *program, const void *const **labels_out) {
+#if VM_THREADED
+    static const void *const labels[VM_OPCODE_COUNT] = {
+        [VM_PUSH] = &&do_VM_PUSH, [VM_PUSH2] = &&do_VM_PUSH2,
+        [VM_ADD] = &&do_VM_ADD, [VM_SUB] = &&do_VM_SUB,
+        [VM_MUL] = &&do_VM_MUL, [VM_DIV] = &&do_VM_DIV, [VM_NEG] = &&do_VM_NEG,
+        [VM_ADD_CONST] = &&do_VM_ADD_CONST, [VM_SUB_CONST] = &&do_VM_SUB_CONST,
+        [VM_MUL_CONST] = &&do_VM_MUL_CONST, [VM_DIV_CONST] = &&do_VM_DIV_CONST,
+        [VM_NULL] = &&do_VM_NULL, [VM_HALT] = &&do_VM_HALT
+    };
+    if (labels_out != NULL) {
+        *labels_out = labels;
+        return 0;
+    }
+#define VM_CASE(name) do_##name:
+#define VM_NEXT() goto *ip->target
+#else
+    if (labels_out != NULL) {
+        *labels_out = NULL;
+        return 0;
+    }
+#define VM_CASE(name) case name:
+#define VM_NEXT() continue
+#endif
+
+    double small_stack[64];
+    double *stack = program->max_depth <= 64 ? small_stack : calc_alloc(program->max_depth * sizeof(double));
+    const double *constants = program->constants;
+    const VMInstr *ip = program->code;
+    size_t top = 0;
+    double right;
+
+#if VM_THREADED
+    VM_NEXT();
+#else
+    for (;;) switch (ip->op) {
+#endif
+    VM_CASE(VM_PUSH)
+        stack[top++] = constants[ip->arg];
+        ip++;
+        VM_NEXT();
+    VM_CASE(VM_PUSH2)
+        stack[top++] = constants[ip->arg];
+        stack[top++] = constants[ip->arg + 1];
+        ip++;
+        VM_NEXT();
+    VM_CASE(VM_ADD)
+        top--;
+        stack[top - 1] += stack[top];
+        ip++;
+        VM_NEXT();
+    VM_CASE(VM_SUB)
+        top--;
+        stack[top - 1] -= stack[top];
+        ip++;
+        VM_NEXT();
+    VM_CASE(VM_MUL)
+        top--;
+        stack[top - 1] *= stack[top];
+        ip++;
+        VM_NEXT();
+    VM_CASE(VM_DIV)
+        right = stack[--top];
+        goto divide;
+    VM_CASE(VM_NEG)
+        stack[top - 1] = -stack[top - 1];
+        ip++;
+        VM_NEXT();
+    VM_CASE(VM_ADD_CONST)
+        stack[top - 1] += constants[ip->arg];
+        ip++;
+        VM_NEXT();
+    VM_CASE(VM_SUB_CONST)
+        stack[top - 1] -= constants[ip->arg];
+        ip++;
+        VM_NEXT();
+    VM_CASE(VM_MUL_CONST)
+        stack[top - 1] *= constants[ip->arg];
+        ip++;
+        VM_NEXT();
+    VM_CASE(VM_DIV_CONST)
+        right = constants[ip->arg];
+    divide:
+        if (right == 0) {
+            fprintf(stderr, "Error: Division by zero\n");
+            exit(1);
+        }
+        stack[top - 1] /= right;
+        ip++;
+        VM_NEXT();
+    VM_CASE(VM_NULL)
+        fprintf(stderr, "Error: NULL node in evaluation\n");
+        exit(1);
+    VM_CASE(VM_HALT)
+        goto done;
+#if !VM_THREADED
+    default:
+        fprintf(stderr, "Error: Unknown opcode %d\n", ip->op);
+        exit(1);
+    }
+#endif
+#undef VM_CASE
+#undef VM_NEXT
+
+done:;
+    double result = stack[top - 1];
+    if (stack != small_stack) calc_free(stack, program->max_depth * sizeof(double));
+    return result;
+}
+
+VMProgram *vm_compile(ASTNode *root) {
+    CALC_TRACE_BEGIN(trace_start);
+    VMProgram *program = vm_create();
+    vm_compile_node(program, root, 0);
+    vm_peephole(program);
+    vm_emit(program, VM_HALT, 0);
+
+    const void *const *labels;
+    vm_execute(NULL, &labels);
+    if (labels != NULL) {
+        for (size_t i = 0; i < program->size; i++) {
+            program->code[i].target = labels[program->code[i].op];
+        }
+    }
+
+    CALC_TRACE_END(trace_start, "vm_compile", "compile");
+    return program;
+}
+
+double vm_run(const VMProgram *program) {
+    CALC_TRACE_BEGIN(trace_start);
+    double result = vm_execute(program, NULL);
+    CALC_TRACE_END(trace_start, "vm_run", "eval");
+    return result;
+}
+
+void vm_print(const VMProgram *program) {
+    for (size_t i = 0; i < program->size; i++) {
+        VMInstr instr = program->code[i];
+        printf("%4zu  %-10s", i, vm_opcode_names[instr.op]);
+        switch (instr.op) {
+            case VM_PUSH:
+            case VM_ADD_CONST:
+            case VM_SUB_CONST:
+            case VM_MUL_CONST:
+            case VM_DIV_CONST:
+                printf(" %g", program->constants[instr.arg]);
+                break;
+            case VM_PUSH2:
+                printf(" %g %g", program->constants[instr.arg], program->constants[instr.arg + 1]);
+                break;
+        }
+        printf("\n");
+    }
+}
+
+void vm_free(VMProgram *program) {
+    if (program == NULL) return;
+    calc_free(program->code, program->capacity * sizeof(VMInstr));
+    calc_free(program->constants, program->constant_capacity * sizeof(double));
+    calc_free(program, sizeof(VMProgram));
+}
+
+/* ===== Register VM ===== */
+typedef struct {
+    bool is_constant;
+    uint32_t index;     // Constant index or virtual register
+} RegOperand;
+
+static const char *reg_opcode_names[] = {
+    "LOAD", "ADD", "SUB", "MUL", "DIV", "ADD_K", "SUB_K", "MUL_K", "DIV_K", "NEG", "NULL", "RET"
+};
+
+static RegProgram *reg_create() {
+    RegProgram *program = calc_alloc(sizeof(RegProgram));
+    program->size = 0;
+    program->capacity = 0;
+    program->code = NULL;
+    program->constant_count = 0;
+    program->constant_capacity = 0;
+    program->constants = NULL;
+    program->register_count = 0;
+    return program;
+}
+
+static void reg_emit(RegProgram *program, RegOpcode op, uint32_t dst, uint32_t a, uint32_t b) {
+    if (program->size == program->capacity) {
+        size_t capacity = program->capacity ? program->capacity * 2 : 32;
+        program->code = calc_realloc(program->code, program->capacity * sizeof(RegInstr), capacity * sizeof(RegInstr));
+        program->capacity = capacity;
+    }
+    program->code[program->size++] = (RegInstr){(uint8_t)op, dst, a, b, NULL};
+}
+
+static uint32_t reg_add_constant(RegProgram *program, double value) {
+    if (program->constant_count == program->constant_capacity) {
+        size_t capacity = program->constant_capacity ? program->constant_capacity * 2 : 16;
+        program->constants = calc_realloc(program->constants, program->constant_capacity * sizeof(double), capacity * sizeof(double));
+        program->constant_capacity = capacity;
+    }
+    program->constants[program->constant_count] = value;
+    return (uint32_t)program->constant_count++;
+}
+
+// Materializes a constant operand into a fresh virtual register
+static uint32_t reg_load(RegProgram *program, RegOperand operand) {
+    if (!operand.is_constant) return operand.index;
+    uint32_t dst = (uint32_t)program->register_count++;
+    reg_emit(program, REG_LOAD, dst, 0, operand.index);
+    return dst;
+}
+
+// Emits code for `node` using one virtual register per value. Numbers are
+// returned as constant operands so the parent can use the *_K forms.
+static RegOperand reg_compile_node(RegProgram *program, ASTNode *node) {
+    if (node == NULL) {
+        uint32_t dst = (uint32_t)program->register_count++;
+        reg_emit(program, REG_NULL, dst, 0, 0);
+        return (RegOperand){false, dst};
+    }
+
+    switch (node->type) {
+        case NODE_NUMBER:
+            return (RegOperand){true, reg_add_constant(program, node->number)};
+        case NODE_BINARY_OP: {
+            uint32_t left = reg_load(program, reg_compile_node(program, node->binary.left));
+            RegOperand right = reg_compile_node(program, node->binary.right);
+            RegOpcode op;
+            switch (node->binary.operator) {
+                case '+': op = REG_ADD; break;
+                case '-': op = REG_SUB; break;
+                case '*': op = REG_MUL; break;
+                case '/': op = REG_DIV; break;
+                default:
+                    fprintf(stderr, "Error: Unknown binary operator %c\n", node->binary.operator);
+                    exit(1);
+            }
+            if (right.is_constant) {
+                op += REG_ADD_K - REG_ADD;
+            }
+            uint32_t dst = (uint32_t)program->register_count++;
+            reg_emit(program, op, dst, left, right.index);
+            return (RegOperand){false, dst};
+        }
+        case NODE_UNARY_OP: {
+            RegOperand operand = reg_compile_node(program, node->unary.operand);
+            switch (node->unary.operator) {
+                case '+':
+                    return operand;
+                case '-':
+                    if (operand.is_constant) {
+                        // Negating a constant is exact, so fold it
+                        program->constants[operand.index] = -program->constants[operand.index];
+                        return operand;
+                    }
+                    uint32_t dst = (uint32_t)program->register_count++;
+                    reg_emit(program, REG_NEG, dst, operand.index, 0);
+                    return (RegOperand){false, dst};
+                default:
+                    fprintf(stderr, "Error: Unknown unary operator %c\n", node->unary.operator);
+                    exit(1);
+            }
+        }
+    }
+
+    fprintf(stderr, "Error: Unknown node type\n");
+    exit(1);
+}
+
+static bool reg_reads_a(uint8_t op) {
+    return op != REG_LOAD && op != REG_NULL;
+}
+
+static bool reg_reads_b(uint8_t op) {
+    return op >= REG_ADD && op <= REG_DIV;
+}
+
+// Linear scan over the virtual registers. Every value in a tree is used
+// exactly once, so intervals are ordered by definition and end at their
+// only use; an operand's register is released before the destination is
+// assigned, letting "r0 = r0 + r1" reuse it.
+static void reg_allocate(RegProgram *program) {
+    size_t virtual_count = program->register_count;
+    size_t *last_use = calc_alloc(virtual_count * sizeof(size_t));
+    uint32_t *assigned = calc_alloc(virtual_count * sizeof(uint32_t));
+    uint32_t *free_registers = calc_alloc(virtual_count * sizeof(uint32_t));
+    size_t free_count = 0;
+    size_t physical_count = 0;
+
+    for (size_t i = 0; i < program->size; i++) {
+        RegInstr *instr = &program->code[i];
+        if (reg_reads_a(instr->op)) last_use[instr->a] = i;
+        if (reg_reads_b(instr->op)) last_use[instr->b] = i;
+    }
+
+    for (size_t i = 0; i < program->size; i++) {
+        RegInstr *instr = &program->code[i];
+        if (reg_reads_a(instr->op)) {
+            uint32_t virtual = instr->a;
+            instr->a = assigned[virtual];
+            if (last_use[virtual] == i) free_registers[free_count++] = instr->a;
+        }
+        if (reg_reads_b(instr->op)) {
+            uint32_t virtual = instr->b;
+            instr->b = assigned[virtual];
+            if (last_use[virtual] == i) free_registers[free_count++] = instr->b;
+        }
+        if (instr->op != REG_RET) {
+            uint32_t physical = free_count > 0 ? free_registers[--free_count] : (uint32_t)physical_count++;
+            assigned[instr->dst] = physical;
+            instr->dst = physical;
+        }
+    }
+
+    program->register_count = physical_count;
+    calc_free(last_use, virtual_count * sizeof(size_t));
+    calc_free(assigned, virtual_count * sizeof(uint32_t));
+    calc_free(free_registers, virtual_count * sizeof(uint32_t));
+}
+
+static double reg_execute(const RegProgram *program, const void *const **labels_out) {
+#if VM_THREADED
+    static const void *const labels[REG_OPCODE_COUNT] = {
+        [REG_LOAD] = &&do_REG_LOAD,
+        [REG_ADD] = &&do_REG_ADD, [REG_SUB] = &&do_REG_SUB,
+        [REG_MUL] = &&do_REG_MUL, [REG_DIV] = &&do_REG_DIV,
+        [REG_ADD_K] = &&do_REG_ADD_K, [REG_SUB_K] = &&do_REG_SUB_K,
+        [REG_MUL_K] = &&do_REG_MUL_K, [REG_DIV_K] = &&do_REG_DIV_K,
+        [REG_NEG] = &&do_REG_NEG, [REG_NULL] = &&do_REG_NULL, [REG_RET] = &&do_REG_RET
+    };
+    if (labels_out != NULL) {
+        *labels_out = labels;
+        return 0;
+    }
+#define REG_CASE(name) do_##name:
+#define REG_NEXT() goto *ip->target
+#else
+    if (labels_out != NULL) {
+        *labels_out = NULL;
+        return 0;
+    }
+#define REG_CASE(name) case name:
+#define REG_NEXT() continue
+#endif
+
+    double small_registers[64];
+    double *r = program->register_count <= 64 ? small_registers : calc_alloc(program->register_count * sizeof(double));
+    const double *constants = program->constants;
+    const RegInstr *ip = program->code;
+    double right;
+    double result;
+
+#if VM_THREADED
+    REG_NEXT();
+#else
+    for (;;) switch (ip->op) {
+#endif
+    REG_CASE(REG_LOAD)
+        r[ip->dst] = constants[ip->b];
+        ip++;
+        REG_NEXT();
+    REG_CASE(REG_ADD)
+        r[ip->dst] = r[ip->a] + r[ip->b];
+        ip++;
+        REG_NEXT();
+    REG_CASE(REG_SUB)
+        r[ip->dst] = r[ip->a] - r[ip->b];
+        ip++;
+        REG_NEXT();
+    REG_CASE(REG_MUL)
+        r[ip->dst] = r[ip->a] * r[ip->b];
+        ip++;
+        REG_NEXT();
+    REG_CASE(REG_DIV)
+        right = r[ip->b];
+        goto divide;
+    REG_CASE(REG_ADD_K)
+        r[ip->dst] = r[ip->a] + constants[ip->b];
+        ip++;
+        REG_NEXT();
+    REG_CASE(REG_SUB_K)
+        r[ip->dst] = r[ip->a] - constants[ip->b];
+        ip++;
+        REG_NEXT();
+    REG_CASE(REG_MUL_K)
+        r[ip->dst] = r[ip->a] * constants[ip->b];
+        ip++;
+        REG_NEXT();
+    REG_CASE(REG_DIV_K)
+        right = constants[ip->b];
+    divide:
+        if (right == 0) {
+            fprintf(stderr, "Error: Division by zero\n");
+            exit(1);
+        }
+        r[ip->dst] = r[ip->a] / right;
+        ip++;
+        REG_NEXT();
+    REG_CASE(REG_NEG)
+        r[ip->dst] = -r[ip->a];
+        ip++;
+        REG_NEXT();
+    REG_CASE(REG_NULL)
+        fprintf(stderr, "Error: NULL node in evaluation\n");
+        exit(1);
+    REG_CASE(REG_RET)
+        result = r[ip->a];
+        goto done;
+#if !VM_THREADED
+    default:
+        fprintf(stderr, "Error: Unknown opcode %d\n", ip->op);
+        exit(1);
+    }
+#endif
+#undef REG_CASE
+#undef REG_NEXT
+
+done:
+    if (r != small_registers) calc_free(r, program->register_count * sizeof(double));
+    return result;
+}
+
+RegProgram *reg_compile(ASTNode *root) {
+    CALC_TRACE_BEGIN(trace_start);
+    RegProgram *program = reg_create();
+    uint32_t result = reg_load(program, reg_compile_node(program, root));
+    reg_emit(program, REG_RET, 0, result, 0);
+    reg_allocate(program);
+
+    const void *const *labels;
+    reg_execute(NULL, &labels);
+    if (labels != NULL) {
+        for (size_t i = 0; i < program->size; i++) {
+            program->code[i].target = labels[program->code[i].op];
+        }
+    }
+
+    CALC_TRACE_END(trace_start, "reg_compile", "compile");
+    return program;
+}
+
+double reg_run(const RegProgram *program) {
+    CALC_TRACE_BEGIN(trace_start);
+    double result = reg_execute(program, NULL);
+    CALC_TRACE_END(trace_start, "reg_run", "eval");
+    return result;
+}
+
+void reg_print(const RegProgram *program) {
+    for (size_t i = 0; i < program->size; i++) {
+        RegInstr instr = program->code[i];
+        printf("%4zu  %-6s", i, reg_opcode_names[instr.op]);
+        switch (instr.op) {
+            case REG_LOAD:
+                printf(" r%u, %g", instr.dst, program->constants[instr.b]);
+                break;
+            case REG_ADD: case REG_SUB: case REG_MUL: case REG_DIV:
+                printf(" r%u, r%u, r%u", instr.dst, instr.a, instr.b);
+                break;
+            case REG_ADD_K: case REG_SUB_K: case REG_MUL_K: case REG_DIV_K:
+                printf(" r%u, r%u, %g", instr.dst, instr.a, program->constants[instr.b]);
+                break;
+            case REG_NEG:
+                printf(" r%u, r%u", instr.dst, instr.a);
+                break;
+            case REG_NULL:
+                printf(" r%u", instr.dst);
+                break;
+            case REG_RET:
+                printf(" r%u", instr.a);
+                break;
+        }
+        printf("\n");
+    }
+}
+
+void reg_free(RegProgram *program) {
+    if (program == NULL) return;
+    calc_free(program->code, program->capacity * sizeof(RegInstr));
+    calc_free(program->constants, program->constant_capacity * sizeof(double));
+    calc_free(program, sizeof(RegProgram));
+}
+
+/* ===== Engine selection ===== */
+static const char *calc_engine_names[CALC_ENGINE_COUNT] = {
+    "ast", "flat", "postfix", "stack", "register"
+};
+
+const char *calc_engine_name(CalcEngine engine) {
+    return engine < CALC_ENGINE_COUNT ? calc_engine_names[engine] : "unknown";
+}
+
+bool calc_engine_parse(const char *name, CalcEngine *engine) {
+    for (int i = 0; i < CALC_ENGINE_COUNT; i++) {
+        if (strcmp(name, calc_engine_names[i]) == 0) {
+            *engine = (CalcEngine)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+double eval_engine(const char *expression, CalcEngine engine) {
+    double result;
+
+    if (engine == CALC_ENGINE_AST) {
+        return eval(expression);
+    }
+    if (engine == CALC_ENGINE_POSTFIX) {
+        PostfixExpr *expr = ast_build_postfix(expression);
+        result = postfix_eval(expr);
+        postfix_free(expr);
+        return result;
+    }
+
+    ASTNode *root = ast_build(expression);
+    switch (engine) {
+        case CALC_ENGINE_FLAT: {
+            FlatAST *flat = flat_from_ast(root);
+            result = flat_eval(flat);
+            flat_free(flat);
+            break;
+        }
+        case CALC_ENGINE_STACK_VM: {
+            VMProgram *program = vm_compile(root);
+            result = vm_run(program);
+            vm_free(program);
+            break;
+        }
+        case CALC_ENGINE_REGISTER_VM: {
+            RegProgram *program = reg_compile(root);
+            result = reg_run(program);
+            reg_free(program);
+            break;
+        }
+        default:
+            fprintf(stderr, "Error: Unknown engine %d\n", engine);
+            exit(1);
+    }
+    ast_free(root);
+    return result;
+}
@@ -0,0 +1,96 @@
+#ifndef VM_H
+#define VM_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "calc.h"
+
+typedef enum {
+    VM_PUSH,        // Push constants[arg]
+    VM_PUSH2,       // Push constants[arg] and constants[arg + 1]
+    VM_ADD, VM_SUB, VM_MUL, VM_DIV, VM_NEG,
+    VM_ADD_CONST,   // Superinstructions fusing "push constants[arg]; op"
+    VM_SUB_CONST,
+    VM_MUL_CONST,
+    VM_DIV_CONST,
+    VM_NULL,        // Hole left by an invalid tree, fails at run time
+    VM_HALT,
+    VM_OPCODE_COUNT
+} VMOpcode;
+
+typedef struct {
+    uint8_t op;
+    uint32_t arg;
+    const void *target;  // Dispatch label, set when built with computed goto
+} VMInstr;
+
+// Stack bytecode compiled from an ASTNode tree
+typedef struct {
+    size_t size;
+    size_t capacity;
+    VMInstr *code;
+    size_t constant_count;
+    size_t constant_capacity;
+    double *constants;
+    size_t max_depth;
+} VMProgram;
+
+typedef enum {
+    REG_LOAD,       // dst = constants[b]
+    REG_ADD, REG_SUB, REG_MUL, REG_DIV,         // dst = a op b
+    REG_ADD_K, REG_SUB_K, REG_MUL_K, REG_DIV_K, // dst = a op constants[b]
+    REG_NEG,        // dst = -a
+    REG_NULL,       // Hole left by an invalid tree, fails at run time
+    REG_RET,        // Return a
+    REG_OPCODE_COUNT
+} RegOpcode;
+
+typedef struct {
+    uint8_t op;
+    uint32_t dst;
+    uint32_t a;
+    uint32_t b;
+    const void *target;  // Dispatch label, set when built with computed goto
+} RegInstr;
+
+// Three-address bytecode over a register file sized by linear scan
+typedef struct {
+    size_t size;
+    size_t capacity;
+    RegInstr *code;
+    size_t constant_count;
+    size_t constant_capacity;
+    double *constants;
+    size_t register_count;
+} RegProgram;
+
+typedef enum {
+    CALC_ENGINE_AST, CALC_ENGINE_FLAT, CALC_ENGINE_POSTFIX,
+    CALC_ENGINE_STACK_VM, CALC_ENGINE_REGISTER_VM,
+    CALC_ENGINE_COUNT
+} CalcEngine;
+
+VMProgram *vm_compile(ASTNode *root);
+
+double vm_run(const VMProgram *program);
+
+void vm_print(const VMProgram *program);
+
+void vm_free(VMProgram *program);
+
+RegProgram *reg_compile(ASTNode *root);
+
+double reg_run(const RegProgram *program);
+
+void reg_print(const RegProgram *program);
+
+void reg_free(RegProgram *program);
+
+const char *calc_engine_name(CalcEngine engine);
+
+bool calc_engine_parse(const char *name, CalcEngine *engine);
+
+double eval_engine(const char *expression, CalcEngine engine);
+
+#endif
@@ -0,0 +1,95 @@
+// calcbatch: evaluates one expression per input line and writes one result
+// per output line.
+//
+// Results are printed as the shortest decimal that reads back as the same
+// double (see calc_format_double). A line that does not parse, or that
+// divides by zero, gives "error" so output lines stay aligned with input.
+// With --binary the results are written in the layout documented with
+// CalcResultsWriter instead, ready to be mmap'd by the consumer.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include "calc.h"
+#include "format.h"
+
+// Strict parse and constant folding, which computes the same value as
+// ast_eval but leaves a division by zero in the tree instead of exiting
+static bool batch_eval(const char *expression, double *result) {
+    ASTNode *root = ast_optimize(ast_build_strict(expression), CALC_OPT_FOLD);
+    bool valid = root != NULL && root->type == NODE_NUMBER;
+    if (valid) *result = root->number;
+    ast_free(root);
+    return valid;
+}
+
+int main(int argc, char **argv) {
+    const char *input_path = NULL;
+    const char *output_path = NULL;
+    bool binary = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (strcmp(argv[i], "--binary") == 0) {
+            binary = true;
+        } else if (input_path == NULL && argv[i][0] != '-') {
+            input_path = argv[i];
+        } else {
+            fprintf(stderr, "Usage: %s [input] [-o output] [--binary]\n", argv[0]);
+            fprintf(stderr, "  Reads stdin and writes stdout when no files are given\n");
+            fprintf(stderr, "  --binary writes raw little-endian doubles and an error bitmap to a seekable output\n");
+            return 1;
+        }
+    }
+
+    FILE *input = input_path ? fopen(input_path, "r") : stdin;
+    if (input == NULL) {
+        fprintf(stderr, "Error: Cannot open %s\n", input_path);
+        return 1;
+    }
+    FILE *output = output_path ? fopen(output_path, binary ? "wb" : "w") : stdout;
+    if (output == NULL) {
+        fprintf(stderr, "Error: Cannot create %s\n", output_path);
+        return 1;
+    }
+
+    CalcResultsWriter *results = malloc(sizeof(CalcResultsWriter));
+    CalcWriter *writer = &results->writer;
+    if (binary) {
+        if (!calc_results_begin(results, output)) {
+            fprintf(stderr, "Error: --binary needs an output file it can seek in\n");
+            return 1;
+        }
+    } else {
+        calc_writer_init(writer, output);
+    }
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &capacity, input)) != -1) {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) line[--length] = '\0';
+        double result = NAN;
+        if (binary) {
+            bool valid = batch_eval(line, &result);
+            calc_results_add(results, result, !valid);
+        } else if (batch_eval(line, &result)) {
+            calc_writer_double(writer, result, '\n');
+        } else {
+            calc_writer_write(writer, "error\n", 6);
+        }
+    }
+
+    bool written = binary ? calc_results_finish(results) : calc_writer_flush(writer);
+    free(results);
+    free(line);
+    if (input != stdin) fclose(input);
+    if (output != stdout && fclose(output) != 0) written = false;
+    if (!written) {
+        fprintf(stderr, "Error: Writing results failed\n");
+        return 1;
+    }
+    return 0;
+}
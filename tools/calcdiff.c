@@ -0,0 +1,72 @@
+// calcdiff: runs random expressions through every evaluation engine and
+// reports the first disagreement, shrunk to a minimal expression.
+//
+// Each run is reproducible from its seed; --count and --leaves set how
+// many expressions are tried and how large they get.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "calc.h"
+#include "difftest.h"
+
+int main(int argc, char **argv) {
+    unsigned seed = 1;
+    size_t count = 10000;
+    size_t max_leaves = 32;
+    size_t threads = 4;
+    const char *ops = "+-*/";
+    DiffOptions options = {false, NULL};
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc) {
+            count = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--leaves") == 0 && i + 1 < argc) {
+            max_leaves = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc) {
+            ops = argv[++i];
+        } else if (strcmp(argv[i], "--native") == 0) {
+            options.native = true;
+        } else {
+            max_leaves = 0;
+            break;
+        }
+    }
+    if (max_leaves == 0 || ops[0] == '\0' || strspn(ops, "+-*/") != strlen(ops)) {
+        fprintf(stderr, "Usage: %s [--seed <n>] [--count <n>] [--leaves <max>] [--threads <n>] [--ops <chars>] [--native]\n", argv[0]);
+        fprintf(stderr, "  --ops limits the binary operators, e.g. --ops '+-*' to check reassociation on every run\n");
+        fprintf(stderr, "  --threads 0 leaves out the parallel engines, --native compiles every expression\n");
+        return 1;
+    }
+
+    if (threads > 0) options.pool = thread_pool_create(threads);
+
+    int status = 0;
+    for (size_t run = 0; run < count; run++) {
+        size_t leaves = 1 + (size_t)rand_r(&seed) % max_leaves;
+        char *expression = diff_generate(&seed, leaves, ops);
+        DiffFailure failure;
+        if (!diff_check(expression, &options, &failure)) {
+            char *minimal = diff_minimize(expression, &options, failure.engine);
+            diff_check(minimal, &options, &failure);
+            printf("Mismatch in %s after %zu expressions\n", failure.engine, run + 1);
+            printf("  expression: %s\n", minimal);
+            printf("  ast_eval:   %.17g\n", failure.expected);
+            printf("  %-11s %.17g\n", failure.engine, failure.actual);
+            printf("  original:   %s\n", expression);
+            diff_free(minimal);
+            diff_free(expression);
+            status = 1;
+            break;
+        }
+        diff_free(expression);
+    }
+    if (status == 0) printf("%zu expressions agreed across all engines\n", count);
+
+    if (options.pool != NULL) thread_pool_destroy(options.pool);
+    return status;
+}
@@ -0,0 +1,196 @@
+// calcgen: compiles a file of named formulas into a C header.
+//
+// Each non-empty line of the input is `name = expression`; lines starting
+// with '#' are comments. Every formula becomes a `static inline` function
+// returning its constant-folded value, so the program using the header
+// pays no parsing or evaluation cost at run time.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include "calc.h"
+#include "codegen.h"
+
+#define MAX_FORMULAS 4096
+
+static char *read_line(FILE *file) {
+    size_t capacity = 256;
+    size_t length = 0;
+    char *line = malloc(capacity);
+
+    int c;
+    while ((c = fgetc(file)) != EOF && c != '\n') {
+        if (length + 1 == capacity) {
+            capacity *= 2;
+            line = realloc(line, capacity);
+        }
+        line[length++] = (char)c;
+    }
+    if (c == EOF && length == 0) {
+        free(line);
+        return NULL;
+    }
+    line[length] = '\0';
+    return line;
+}
+
+static char *trim(char *text) {
+    while (isspace((unsigned char)*text)) text++;
+    char *end = text + strlen(text);
+    while (end > text && isspace((unsigned char)end[-1])) end--;
+    *end = '\0';
+    return text;
+}
+
+static const char *c_keywords[] = {
+    "auto", "break", "case", "char", "const", "continue", "default", "do",
+    "double", "else", "enum", "extern", "float", "for", "goto", "if",
+    "inline", "int", "long", "register", "restrict", "return", "short",
+    "signed", "sizeof", "static", "struct", "switch", "typedef", "union",
+    "unsigned", "void", "volatile", "while", "bool", "true", "false",
+    "alignas", "alignof", "nullptr", "static_assert", "thread_local",
+    "typeof", "typeof_unqual", "constexpr"
+};
+
+static bool is_identifier(const char *name) {
+    if (!isalpha((unsigned char)name[0]) && name[0] != '_') return false;
+    for (const char *c = name + 1; *c; c++) {
+        if (!isalnum((unsigned char)*c) && *c != '_') return false;
+    }
+    return true;
+}
+
+// Keywords, and names reserved to the implementation such as _Bool or __x
+static bool is_reserved(const char *name) {
+    if (name[0] == '_' && (name[1] == '_' || isupper((unsigned char)name[1]))) return true;
+    for (size_t i = 0; i < sizeof(c_keywords) / sizeof(c_keywords[0]); i++) {
+        if (strcmp(name, c_keywords[i]) == 0) return true;
+    }
+    return false;
+}
+
+// Builds CALCGEN_FORMULAS_H from "path/to/formulas.h". The prefix keeps
+// the guard a valid macro name when the file name starts with a digit.
+static void header_guard(const char *path, char *guard, size_t size) {
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    size_t i = (size_t)snprintf(guard, size, "CALCGEN_");
+    for (; *base && i + 1 < size; base++, i++) {
+        guard[i] = isalnum((unsigned char)*base) ? (char)toupper((unsigned char)*base) : '_';
+    }
+    guard[i] = '\0';
+}
+
+int main(int argc, char **argv) {
+    const char *input_path = NULL;
+    const char *output_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (input_path == NULL) {
+            input_path = argv[i];
+        } else {
+            input_path = NULL;
+            break;
+        }
+    }
+    if (input_path == NULL) {
+        fprintf(stderr, "Usage: %s <formulas> [-o <header.h>]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *input = fopen(input_path, "r");
+    if (input == NULL) {
+        fprintf(stderr, "Error: Cannot open %s\n", input_path);
+        return 1;
+    }
+
+    char *names[MAX_FORMULAS];
+    char *sources[MAX_FORMULAS];
+    ASTNode *formulas[MAX_FORMULAS];
+    size_t count = 0;
+    size_t line_number = 0;
+    char *line;
+
+    while ((line = read_line(input)) != NULL) {
+        line_number++;
+        char *text = trim(line);
+        if (*text == '\0' || *text == '#') {
+            free(line);
+            continue;
+        }
+
+        char *equals = strchr(text, '=');
+        if (equals == NULL) {
+            fprintf(stderr, "%s:%zu: expected `name = expression`\n", input_path, line_number);
+            return 1;
+        }
+        *equals = '\0';
+        char *name = trim(text);
+        char *source = trim(equals + 1);
+
+        if (!is_identifier(name)) {
+            fprintf(stderr, "%s:%zu: `%s` is not a valid C identifier\n", input_path, line_number, name);
+            return 1;
+        }
+        if (is_reserved(name)) {
+            fprintf(stderr, "%s:%zu: `%s` is a C keyword or reserved name\n", input_path, line_number, name);
+            return 1;
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (strcmp(names[i], name) == 0) {
+                fprintf(stderr, "%s:%zu: `%s` is already defined\n", input_path, line_number, name);
+                return 1;
+            }
+        }
+        if (count == MAX_FORMULAS) {
+            fprintf(stderr, "%s:%zu: too many formulas\n", input_path, line_number);
+            return 1;
+        }
+
+        ASTNode *root = ast_build_strict(source);
+        if (root == NULL) {
+            fprintf(stderr, "%s:%zu: syntax error in `%s`\n", input_path, line_number, source);
+            return 1;
+        }
+        root = ast_optimize(root, CALC_OPT_FOLD);
+        if (root->type != NODE_NUMBER) {
+            // Folding only stops at a division by zero
+            fprintf(stderr, "%s:%zu: division by zero in `%s`\n", input_path, line_number, source);
+            return 1;
+        }
+
+        names[count] = strdup(name);
+        sources[count] = strdup(source);
+        formulas[count] = root;
+        count++;
+        free(line);
+    }
+    fclose(input);
+
+    FILE *output = output_path ? fopen(output_path, "w") : stdout;
+    if (output == NULL) {
+        fprintf(stderr, "Error: Cannot open %s\n", output_path);
+        return 1;
+    }
+
+    char guard[256];
+    header_guard(output_path ? output_path : "calcgen.h", guard, sizeof(guard));
+
+    fprintf(output, "// Generated by calcgen from %s. Do not edit.\n", input_path);
+    fprintf(output, "#ifndef %s\n#define %s\n\n#include <math.h>\n", guard, guard);
+    for (size_t i = 0; i < count; i++) {
+        fprintf(output, "\n// %s = %s\n", names[i], sources[i]);
+        codegen_emit_function(output, names[i], formulas[i]);
+        ast_free(formulas[i]);
+        free(names[i]);
+        free(sources[i]);
+    }
+    fprintf(output, "\n#endif\n");
+
+    if (output != stdout) fclose(output);
+    return 0;
+}
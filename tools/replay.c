@@ -0,0 +1,160 @@
+// replay: drives the evaluator with a workload recorded by calc_capture_start.
+//
+// Expressions are issued at their recorded times, scaled by --speed, or
+// back to back with --speed 0. Latency is measured from when each
+// expression was due, so time spent queued behind a slow one counts, and
+// the report gives throughput and latency percentiles.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "calc.h"
+#include "vm.h"
+#include "capture.h"
+
+typedef struct {
+    uint64_t time_ns;
+    char *expression;
+} ReplayRecord;
+
+// A missing operand, which ALLOW_INVALID_TREE leaves as NULL
+static bool replay_has_hole(const ASTNode *node) {
+    if (node == NULL) return true;
+    switch (node->type) {
+        case NODE_BINARY_OP:
+            return replay_has_hole(node->binary.left) || replay_has_hole(node->binary.right);
+        case NODE_UNARY_OP:
+            return replay_has_hole(node->unary.operand);
+        default:
+            return false;
+    }
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Sleeps through most of the wait and spins for the last stretch, since
+// sleeps overshoot by tens of microseconds
+static void wait_until(uint64_t deadline_ns) {
+    for (;;) {
+        uint64_t now = calc_time_ns();
+        if (now >= deadline_ns) return;
+        uint64_t remaining = deadline_ns - now;
+        if (remaining > 200000) {
+            uint64_t sleep_ns = remaining - 100000;
+            struct timespec pause = {(time_t)(sleep_ns / 1000000000ULL), (long)(sleep_ns % 1000000000ULL)};
+            nanosleep(&pause, NULL);
+        }
+    }
+}
+
+static double percentile_us(const uint64_t *sorted, size_t count, double percentile) {
+    size_t rank = (size_t)(percentile / 100.0 * (double)count + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+    return (double)sorted[rank - 1] / 1000.0;
+}
+
+int main(int argc, char **argv) {
+    const char *path = NULL;
+    double speed = 1.0;
+    CalcEngine engine = CALC_ENGINE_AST;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            speed = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            if (!calc_engine_parse(argv[++i], &engine)) {
+                fprintf(stderr, "Error: Unknown engine %s\n", argv[i]);
+                return 1;
+            }
+        } else if (path == NULL) {
+            path = argv[i];
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+    if (path == NULL || speed < 0) {
+        fprintf(stderr, "Usage: %s <capture> [--speed <factor>] [--engine <name>]\n", argv[0]);
+        fprintf(stderr, "  --speed 2 replays twice as fast as recorded, --speed 0 as fast as possible\n");
+        return 1;
+    }
+
+    CaptureReader *reader = capture_open(path);
+    if (reader == NULL) {
+        fprintf(stderr, "Error: %s is not a capture log\n", path);
+        return 1;
+    }
+
+    size_t count = 0;
+    size_t capacity = 1024;
+    size_t incomplete = 0;
+    size_t division_by_zero = 0;
+    ReplayRecord *records = malloc(capacity * sizeof(ReplayRecord));
+    uint64_t time_ns;
+    const char *expression;
+    while ((expression = capture_next(reader, &time_ns)) != NULL) {
+        // Parse as the capture hook saw it, so partial trees that
+        // ALLOW_INVALID_TREE accepts are replayed too. Evaluation exits on
+        // a missing operand or a division by zero, so only those are left
+        // out.
+        ASTNode *root = ast_build(expression);
+        bool hole = replay_has_hole(root);
+        root = ast_optimize(root, CALC_OPT_FOLD);
+        bool valid = !hole && root->type == NODE_NUMBER;
+        ast_free(root);
+        if (!valid) {
+            if (hole) incomplete++;
+            else division_by_zero++;
+            continue;
+        }
+
+        if (count == capacity) {
+            capacity *= 2;
+            records = realloc(records, capacity * sizeof(ReplayRecord));
+        }
+        records[count++] = (ReplayRecord){time_ns, strdup(expression)};
+    }
+    capture_close(reader);
+    if (count == 0) {
+        fprintf(stderr, "Error: %s holds no replayable expressions\n", path);
+        return 1;
+    }
+
+    uint64_t *latencies = malloc(count * sizeof(uint64_t));
+    volatile double sink = 0;
+    uint64_t start = calc_time_ns();
+    for (size_t i = 0; i < count; i++) {
+        uint64_t due = start;
+        if (speed > 0) {
+            due += (uint64_t)((double)records[i].time_ns / speed);
+            wait_until(due);
+        } else {
+            due = calc_time_ns();
+        }
+        sink = eval_engine(records[i].expression, engine);
+        latencies[i] = calc_time_ns() - due;
+    }
+    uint64_t elapsed = calc_time_ns() - start;
+    (void)sink;
+
+    qsort(latencies, count, sizeof(uint64_t), compare_u64);
+    printf("engine      %s\n", calc_engine_name(engine));
+    printf("replayed    %zu expressions\n", count);
+    printf("skipped     %zu incomplete, %zu dividing by zero\n", incomplete, division_by_zero);
+    printf("elapsed     %.3f s\n", (double)elapsed / 1e9);
+    printf("throughput  %.1f evals/s\n", (double)count * 1e9 / (double)elapsed);
+    printf("latency us  p50 %.2f  p90 %.2f  p99 %.2f  p99.9 %.2f  max %.2f\n",
+        percentile_us(latencies, count, 50), percentile_us(latencies, count, 90), percentile_us(latencies, count, 99),
+        percentile_us(latencies, count, 99.9), (double)latencies[count - 1] / 1000.0);
+
+    for (size_t i = 0; i < count; i++) free(records[i].expression);
+    free(records);
+    free(latencies);
+    return 0;
+}